@@ -0,0 +1,961 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This analyze.c module implements --analyze: the files named on the
+ *  command line are decoded on the --jobs thread pool, and instead of
+ *  being played every frame is measured as ITU-R BS.1770-4 and EBU R128
+ *  ask: integrated loudness, loudness range, true peak and sample peak,
+ *  per track and for all tracks as an album.  The results are printed
+ *  as JSON and, with --write-replaygain, stored as REPLAYGAIN_* tags.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "flac123.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ANALYZE_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define ANALYZE_NEON
+#include <arm_neon.h>
+#endif
+
+/* the loudness is measured over 400 ms blocks, the loudness range over
+ * 3 s, both every 100 ms */
+#define SEGMENTS_PER_SECOND 10
+#define BLOCK_SEGMENTS      4
+#define SHORT_SEGMENTS      30
+
+#define ABSOLUTE_GATE  -70.0 /* LUFS */
+#define RELATIVE_GATE  -10.0 /* LU below the loudness of the blocks above */
+#define RANGE_GATE     -20.0 /* the same for the loudness range */
+
+/* ReplayGain 2.0 brings every track to this loudness */
+#define REPLAYGAIN_REFERENCE -18.0
+
+/* the true peak is looked for at 4 times the sample rate, by a
+ * Hann-windowed sinc of 12 taps per phase, where that is no more than
+ * 192 kHz.  Above 48 kHz the sample peak is close enough. */
+#define PEAK_PHASES 4
+#define PEAK_TAPS   12
+#define PEAK_RATE   192000
+
+/* the K-weighting filter: a high shelf, then a high pass whose numerator
+ * is 1, -2, 1 */
+typedef struct {
+    double b0, b1, b2, a1, a2;
+    double c1, c2;
+} kweight_coef;
+
+struct loudness {
+    unsigned rate;
+    unsigned channels;
+    float scale;             /* from samples to full scale 1.0 */
+    double weight[FLAC__MAX_CHANNELS];
+    kweight_coef k;
+    double state[FLAC__MAX_CHANNELS][4];
+    double sum[FLAC__MAX_CHANNELS]; /* K-weighted squares of this segment */
+    unsigned segment_fill;
+    unsigned segment_len;
+    unsigned segment;        /* index of the one being filled */
+    double *segments;        /* weighted mean squares of those done */
+    unsigned segment_size;
+
+    FLAC__bool true_peak;    /* not if oversampling would go past PEAK_RATE */
+    float *history[FLAC__MAX_CHANNELS]; /* PEAK_TAPS - 1 samples, then the frame */
+    unsigned history_size;
+    FLAC__uint32 sample_max; /* largest magnitude of a sample */
+    float peak_max;          /* of the oversampled signal */
+};
+
+typedef struct {
+    const char *path;
+    FLAC__bool ok;
+    FLAC__uint64 samples;
+    double seconds;
+    double *blocks, *shorts; /* energies of the 400 ms and 3 s windows */
+    unsigned nblocks, nshorts;
+    double integrated;       /* LUFS, -HUGE_VAL when silent */
+    double range;            /* LU */
+    double true_peak;        /* linear */
+    double sample_peak;
+} analyze_job;
+
+static float peak_coef[PEAK_TAPS][PEAK_PHASES];
+
+/*
+ * K-weighting of two channels at once, the sums of their squares added
+ * to sum[].  z are the filter states of the channels, x1 may be NULL for
+ * the last of an odd number.
+ */
+typedef void (*kweight_fn)(const kweight_coef *k, double *z0, double *z1,
+			   const float *x0, const float *x1, unsigned n, double sum[2]);
+
+/* the largest magnitude between the samples of x[PEAK_TAPS - 1 ...] */
+typedef float (*peak_fn)(const float *x, unsigned n, float max);
+
+static double kweight_one(const kweight_coef *k, double *z, const float *x, unsigned n)
+{
+    double sum = 0, in, y, out;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+	in = x[i];
+	y = k->b0 * in + z[0];
+	z[0] = k->b1 * in - k->a1 * y + z[1];
+	z[1] = k->b2 * in - k->a2 * y;
+	out = y + z[2];
+	z[2] = -2 * y - k->c1 * out + z[3];
+	z[3] = y - k->c2 * out;
+	sum += out * out;
+    }
+    return sum;
+}
+
+static void kweight_scalar(const kweight_coef *k, double *z0, double *z1,
+			   const float *x0, const float *x1, unsigned n, double sum[2])
+{
+    sum[0] += kweight_one(k, z0, x0, n);
+    if (x1)
+	sum[1] += kweight_one(k, z1, x1, n);
+}
+
+static float peak_scalar(const float *x, unsigned n, float max)
+{
+    float acc[PEAK_PHASES];
+    unsigned i, t, p;
+
+    for (i = 0; i < n; i++) {
+	for (p = 0; p < PEAK_PHASES; p++)
+	    acc[p] = 0;
+	for (t = 0; t < PEAK_TAPS; t++)
+	    for (p = 0; p < PEAK_PHASES; p++)
+		acc[p] += peak_coef[t][p] * x[i + t];
+	for (p = 0; p < PEAK_PHASES; p++)
+	    if (fabsf(acc[p]) > max)
+		max = fabsf(acc[p]);
+    }
+    return max;
+}
+
+static kweight_fn kweight_kernel = kweight_scalar;
+static peak_fn peak_kernel = peak_scalar;
+
+#ifdef ANALYZE_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX  __attribute__((target("avx")))
+
+SSE2 static void kweight_sse2(const kweight_coef *k, double *z0, double *z1,
+			      const float *x0, const float *x1, unsigned n, double sum[2])
+{
+    __m128d b0 = _mm_set1_pd(k->b0), b1 = _mm_set1_pd(k->b1), b2 = _mm_set1_pd(k->b2);
+    __m128d a1 = _mm_set1_pd(k->a1), a2 = _mm_set1_pd(k->a2);
+    __m128d c1 = _mm_set1_pd(k->c1), c2 = _mm_set1_pd(k->c2), two = _mm_set1_pd(2);
+    __m128d s0, s1, s2, s3, acc = _mm_setzero_pd(), in, y, out;
+    double lanes[2];
+    unsigned i;
+
+    if (!x1) {
+	kweight_scalar(k, z0, z1, x0, x1, n, sum);
+	return;
+    }
+
+    s0 = _mm_set_pd(z1[0], z0[0]);
+    s1 = _mm_set_pd(z1[1], z0[1]);
+    s2 = _mm_set_pd(z1[2], z0[2]);
+    s3 = _mm_set_pd(z1[3], z0[3]);
+
+    for (i = 0; i < n; i++) {
+	in = _mm_set_pd(x1[i], x0[i]);
+	y = _mm_add_pd(_mm_mul_pd(b0, in), s0);
+	s0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, in), _mm_mul_pd(a1, y)), s1);
+	s1 = _mm_sub_pd(_mm_mul_pd(b2, in), _mm_mul_pd(a2, y));
+	out = _mm_add_pd(y, s2);
+	s2 = _mm_add_pd(_mm_sub_pd(_mm_sub_pd(_mm_setzero_pd(), _mm_mul_pd(two, y)),
+				   _mm_mul_pd(c1, out)), s3);
+	s3 = _mm_sub_pd(y, _mm_mul_pd(c2, out));
+	acc = _mm_add_pd(acc, _mm_mul_pd(out, out));
+    }
+
+    _mm_storeu_pd(lanes, acc);
+    sum[0] += lanes[0];
+    sum[1] += lanes[1];
+    _mm_storel_pd(&z0[0], s0); _mm_storeh_pd(&z1[0], s0);
+    _mm_storel_pd(&z0[1], s1); _mm_storeh_pd(&z1[1], s1);
+    _mm_storel_pd(&z0[2], s2); _mm_storeh_pd(&z1[2], s2);
+    _mm_storel_pd(&z0[3], s3); _mm_storeh_pd(&z1[3], s3);
+}
+
+/* the four phases of an output sample are the four lanes; four samples
+ * are worked on at once to keep the adds of one from waiting on another */
+SSE2 static float peak_sse2(const float *x, unsigned n, float max)
+{
+    __m128 coef[PEAK_TAPS], a0, a1, a2, a3, top = _mm_set1_ps(max);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    float lanes[4];
+    unsigned i = 0, t;
+
+    for (t = 0; t < PEAK_TAPS; t++)
+	coef[t] = _mm_loadu_ps(peak_coef[t]);
+
+    for (; i + 4 <= n; i += 4) {
+	a0 = _mm_mul_ps(coef[0], _mm_set1_ps(x[i]));
+	a1 = _mm_mul_ps(coef[0], _mm_set1_ps(x[i + 1]));
+	a2 = _mm_mul_ps(coef[0], _mm_set1_ps(x[i + 2]));
+	a3 = _mm_mul_ps(coef[0], _mm_set1_ps(x[i + 3]));
+	for (t = 1; t < PEAK_TAPS; t++) {
+	    a0 = _mm_add_ps(a0, _mm_mul_ps(coef[t], _mm_set1_ps(x[i + t])));
+	    a1 = _mm_add_ps(a1, _mm_mul_ps(coef[t], _mm_set1_ps(x[i + t + 1])));
+	    a2 = _mm_add_ps(a2, _mm_mul_ps(coef[t], _mm_set1_ps(x[i + t + 2])));
+	    a3 = _mm_add_ps(a3, _mm_mul_ps(coef[t], _mm_set1_ps(x[i + t + 3])));
+	}
+	top = _mm_max_ps(top, _mm_max_ps(_mm_max_ps(_mm_andnot_ps(sign, a0),
+						    _mm_andnot_ps(sign, a1)),
+					 _mm_max_ps(_mm_andnot_ps(sign, a2),
+						    _mm_andnot_ps(sign, a3))));
+    }
+    for (; i < n; i++) {
+	a0 = _mm_mul_ps(coef[0], _mm_set1_ps(x[i]));
+	for (t = 1; t < PEAK_TAPS; t++)
+	    a0 = _mm_add_ps(a0, _mm_mul_ps(coef[t], _mm_set1_ps(x[i + t])));
+	top = _mm_max_ps(top, _mm_andnot_ps(sign, a0));
+    }
+
+    top = _mm_max_ps(top, _mm_movehl_ps(top, top));
+    top = _mm_max_ss(top, _mm_shuffle_ps(top, top, 1));
+    _mm_storeu_ps(lanes, top);
+    return lanes[0];
+}
+
+/* eight samples in the lanes, each phase a vector of its own */
+AVX static float peak_avx(const float *x, unsigned n, float max)
+{
+    __m256 a0, a1, a2, a3, in, top = _mm256_set1_ps(max), sign = _mm256_set1_ps(-0.0f);
+    __m128 lo;
+    unsigned i = 0, t;
+
+    for (; i + 8 <= n; i += 8) {
+	in = _mm256_loadu_ps(x + i);
+	a0 = _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[0][0]), in);
+	a1 = _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[0][1]), in);
+	a2 = _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[0][2]), in);
+	a3 = _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[0][3]), in);
+	for (t = 1; t < PEAK_TAPS; t++) {
+	    in = _mm256_loadu_ps(x + i + t);
+	    a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[t][0]), in));
+	    a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[t][1]), in));
+	    a2 = _mm256_add_ps(a2, _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[t][2]), in));
+	    a3 = _mm256_add_ps(a3, _mm256_mul_ps(_mm256_broadcast_ss(&peak_coef[t][3]), in));
+	}
+	top = _mm256_max_ps(top, _mm256_max_ps(_mm256_max_ps(_mm256_andnot_ps(sign, a0),
+							     _mm256_andnot_ps(sign, a1)),
+					       _mm256_max_ps(_mm256_andnot_ps(sign, a2),
+							     _mm256_andnot_ps(sign, a3))));
+    }
+
+    lo = _mm_max_ps(_mm256_castps256_ps128(top), _mm256_extractf128_ps(top, 1));
+    lo = _mm_max_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_max_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return peak_sse2(x + i, n - i, _mm_cvtss_f32(lo));
+}
+
+#endif /* ANALYZE_X86 */
+
+#ifdef ANALYZE_NEON
+
+static void kweight_neon(const kweight_coef *k, double *z0, double *z1,
+			 const float *x0, const float *x1, unsigned n, double sum[2])
+{
+    float64x2_t b0 = vdupq_n_f64(k->b0), b1 = vdupq_n_f64(k->b1), b2 = vdupq_n_f64(k->b2);
+    float64x2_t a1 = vdupq_n_f64(k->a1), a2 = vdupq_n_f64(k->a2);
+    float64x2_t c1 = vdupq_n_f64(k->c1), c2 = vdupq_n_f64(k->c2), two = vdupq_n_f64(2);
+    float64x2_t s[4], acc = vdupq_n_f64(0), in, y, out;
+    unsigned i;
+
+    if (!x1) {
+	kweight_scalar(k, z0, z1, x0, x1, n, sum);
+	return;
+    }
+
+    for (i = 0; i < 4; i++)
+	s[i] = vsetq_lane_f64(z1[i], vdupq_n_f64(z0[i]), 1);
+
+    for (i = 0; i < n; i++) {
+	in = vsetq_lane_f64(x1[i], vdupq_n_f64(x0[i]), 1);
+	y = vaddq_f64(vmulq_f64(b0, in), s[0]);
+	s[0] = vaddq_f64(vsubq_f64(vmulq_f64(b1, in), vmulq_f64(a1, y)), s[1]);
+	s[1] = vsubq_f64(vmulq_f64(b2, in), vmulq_f64(a2, y));
+	out = vaddq_f64(y, s[2]);
+	s[2] = vaddq_f64(vsubq_f64(vnegq_f64(vmulq_f64(two, y)), vmulq_f64(c1, out)), s[3]);
+	s[3] = vsubq_f64(y, vmulq_f64(c2, out));
+	acc = vaddq_f64(acc, vmulq_f64(out, out));
+    }
+
+    sum[0] += vgetq_lane_f64(acc, 0);
+    sum[1] += vgetq_lane_f64(acc, 1);
+    for (i = 0; i < 4; i++) {
+	z0[i] = vgetq_lane_f64(s[i], 0);
+	z1[i] = vgetq_lane_f64(s[i], 1);
+    }
+}
+
+static float peak_neon(const float *x, unsigned n, float max)
+{
+    float32x4_t coef[PEAK_TAPS], a0, a1, a2, a3, top = vdupq_n_f32(max);
+    unsigned i = 0, t;
+
+    for (t = 0; t < PEAK_TAPS; t++)
+	coef[t] = vld1q_f32(peak_coef[t]);
+
+    for (; i + 4 <= n; i += 4) {
+	a0 = vmulq_n_f32(coef[0], x[i]);
+	a1 = vmulq_n_f32(coef[0], x[i + 1]);
+	a2 = vmulq_n_f32(coef[0], x[i + 2]);
+	a3 = vmulq_n_f32(coef[0], x[i + 3]);
+	for (t = 1; t < PEAK_TAPS; t++) {
+	    a0 = vaddq_f32(a0, vmulq_n_f32(coef[t], x[i + t]));
+	    a1 = vaddq_f32(a1, vmulq_n_f32(coef[t], x[i + t + 1]));
+	    a2 = vaddq_f32(a2, vmulq_n_f32(coef[t], x[i + t + 2]));
+	    a3 = vaddq_f32(a3, vmulq_n_f32(coef[t], x[i + t + 3]));
+	}
+	top = vmaxq_f32(top, vmaxq_f32(vmaxq_f32(vabsq_f32(a0), vabsq_f32(a1)),
+				       vmaxq_f32(vabsq_f32(a2), vabsq_f32(a3))));
+    }
+    for (; i < n; i++) {
+	a0 = vmulq_n_f32(coef[0], x[i]);
+	for (t = 1; t < PEAK_TAPS; t++)
+	    a0 = vaddq_f32(a0, vmulq_n_f32(coef[t], x[i + t]));
+	top = vmaxq_f32(top, vabsq_f32(a0));
+    }
+    return vmaxvq_f32(top);
+}
+
+#endif /* ANALYZE_NEON */
+
+/* tabulate the true peak filter and pick the kernels this cpu can run */
+static void analyze_init(void)
+{
+    double d, w, sum;
+    unsigned t, p;
+
+    /* phase p lies p/4 of the way from x[5] to x[6], phase 0 on x[5] */
+    for (p = 0; p < PEAK_PHASES; p++) {
+	for (sum = 0, t = 0; t < PEAK_TAPS; t++) {
+	    d = (double) t - (PEAK_TAPS / 2 - 1) - (double) p / PEAK_PHASES;
+	    w = 0.5 + 0.5 * cos(M_PI * d / (PEAK_TAPS / 2));
+	    sum += peak_coef[t][p] = (d == 0 ? 1 : sin(M_PI * d) / (M_PI * d)) * w;
+	}
+	for (t = 0; t < PEAK_TAPS; t++)
+	    peak_coef[t][p] /= sum;
+    }
+
+#ifdef ANALYZE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+	kweight_kernel = kweight_sse2;
+	peak_kernel = peak_sse2;
+    }
+    if (__builtin_cpu_supports("avx"))
+	peak_kernel = peak_avx;
+#endif
+#ifdef ANALYZE_NEON
+    kweight_kernel = kweight_neon;
+    peak_kernel = peak_neon;
+#endif
+}
+
+/* BS.1770 weights by FLAC channel order: the surround channels at the
+ * sides count 1.41 times, LFE not at all */
+static void channel_weights(double *weight, unsigned channels)
+{
+    unsigned i;
+
+    for (i = 0; i < channels; i++)
+	weight[i] = 1.0;
+
+    switch (channels) {
+    case 4:                  /* L R BL BR */
+	weight[2] = weight[3] = 1.41;
+	break;
+    case 5:                  /* L R C BL BR */
+	weight[3] = weight[4] = 1.41;
+	break;
+    case 6:                  /* L R C LFE BL BR */
+	weight[3] = 0;
+	weight[4] = weight[5] = 1.41;
+	break;
+    case 7:                  /* L R C LFE BC SL SR */
+    case 8:                  /* L R C LFE BL BR SL SR */
+	weight[3] = 0;
+	weight[channels - 2] = weight[channels - 1] = 1.41;
+	break;
+    }
+}
+
+/* the K-weighting filter of BS.1770 for any sample rate */
+static void kweight_design(kweight_coef *k, unsigned rate)
+{
+    double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+    double kk = tan(M_PI * f0 / rate);
+    double vh = pow(10.0, gain / 20), vb = pow(vh, 0.4996667741545416);
+    double a0 = 1 + kk / q + kk * kk;
+
+    k->b0 = (vh + vb * kk / q + kk * kk) / a0;
+    k->b1 = 2 * (kk * kk - vh) / a0;
+    k->b2 = (vh - vb * kk / q + kk * kk) / a0;
+    k->a1 = 2 * (kk * kk - 1) / a0;
+    k->a2 = (1 - kk / q + kk * kk) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    kk = tan(M_PI * f0 / rate);
+    a0 = 1 + kk / q + kk * kk;
+    k->c1 = 2 * (kk * kk - 1) / a0;
+    k->c2 = (1 - kk / q + kk * kk) / a0;
+}
+
+static void loudness_free(loudness *l)
+{
+    unsigned c;
+
+    if (!l)
+	return;
+    for (c = 0; c < l->channels; c++)
+	free(l->history[c]);
+    free(l->segments);
+    free(l);
+}
+
+/* samples in segment i, whose boundaries are rounded down */
+static unsigned segment_length(unsigned rate, unsigned i)
+{
+    return (FLAC__uint64) (i + 1) * rate / SEGMENTS_PER_SECOND -
+	(FLAC__uint64) i * rate / SEGMENTS_PER_SECOND;
+}
+
+static FLAC__bool history_reserve(loudness *l, unsigned samples)
+{
+    unsigned c, size = PEAK_TAPS - 1 + samples;
+    float *grown;
+
+    if (size <= l->history_size)
+	return true;
+    for (c = 0; c < l->channels; c++) {
+	if (!(grown = realloc(l->history[c], size * sizeof(float))))
+	    return false;
+	if (!l->history_size)
+	    memset(grown, 0, (PEAK_TAPS - 1) * sizeof(float));
+	l->history[c] = grown;
+    }
+    l->history_size = size;
+    return true;
+}
+
+static loudness *loudness_new(unsigned rate, unsigned channels, unsigned bits, unsigned max_block)
+{
+    loudness *l = calloc(1, sizeof(loudness));
+
+    if (!l)
+	return NULL;
+    l->rate = rate;
+    l->channels = channels;
+    l->scale = ldexpf(1.0f, 1 - (int) bits);
+    channel_weights(l->weight, channels);
+    kweight_design(&l->k, rate);
+    l->segment_len = segment_length(rate, 0);
+    l->true_peak = rate <= PEAK_RATE / PEAK_PHASES;
+
+    if (rate < SEGMENTS_PER_SECOND || !history_reserve(l, max_block ? max_block : 4096)) {
+	loudness_free(l);
+	return NULL;
+    }
+    return l;
+}
+
+/* measure one frame of p, its sample_fn instead of playing it */
+static FLAC__bool loudness_frame(file_info_struct *p, const FLAC__int32 * const buf[],
+				 unsigned samples)
+{
+    loudness *l = p->loudness;
+    unsigned c, i, done, take;
+    FLAC__uint32 max = l->sample_max, magnitude;
+    double sum[2], energy, *grown;
+    float *x;
+
+    if (!history_reserve(l, samples))
+	return false;
+
+    for (c = 0; c < l->channels; c++) {
+	x = l->history[c] + PEAK_TAPS - 1;
+	for (i = 0; i < samples; i++) {
+	    magnitude = buf[c][i] < 0 ? -(FLAC__uint32) buf[c][i] : (FLAC__uint32) buf[c][i];
+	    if (magnitude > max)
+		max = magnitude;
+	    x[i] = buf[c][i] * l->scale;
+	}
+	if (l->true_peak)
+	    l->peak_max = peak_kernel(l->history[c], samples, l->peak_max);
+    }
+    l->sample_max = max;
+
+    /* the K-weighted squares, cut into 100 ms segments */
+    for (done = 0; done < samples; done += take) {
+	take = samples - done;
+	if (take > l->segment_len - l->segment_fill)
+	    take = l->segment_len - l->segment_fill;
+
+	for (c = 0; c < l->channels; c += 2) {
+	    sum[0] = l->sum[c];
+	    sum[1] = c + 1 < l->channels ? l->sum[c + 1] : 0;
+	    kweight_kernel(&l->k, l->state[c], c + 1 < l->channels ? l->state[c + 1] : NULL,
+			   l->history[c] + PEAK_TAPS - 1 + done,
+			   c + 1 < l->channels ? l->history[c + 1] + PEAK_TAPS - 1 + done : NULL,
+			   take, sum);
+	    l->sum[c] = sum[0];
+	    if (c + 1 < l->channels)
+		l->sum[c + 1] = sum[1];
+	}
+
+	if ((l->segment_fill += take) < l->segment_len)
+	    continue;
+
+	for (energy = 0, c = 0; c < l->channels; c++) {
+	    energy += l->weight[c] * l->sum[c];
+	    l->sum[c] = 0;
+	}
+	if (l->segment == l->segment_size) {
+	    if (!(grown = realloc(l->segments, (l->segment_size ? 2 * l->segment_size : 1024) *
+				  sizeof(double))))
+		return false;
+	    l->segments = grown;
+	    l->segment_size = l->segment_size ? 2 * l->segment_size : 1024;
+	}
+	l->segments[l->segment++] = energy / l->segment_len;
+	l->segment_fill = 0;
+	l->segment_len = segment_length(l->rate, l->segment);
+    }
+
+    for (c = 0; c < l->channels; c++)
+	memmove(l->history[c], l->history[c] + samples, (PEAK_TAPS - 1) * sizeof(float));
+
+    return true;
+}
+
+/* the mean energies of every window of span segments, one segment apart */
+static double *windows(const loudness *l, unsigned span, unsigned *count)
+{
+    double *w, sum = 0;
+    unsigned i;
+
+    *count = l->segment >= span ? l->segment - span + 1 : 0;
+    if (!(w = malloc((*count ? *count : 1) * sizeof(double))))
+	return NULL;
+
+    for (i = 0; i < l->segment; i++) {
+	sum += l->segments[i];
+	if (i >= span)
+	    sum -= l->segments[i - span];
+	if (i + 1 >= span)
+	    w[i + 1 - span] = (sum > 0 ? sum : 0) / span;
+    }
+    return w;
+}
+
+static double lufs(double energy)
+{
+    return energy > 0 ? -0.691 + 10 * log10(energy) : -HUGE_VAL;
+}
+
+static double energy_of(double lufs)
+{
+    return pow(10.0, (lufs + 0.691) / 10);
+}
+
+/* the mean energy of e[] above gate and then above its own mean plus
+ * relative, in LU; -HUGE_VAL if nothing is above the gates */
+static double gated_mean(const double *e, unsigned n, double relative, double *above)
+{
+    double sum = 0, gate = energy_of(ABSOLUTE_GATE);
+    unsigned i, count = 0;
+
+    for (i = 0; i < n; i++)
+	if (e[i] > gate)
+	    sum += e[i], count++;
+    if (!count)
+	return 0;
+
+    *above = sum / count * pow(10.0, relative / 10);
+    if (*above < gate)
+	*above = gate;
+    return sum / count;
+}
+
+static double integrated(const double *e, unsigned n)
+{
+    double sum = 0, gate;
+    unsigned i, count = 0;
+
+    if (!gated_mean(e, n, RELATIVE_GATE, &gate))
+	return -HUGE_VAL;
+    for (i = 0; i < n; i++)
+	if (e[i] > gate)
+	    sum += e[i], count++;
+    return count ? lufs(sum / count) : -HUGE_VAL;
+}
+
+static int by_energy(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* EBU Tech 3342: from the 10th to the 95th percentile of the short-term
+ * loudness above the gates */
+static double loudness_range(const double *e, unsigned n)
+{
+    double gate, range = 0, *above;
+    unsigned i, count = 0;
+
+    if (!gated_mean(e, n, RANGE_GATE, &gate) || !(above = malloc(n * sizeof(double))))
+	return 0;
+    for (i = 0; i < n; i++)
+	if (e[i] > gate)
+	    above[count++] = e[i];
+
+    if (count >= 2) {
+	qsort(above, count, sizeof(double), by_energy);
+	range = lufs(above[(unsigned) ((count - 1) * 0.95 + 0.5)]) -
+	    lufs(above[(unsigned) ((count - 1) * 0.10 + 0.5)]);
+    }
+    free(above);
+    return range;
+}
+
+static void analyze_job_run(void *arg)
+{
+    analyze_job *job = (analyze_job *) arg;
+    file_info_struct *p;
+    loudness *l;
+    FLAC__bool ok;
+
+    if (!(p = calloc(1, sizeof(file_info_struct))))
+	return;
+
+    if (!decoder_open(p, job->path)) {
+	fprintf(stderr, "Error opening %s\n", job->path);
+	free(p);
+	return;
+    }
+
+    if (!(p->loudness = l = loudness_new(p->ao_fmt.rate, p->ao_fmt.channels,
+					 p->sam_fmt.bits, p->max_blocksize)))
+    {
+	fprintf(stderr, "Error analyzing %s\n", job->path);
+	decoder_close(p);
+	free(p);
+	return;
+    }
+    p->sample_fn = loudness_frame;
+
+    while ((ok = FLAC__stream_decoder_process_single(p->decoder)) &&
+	   FLAC__stream_decoder_get_state(p->decoder) < FLAC__STREAM_DECODER_END_OF_STREAM)
+    {
+    }
+
+    if (!ok)
+	fprintf(stderr, "Error decoding %s: %s\n", job->path,
+		FLAC__stream_decoder_get_resolved_state_string(p->decoder));
+    else if (!(ok = FLAC__stream_decoder_finish(p->decoder)))
+	fprintf(stderr, "Error decoding %s: MD5 mismatch\n", job->path);
+
+    if (ok) {
+	job->samples = p->current_sample;
+	job->seconds = (double) p->current_sample / l->rate;
+	job->blocks = windows(l, BLOCK_SEGMENTS, &job->nblocks);
+	job->shorts = windows(l, SHORT_SEGMENTS, &job->nshorts);
+	job->sample_peak = (double) l->sample_max * l->scale;
+	job->true_peak = l->peak_max > job->sample_peak ? l->peak_max : job->sample_peak;
+	if ((ok = job->blocks && job->shorts)) {
+	    job->integrated = integrated(job->blocks, job->nblocks);
+	    job->range = loudness_range(job->shorts, job->nshorts);
+	}
+    }
+    job->ok = ok;
+
+    p->loudness = NULL;
+    loudness_free(l);
+    decoder_close(p);
+    free(p->aobuf);
+    free(p->noise);
+    free(p);
+}
+
+static void print_db(const char *name, double linear)
+{
+    if (linear > 0)
+	printf(",\"%s\":%.2f", name, 20 * log10(linear));
+    else
+	printf(",\"%s\":null", name);
+}
+
+static void print_result(const analyze_job *r)
+{
+    if (isinf(r->integrated)) {
+	printf(",\"integrated_lufs\":null,\"range_lu\":%.2f", r->range);
+    } else {
+	printf(",\"integrated_lufs\":%.2f,\"range_lu\":%.2f", r->integrated, r->range);
+    }
+    print_db("true_peak_dbtp", r->true_peak);
+    print_db("sample_peak_dbfs", r->sample_peak);
+    if (isinf(r->integrated))
+	printf(",\"replaygain_gain_db\":null");
+    else
+	printf(",\"replaygain_gain_db\":%.2f", REPLAYGAIN_REFERENCE - r->integrated);
+    printf(",\"replaygain_peak\":%.6f}\n", r->true_peak);
+}
+
+/* replace the REPLAYGAIN_* tags of job->path */
+static FLAC__bool analyze_tag(const analyze_job *job, const analyze_job *album)
+{
+    static const char *names[4] = {
+	"REPLAYGAIN_TRACK_GAIN", "REPLAYGAIN_TRACK_PEAK",
+	"REPLAYGAIN_ALBUM_GAIN", "REPLAYGAIN_ALBUM_PEAK"
+    };
+    FLAC__Metadata_Chain *chain = FLAC__metadata_chain_new();
+    FLAC__Metadata_Iterator *it = FLAC__metadata_iterator_new();
+    FLAC__StreamMetadata *vc = NULL;
+    FLAC__StreamMetadata_VorbisComment_Entry entry;
+    char values[4][32];
+    FLAC__bool ok = false;
+    unsigned i;
+
+    snprintf(values[0], sizeof(values[0]), "%+.2f dB", REPLAYGAIN_REFERENCE - job->integrated);
+    snprintf(values[1], sizeof(values[1]), "%.6f", job->true_peak);
+    snprintf(values[2], sizeof(values[2]), "%+.2f dB", REPLAYGAIN_REFERENCE - album->integrated);
+    snprintf(values[3], sizeof(values[3]), "%.6f", album->true_peak);
+
+    if (chain && it && FLAC__metadata_chain_read(chain, job->path)) {
+	FLAC__metadata_iterator_init(it, chain);
+	do {
+	    if (FLAC__metadata_iterator_get_block_type(it) == FLAC__METADATA_TYPE_VORBIS_COMMENT)
+		vc = FLAC__metadata_iterator_get_block(it);
+	} while (!vc && FLAC__metadata_iterator_next(it));
+
+	/* a file without tags gets them after STREAMINFO */
+	if (!vc && (vc = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT))) {
+	    FLAC__metadata_iterator_init(it, chain);
+	    if (!FLAC__metadata_iterator_insert_block_after(it, vc)) {
+		FLAC__metadata_object_delete(vc);
+		vc = NULL;
+	    }
+	}
+
+	for (ok = vc != NULL, i = 0; ok && i < 4; i++) {
+	    ok = FLAC__metadata_object_vorbiscomment_remove_entries_matching(vc, names[i]) >= 0 &&
+		FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry, names[i],
+									       values[i]) &&
+		FLAC__metadata_object_vorbiscomment_append_comment(vc, entry, /*copy=*/false);
+	}
+	if (ok) {
+	    FLAC__metadata_chain_sort_padding(chain);
+	    ok = FLAC__metadata_chain_write(chain, /*use_padding=*/true,
+					    /*preserve_file_stats=*/false);
+	}
+    }
+
+    if (!ok)
+	fprintf(stderr, "Error writing the ReplayGain tags of %s: %s\n", job->path,
+		chain ? FLAC__Metadata_ChainStatusString[FLAC__metadata_chain_status(chain)] :
+		"out of memory");
+    if (it)
+	FLAC__metadata_iterator_delete(it);
+    if (chain)
+	FLAC__metadata_chain_delete(chain);
+    return ok;
+}
+
+typedef struct {
+    analyze_job *job;
+    const analyze_job *album;
+    FLAC__bool ok;
+} analyze_tag_job;
+
+static void analyze_tag_run(void *arg)
+{
+    analyze_tag_job *t = (analyze_tag_job *) arg;
+
+    t->ok = analyze_tag(t->job, t->album);
+}
+
+/* the blocks of all tracks gated together, and the largest peaks */
+static FLAC__bool analyze_album(analyze_job *album, const analyze_job *jobs, unsigned count)
+{
+    unsigned i, nblocks = 0, nshorts = 0;
+    double *blocks, *shorts;
+
+    for (i = 0; i < count; i++) {
+	if (!jobs[i].ok)
+	    continue;
+	nblocks += jobs[i].nblocks;
+	nshorts += jobs[i].nshorts;
+    }
+    blocks = malloc((nblocks ? nblocks : 1) * sizeof(double));
+    shorts = malloc((nshorts ? nshorts : 1) * sizeof(double));
+    if (!blocks || !shorts) {
+	free(blocks);
+	free(shorts);
+	return false;
+    }
+
+    for (i = 0; i < count; i++) {
+	if (!jobs[i].ok)
+	    continue;
+	memcpy(blocks + album->nblocks, jobs[i].blocks, jobs[i].nblocks * sizeof(double));
+	memcpy(shorts + album->nshorts, jobs[i].shorts, jobs[i].nshorts * sizeof(double));
+	album->nblocks += jobs[i].nblocks;
+	album->nshorts += jobs[i].nshorts;
+	album->samples += jobs[i].samples;
+	album->seconds += jobs[i].seconds;
+	if (jobs[i].true_peak > album->true_peak)
+	    album->true_peak = jobs[i].true_peak;
+	if (jobs[i].sample_peak > album->sample_peak)
+	    album->sample_peak = jobs[i].sample_peak;
+    }
+
+    album->integrated = integrated(blocks, nblocks);
+    album->range = loudness_range(shorts, nshorts);
+    album->ok = true;
+    free(blocks);
+    free(shorts);
+    return true;
+}
+
+/* measure files[] and print the results, returns the number of failures */
+int analyze_run(const char **files, unsigned count)
+{
+    analyze_job *jobs, album;
+    analyze_tag_job *tags = NULL;
+    thread_pool *pool;
+    unsigned threads = cli_args.jobs > 0 ? (unsigned) cli_args.jobs : pool_cpus();
+    unsigned i, done = 0, failed = 0;
+    struct timespec start, end;
+    double elapsed;
+
+    if (count == 0)
+	return 0;
+
+    memset(&album, 0, sizeof(album));
+    if (!(jobs = calloc(count, sizeof(analyze_job)))) {
+	fprintf(stderr, "Out of memory\n");
+	return count;
+    }
+    analyze_init();
+
+    if (threads > count)
+	threads = count;
+    if (!(pool = pool_new(threads))) {
+	fprintf(stderr, "Error starting decoder threads\n");
+	threads = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+	jobs[i].path = files[i];
+	if (pool)
+	    pool_submit(pool, analyze_job_run, &jobs[i]);
+	else
+	    analyze_job_run(&jobs[i]);
+    }
+    if (pool)
+	pool_wait(pool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (i = 0; i < count; i++) {
+	printf("{\"path\":");
+	json_string(stdout, jobs[i].path);
+	if (!jobs[i].ok) {
+	    printf(",\"error\":\"not analyzed\"}\n");
+	    failed++;
+	    continue;
+	}
+	printf(",\"samples\":%llu", (unsigned long long) jobs[i].samples);
+	print_result(&jobs[i]);
+	done++;
+    }
+
+    if (done && analyze_album(&album, jobs, count)) {
+	printf("{\"album\":%u,\"samples\":%llu", done, (unsigned long long) album.samples);
+	print_result(&album);
+    }
+
+    if (cli_args.write_replaygain) {
+	/* the album gain would be wrong for all of them */
+	if (failed || !album.ok)
+	    fprintf(stderr, "Not writing ReplayGain tags, not every file was analyzed\n");
+	else if (isinf(album.integrated))
+	    fprintf(stderr, "Not writing ReplayGain tags, the album is silent\n");
+	else if (!(tags = calloc(count, sizeof(analyze_tag_job))))
+	    fprintf(stderr, "Out of memory\n");
+    }
+
+    if (tags) {
+	for (i = 0; i < count; i++) {
+	    tags[i].job = &jobs[i];
+	    tags[i].album = &album;
+	    if (isinf(jobs[i].integrated)) {
+		fprintf(stderr, "Not tagging %s, it is silent\n", jobs[i].path);
+		tags[i].ok = true;
+	    } else if (pool) {
+		pool_submit(pool, analyze_tag_run, &tags[i]);
+	    } else {
+		analyze_tag_run(&tags[i]);
+	    }
+	}
+	if (pool)
+	    pool_wait(pool);
+	for (i = 0; i < count; i++)
+	    if (!tags[i].ok)
+		failed++;
+	free(tags);
+    }
+
+    if (pool)
+	pool_free(pool);
+
+    if (!cli_args.quiet && album.ok) {
+	if (elapsed <= 0)
+	    elapsed = 1e-9;
+	fprintf(stderr, "Analyzed %u of %u files on %u threads in %.2f seconds, %.1fx realtime\n",
+		done, count, threads ? threads : 1, elapsed, album.seconds / elapsed);
+    }
+
+    for (i = 0; i < count; i++) {
+	free(jobs[i].blocks);
+	free(jobs[i].shorts);
+    }
+    free(jobs);
+
+    return failed;
+}
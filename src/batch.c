@@ -0,0 +1,251 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This batch.c module implements --outdir: instead of being played, all
+ *  the files named on the command line are decoded into wav (or raw)
+ *  files, several at a time.  Every job has a decoder, conversion buffers
+ *  and output file of its own; the jobs are spread over a work-stealing
+ *  pool of --jobs threads.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "flac123.h"
+
+typedef struct {
+    const char *input;
+    char *output;
+    FLAC__uint64 input_size;
+    FLAC__uint64 samples;    /* per channel, as decoded */
+    FLAC__uint64 output_size; /* PCM bytes, without the wav header */
+    double seconds;          /* of audio */
+    FLAC__bool skip;         /* output name taken by an earlier job */
+    FLAC__bool ok;
+} batch_job;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* DIR/name.wav for DIR/../name.flac */
+static char *batch_output_name(const char *input)
+{
+    const char *base = strrchr(input, '/') ? strrchr(input, '/') + 1 : input;
+    const char *dot = strrchr(base, '.');
+    int len = dot && dot != base ? (int) (dot - base) : (int) strlen(base);
+    char *output = malloc(strlen(cli_args.outdir) + len + 6);
+
+    if (output)
+	sprintf(output, "%s/%.*s%s", cli_args.outdir, len, base,
+		cli_args.raw ? ".raw" : ".wav");
+    return output;
+}
+
+static void batch_job_run(void *arg)
+{
+    batch_job *job = (batch_job *) arg;
+    file_info_struct *p;
+    FLAC__bool ok;
+
+    if (!(p = calloc(1, sizeof(file_info_struct)))) {
+	fprintf(stderr, "Out of memory\n");
+	return;
+    }
+
+    p->pcm_fn = output_pcm;
+    if (!decoder_open(p, job->input)) {
+	fprintf(stderr, "Error opening %s\n", job->input);
+	free(p);
+	return;
+    }
+
+    if (!(p->writer = writer_open(job->output, writer_type(), output_format(p)))) {
+	decoder_close(p);
+	free(p->aobuf);
+	free(p->noise);
+	free(p);
+	return;
+    }
+
+    /* seeking to --start may write out the first frame already */
+    if (!clip_apply(p)) {
+	decoder_close(p);
+	writer_close(p->writer);
+	unlink(job->output);
+	free(p->aobuf);
+	free(p->noise);
+	free(p);
+	return;
+    }
+
+    while ((ok = FLAC__stream_decoder_process_single(p->decoder)) &&
+	   FLAC__stream_decoder_get_state(p->decoder) < FLAC__STREAM_DECODER_END_OF_STREAM &&
+	   !clip_done(p))
+    {
+    }
+
+    if (!ok)
+	fprintf(stderr, "Error decoding %s: %s\n", job->input,
+		FLAC__stream_decoder_get_resolved_state_string(p->decoder));
+    /* finishing compares the MD5 of the decoded audio with STREAMINFO,
+     * which a --start or --end clip is not all of */
+    else if (!p->start_sample && !p->end_sample &&
+	     !(ok = FLAC__stream_decoder_finish(p->decoder)))
+	fprintf(stderr, "Error decoding %s: MD5 mismatch\n", job->input);
+
+    job->samples = p->current_sample - p->start_sample;
+    job->output_size = (FLAC__uint64) job->samples * output_format(p)->rate /
+	p->ao_fmt.rate * output_format(p)->channels * (output_format(p)->bits / 8);
+    job->seconds = p->ao_fmt.rate ? (double) job->samples / p->ao_fmt.rate : 0;
+    job->ok = ok;
+
+    decoder_close(p);
+    if (!writer_close(p->writer))
+	ok = job->ok = false;
+
+    if (!ok)
+	unlink(job->output);
+
+    free(p->aobuf);
+    free(p->noise);
+    free(p);
+}
+
+static int by_output(const void *a, const void *b)
+{
+    const batch_job *x = *(const batch_job * const *) a;
+    const batch_job *y = *(const batch_job * const *) b;
+    int c = strcmp(x->output, y->output);
+
+    return c ? c : (x < y ? -1 : x > y);
+}
+
+static int by_size(const void *a, const void *b)
+{
+    const batch_job *x = *(const batch_job * const *) a;
+    const batch_job *y = *(const batch_job * const *) b;
+
+    return x->input_size < y->input_size ? -1 : x->input_size > y->input_size;
+}
+
+/* decode files[] into cli_args.outdir, returns the number of failures */
+int batch_run(const char **files, unsigned count)
+{
+    batch_job *jobs, **order;
+    thread_pool *pool;
+    unsigned threads = cli_args.jobs > 0 ? (unsigned) cli_args.jobs : pool_cpus();
+    unsigned i, done = 0;
+    FLAC__uint64 samples = 0, in_bytes = 0, out_bytes = 0;
+    double audio = 0, start, elapsed;
+    struct stat st;
+
+    if (count == 0)
+	return 0;
+
+    jobs = calloc(count, sizeof(batch_job));
+    order = malloc(count * sizeof(batch_job *));
+    if (!jobs || !order) {
+	fprintf(stderr, "Out of memory\n");
+	free(jobs);
+	free(order);
+	return count;
+    }
+
+    for (i = 0; i < count; i++) {
+	jobs[i].input = files[i];
+	if (!(jobs[i].output = batch_output_name(files[i])))
+	    jobs[i].skip = true;
+	else if (stat(files[i], &st) == 0)
+	    jobs[i].input_size = st.st_size;
+	order[i] = &jobs[i];
+    }
+
+    /* two inputs of the same name would write the same output */
+    qsort(order, count, sizeof(batch_job *), by_output);
+    for (i = 1; i < count; i++) {
+	if (order[i]->output && order[i - 1]->output &&
+	    strcmp(order[i]->output, order[i - 1]->output) == 0)
+	{
+	    fprintf(stderr, "Skipping %s, %s is already written for %s\n",
+		    order[i]->input, order[i]->output, order[i - 1]->input);
+	    order[i]->skip = true;
+	}
+    }
+
+    if (threads > count)
+	threads = count;
+    if (!(pool = pool_new(threads))) {
+	fprintf(stderr, "Error starting decoder threads\n");
+	threads = 0;
+    }
+
+    /* the smallest files go first: a worker takes the newest task of its
+     * own, so it starts on its biggest file and the short ones are left to
+     * be stolen at the end */
+    qsort(order, count, sizeof(batch_job *), by_size);
+
+    start = now();
+    for (i = 0; i < count; i++) {
+	if (order[i]->skip)
+	    continue;
+	if (pool)
+	    pool_submit(pool, batch_job_run, order[i]);
+	else
+	    batch_job_run(order[i]);
+    }
+    if (pool) {
+	pool_wait(pool);
+	pool_free(pool);
+    }
+    elapsed = now() - start;
+
+    for (i = 0; i < count; i++) {
+	if (!jobs[i].ok)
+	    continue;
+	done++;
+	samples += jobs[i].samples;
+	audio += jobs[i].seconds;
+	in_bytes += jobs[i].input_size;
+	out_bytes += jobs[i].output_size;
+    }
+
+    if (!cli_args.quiet) {
+	if (elapsed <= 0)
+	    elapsed = 1e-9;
+	printf("Decoded %u of %u files on %u threads in %.2f seconds\n",
+	       done, count, threads ? threads : 1, elapsed);
+	printf("%.1f seconds of audio, %.1fx realtime, %.2f Msamples/s, "
+	       "%.1f MB/s read, %.1f MB/s written\n",
+	       audio, audio / elapsed, samples / elapsed / 1e6,
+	       in_bytes / elapsed / 1e6, out_bytes / elapsed / 1e6);
+    }
+
+    for (i = 0; i < count; i++)
+	free(jobs[i].output);
+    free(jobs);
+    free(order);
+
+    return count - done;
+}
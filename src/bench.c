@@ -0,0 +1,348 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This bench.c module implements --bench: a corpus of FLAC files is
+ *  encoded from a synthetic signal with libFLAC, the same bytes on every
+ *  run, and every file is decoded through decoder_constructor() and
+ *  flac_write_hdl() into libao's null driver.  The figures are printed as
+ *  one JSON object per line, so that runs of two versions can be diffed.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "flac123.h"
+#include "version.h"
+
+/* seconds of audio in every generated file */
+#define BENCH_SECONDS 20
+
+/* every file is decoded this often, the fastest run counts */
+#define BENCH_RUNS 3
+
+/* random seeks timed per file */
+#define BENCH_SEEKS 64
+
+/* samples per channel handed to the encoder at once */
+#define BENCH_CHUNK 4096
+
+typedef struct {
+    unsigned bits;
+    unsigned channels;
+    unsigned rate;
+    unsigned blocksize;
+    FLAC__bool seektable;
+} bench_case;
+
+static const bench_case bench_cases[] = {
+    {  8, 1, 44100, 4096, true },
+    {  8, 2, 44100, 4096, true },
+    { 16, 1, 44100, 4096, true },
+    { 16, 2, 44100, 4096, true },
+    { 16, 2, 44100, 4096, false },
+    { 16, 2, 44100, 1152, true },
+    { 16, 2, 44100, 16384, true },
+    { 16, 3, 44100, 4096, true },
+    { 16, 4, 44100, 4096, true },
+    { 16, 6, 48000, 4096, true },
+    { 16, 8, 48000, 4096, true },
+    { 24, 2, 96000, 4096, true },
+    { 24, 2, 96000, 4096, false },
+    { 24, 6, 48000, 4096, true },
+    { 24, 8, 96000, 4096, true },
+    { 32, 2, 96000, 4096, true },
+    { 32, 8, 48000, 4096, true },
+};
+
+#define BENCH_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+typedef struct {
+    FLAC__uint64 samples;
+    double seconds;          /* of the fastest run, decoding only */
+    bench_times stages;      /* of the fastest run */
+    double seek_us[BENCH_SEEKS];
+    unsigned seeks;
+    unsigned seek_errors;
+} bench_result;
+
+/* the same pseudo random numbers everywhere, unlike rand() */
+static uint_32 bench_random(uint_32 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* a triangle wave of its own frequency on every channel plus a little
+ * noise, in integers only so every platform encodes the same file */
+static void bench_signal(FLAC__int32 *out, const bench_case *c, FLAC__uint64 first,
+			 unsigned samples, uint_32 *state)
+{
+    FLAC__int64 full = (FLAC__int64) 1 << (c->bits - 1);
+    FLAC__int64 amplitude = full / 4, noise = full / 64, v;
+    unsigned i, ch, period, pos;
+
+    for (i = 0; i < samples; i++) {
+	for (ch = 0; ch < c->channels; ch++) {
+	    period = c->rate / (110 * (ch + 2));
+	    pos = (unsigned) ((first + i) % period);
+	    v = pos < period / 2 ? -amplitude + 4 * amplitude * pos / period :
+		3 * amplitude - 4 * amplitude * pos / period;
+	    if (noise > 0)
+		v += (FLAC__int64) (bench_random(state) % (2 * noise + 1)) - noise;
+	    *out++ = (FLAC__int32) (v < -full ? -full : v > full - 1 ? full - 1 : v);
+	}
+    }
+}
+
+static char *bench_name(const char *dir, const bench_case *c)
+{
+    char *path = malloc(strlen(dir) + 64);
+
+    if (path)
+	sprintf(path, "%s/b%u-c%u-r%u-bs%u%s.flac", dir, c->bits, c->channels,
+		c->rate, c->blocksize, c->seektable ? "-seektable" : "");
+    return path;
+}
+
+/* encode the file of case c, false if this libFLAC cannot */
+static FLAC__bool bench_encode(const char *path, const bench_case *c)
+{
+    FLAC__uint64 total = (FLAC__uint64) c->rate * BENCH_SECONDS, done;
+    FLAC__StreamEncoder *encoder;
+    FLAC__StreamMetadata *seektable = NULL;
+    FLAC__int32 *pcm;
+    uint_32 state = 0x12345678 + c->bits * 8 + c->channels;
+    unsigned n;
+    FLAC__bool ok;
+
+    if (!(encoder = FLAC__stream_encoder_new()))
+	return false;
+    if (!(pcm = malloc(BENCH_CHUNK * c->channels * sizeof(FLAC__int32)))) {
+	FLAC__stream_encoder_delete(encoder);
+	return false;
+    }
+
+    ok = FLAC__stream_encoder_set_channels(encoder, c->channels) &&
+	FLAC__stream_encoder_set_bits_per_sample(encoder, c->bits) &&
+	FLAC__stream_encoder_set_sample_rate(encoder, c->rate) &&
+	FLAC__stream_encoder_set_compression_level(encoder, 5) &&
+	FLAC__stream_encoder_set_blocksize(encoder, c->blocksize) &&
+	FLAC__stream_encoder_set_total_samples_estimate(encoder, total);
+
+    /* a seek point every second */
+    if (ok && c->seektable) {
+	ok = (seektable = FLAC__metadata_object_new(FLAC__METADATA_TYPE_SEEKTABLE)) &&
+	    FLAC__metadata_object_seektable_template_append_spaced_points_by_samples(seektable, c->rate, total) &&
+	    FLAC__metadata_object_seektable_template_sort(seektable, true) &&
+	    FLAC__stream_encoder_set_metadata(encoder, &seektable, 1);
+    }
+
+    ok = ok && FLAC__stream_encoder_init_file(encoder, path, NULL, NULL) ==
+	FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+
+    for (done = 0; ok && done < total; done += n) {
+	n = total - done < BENCH_CHUNK ? (unsigned) (total - done) : BENCH_CHUNK;
+	bench_signal(pcm, c, done, n, &state);
+	ok = FLAC__stream_encoder_process_interleaved(encoder, pcm, n);
+    }
+
+    /* finish also writes the seek points */
+    if (!FLAC__stream_encoder_finish(encoder))
+	ok = false;
+    FLAC__stream_encoder_delete(encoder);
+    if (seektable)
+	FLAC__metadata_object_delete(seektable);
+    free(pcm);
+
+    if (!ok)
+	unlink(path);
+    return ok;
+}
+
+static void bench_free(file_info_struct *p)
+{
+    if (p->is_loaded)
+	decoder_destructor(p);
+    if (p->ao_dev)
+	ao_close(p->ao_dev);
+    free(p->aobuf);
+    free(p->noise);
+    memset(p, 0, sizeof(file_info_struct));
+}
+
+static int by_latency(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* decode path BENCH_RUNS times, then seek around in it */
+static FLAC__bool bench_file(const char *path, bench_result *r)
+{
+    static file_info_struct info, next;
+    file_info_struct *p = &info;
+    bench_times stages;
+    FLAC__uint64 start, target;
+    FLAC__bool ok = true;
+    uint_32 state = 0x9e3779b9;
+    unsigned run, i;
+    double seconds;
+
+    memset(r, 0, sizeof(bench_result));
+
+    for (run = 0; ok && run < BENCH_RUNS; run++) {
+	memset(&stages, 0, sizeof(stages));
+	p->next = &next;
+	p->bench = &stages;
+	if (!decoder_constructor(p, path)) {
+	    fprintf(stderr, "Error opening %s\n", path);
+	    return false;
+	}
+
+	start = stats_clock();
+	while ((ok = FLAC__stream_decoder_process_single(p->decoder)) &&
+	       FLAC__stream_decoder_get_state(p->decoder) < FLAC__STREAM_DECODER_END_OF_STREAM)
+	{
+	}
+	seconds = (stats_clock() - start) / 1e9;
+
+	if (!ok)
+	    fprintf(stderr, "Error decoding %s: %s\n", path,
+		    FLAC__stream_decoder_get_resolved_state_string(p->decoder));
+	if (run == 0 || seconds < r->seconds) {
+	    r->seconds = seconds;
+	    r->stages = stages;
+	}
+	r->samples = p->current_sample;
+	bench_free(p);
+    }
+
+    /* a freshly opened file, the frame table has to be built as it goes */
+    p->next = &next;
+    if (ok && decoder_constructor(p, path)) {
+	for (i = 0; i < BENCH_SEEKS && p->total_samples > 0; i++) {
+	    target = bench_random(&state) % p->total_samples;
+	    start = stats_clock();
+	    if (decoder_seek(p, target) && FLAC__stream_decoder_process_single(p->decoder)) {
+		r->seek_us[r->seeks++] = (stats_clock() - start) / 1e3;
+	    } else {
+		r->seek_errors++;
+		FLAC__stream_decoder_flush(p->decoder);
+	    }
+	}
+	qsort(r->seek_us, r->seeks, sizeof(double), by_latency);
+    }
+    bench_free(p);
+
+    return ok;
+}
+
+static double percentile(const bench_result *r, unsigned pct)
+{
+    return r->seeks ? r->seek_us[(r->seeks - 1) * pct / 100] : 0;
+}
+
+static void bench_report(const char *path, const bench_case *c, const bench_result *r)
+{
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    double samples = r->samples ? (double) r->samples : 1;
+    double decode_ns = r->seconds * 1e9 - r->stages.write_ns;
+
+    printf("{\"file\":\"%s\"", name);
+    if (c)
+	printf(",\"bits\":%u,\"channels\":%u,\"rate\":%u,\"blocksize\":%u,\"seektable\":%s",
+	       c->bits, c->channels, c->rate, c->blocksize, c->seektable ? "true" : "false");
+    printf(",\"samples\":%llu,\"samples_per_s\":%.0f,"
+	   "\"decode_ns_per_sample\":%.3f,\"convert_ns_per_sample\":%.3f,"
+	   "\"output_ns_per_sample\":%.3f,\"seeks\":%u,\"seek_errors\":%u,"
+	   "\"seek_p50_us\":%.1f,\"seek_p90_us\":%.1f,\"seek_p99_us\":%.1f,"
+	   "\"seek_max_us\":%.1f}\n",
+	   (unsigned long long) r->samples,
+	   r->seconds > 0 ? r->samples / r->seconds : 0,
+	   (decode_ns > 0 ? decode_ns : 0) / samples,
+	   r->stages.convert_ns / samples, r->stages.output_ns / samples,
+	   r->seeks, r->seek_errors, percentile(r, 50), percentile(r, 90),
+	   percentile(r, 99), r->seeks ? r->seek_us[r->seeks - 1] : 0);
+    fflush(stdout);
+}
+
+/* benchmark files[], or the generated corpus if there are none.  The
+ * corpus is kept in --outdir if given.  Returns the number of failures. */
+int bench_run(const char **files, unsigned count)
+{
+    char tmpdir[PATH_MAX], *path;
+    const char *dir = cli_args.outdir, *tmp;
+    bench_result result;
+    unsigned i, failed = 0;
+
+    /* the figures are all that goes to stdout */
+    cli_args.quiet = 1;
+
+    printf("{\"bench\":\"flac123\",\"version\":\"%s\",\"libflac\":\"%s\","
+	   "\"runs\":%d,\"seeks\":%d}\n",
+	   FLAC123_VERSION, FLAC__VERSION_STRING, BENCH_RUNS, BENCH_SEEKS);
+
+    if (count > 0) {
+	for (i = 0; i < count; i++) {
+	    if (bench_file(files[i], &result))
+		bench_report(files[i], NULL, &result);
+	    else
+		failed++;
+	}
+	return failed;
+    }
+
+    if (!dir) {
+	tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	snprintf(tmpdir, sizeof(tmpdir), "%s/flac123-bench-XXXXXX", tmp);
+	if (!mkdtemp(tmpdir)) {
+	    fprintf(stderr, "Error creating %s: %s\n", tmpdir, strerror(errno));
+	    return 1;
+	}
+	dir = tmpdir;
+    }
+
+    for (i = 0; i < BENCH_CASES; i++) {
+	if (!(path = bench_name(dir, &bench_cases[i]))) {
+	    failed++;
+	    continue;
+	}
+
+	if (!bench_encode(path, &bench_cases[i]))
+	    printf("{\"file\":\"%s\",\"error\":\"libFLAC cannot encode it\"}\n",
+		   strrchr(path, '/') + 1);
+	else if (bench_file(path, &result))
+	    bench_report(path, &bench_cases[i], &result);
+	else
+	    failed++;
+
+	if (dir == tmpdir)
+	    unlink(path);
+	free(path);
+    }
+
+    if (dir == tmpdir)
+	rmdir(tmpdir);
+
+    return failed;
+}
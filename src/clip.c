@@ -0,0 +1,128 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This clip.c module implements --start and --end.  Every file played or
+ *  written out is sought straight to the frame holding the start sample,
+ *  the part of that frame before it is dropped by flac_write_hdl(), and
+ *  decoding stops after the end sample, so cutting a clip out of a long
+ *  file costs about as much as the clip is long.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "flac123.h"
+
+/* parse s:SAMPLES or [[HOURS:]MINUTES:]SECONDS[.FRACTION] into pos */
+FLAC__bool clip_parse(const char *arg, clip_position *pos)
+{
+    double seconds = 0;
+    unsigned fields = 0;
+    char *end;
+
+    memset(pos, 0, sizeof(clip_position));
+
+    if (strncasecmp(arg, "s:", 2) == 0) {
+	if (!isdigit((unsigned char) arg[2]))
+	    return false;
+	pos->sample = strtoull(arg + 2, &end, 10);
+	pos->is_sample = true;
+	return pos->set = *end == '\0';
+    }
+
+    for (;;) {
+	if (!isdigit((unsigned char) *arg) || ++fields > 3)
+	    return false;
+	seconds = seconds * 60 + strtod(arg, &end);
+	if (*end == '\0')
+	    break;
+	/* only the seconds may have a fraction */
+	if (*end != ':' || memchr(arg, '.', end - arg))
+	    return false;
+	arg = end + 1;
+    }
+
+    pos->seconds = seconds;
+    return pos->set = true;
+}
+
+static FLAC__uint64 clip_sample(const clip_position *pos, unsigned rate)
+{
+    return pos->is_sample ? pos->sample : (FLAC__uint64) (pos->seconds * rate + 0.5);
+}
+
+/*
+ * Seek p, just opened, to --start and make it stop at --end.  A pipe
+ * cannot seek, so it is decoded from the beginning and flac_write_hdl()
+ * drops the samples before the start.  False after an error has been
+ * printed.
+ */
+FLAC__bool clip_apply(file_info_struct *p)
+{
+    FLAC__uint64 start = 0, end = 0;
+
+    p->start_sample = p->end_sample = 0;
+    if (!cli_args.start_pos.set && !cli_args.end_pos.set)
+	return true;
+
+    if (cli_args.start_pos.set)
+	start = clip_sample(&cli_args.start_pos, p->ao_fmt.rate);
+    if (cli_args.end_pos.set)
+	end = clip_sample(&cli_args.end_pos, p->ao_fmt.rate);
+    if (p->total_samples && end >= p->total_samples)
+	end = 0; /* to the end of the stream, as usual */
+
+    if (p->total_samples && start >= p->total_samples) {
+	fprintf(stderr, "%s ends before --start (sample %llu of %lu)\n", p->filename,
+		(unsigned long long) start, p->total_samples);
+	return false;
+    }
+    if (end && end <= start) {
+	fprintf(stderr, "--end must come after --start\n");
+	return false;
+    }
+
+    p->start_sample = start;
+    p->end_sample = end;
+    /* where playback stops, for preloading the next track in time */
+    if (end)
+	p->total_time = (float) end / p->ao_fmt.rate;
+    if (start == 0)
+	return true;
+
+    /* if libFLAC seeks, it writes out the rest of the frame holding start
+     * right away, and that counts from start on */
+    p->current_sample = start;
+    p->elapsed_time = (float) start / p->ao_fmt.rate;
+    if (p->input && !input_seekable(p->input)) {
+	p->skip_samples = start;
+    } else if (!decoder_seek(p, start)) {
+	fprintf(stderr, "Error seeking to sample %llu of %s\n", (unsigned long long) start,
+		p->filename);
+	return false;
+    }
+
+    return true;
+}
+
+/* whether p has been decoded up to --end */
+FLAC__bool clip_done(const file_info_struct *p)
+{
+    return p->end_sample && p->current_sample >= p->end_sample;
+}
@@ -0,0 +1,601 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This convert.c module turns the planar 32 bit samples handed out by
+ *  libFLAC into the interleaved 8/16/24/32 bit PCM that libao expects.
+ *  Every combination of output format, channel count and gain mode
+ *  (unity, fixed point gain, gain plus TPDF dither) gets its own kernel;
+ *  SIMD versions are picked at run time and produce exactly the same
+ *  bytes as the scalar ones.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include "flac123.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+/* output formats, indexed by bytes per sample - 1 */
+#define CONV_U8  0
+#define CONV_S16 1
+#define CONV_S24 2
+#define CONV_S32 3
+
+/*
+ * The gain is Q16.16 fixed point: every sample is multiplied into 64
+ * bits, rounded (or dithered) and shifted back down, then clamped to the
+ * output range.  gain_update() keeps the gain small enough for the
+ * shifted result to fit into 32 bits, so the SIMD kernels can narrow
+ * before clamping and still match the scalar code bit for bit.
+ */
+ALWAYS_INLINE FLAC__int32 gain_sample(FLAC__int32 x, FLAC__int32 gain,
+				      FLAC__int32 noise, const int fmt)
+{
+    FLAC__int32 v = (FLAC__int32) (((FLAC__int64) x * gain + GAIN_ROUND + noise) >> GAIN_BITS);
+
+    if (fmt != CONV_S32) {
+	const FLAC__int32 hi = (1 << (8 * (fmt + 1) - 1)) - 1;
+
+	v = v > hi ? hi : v;
+	v = v < -hi - 1 ? -hi - 1 : v;
+    }
+    return v;
+}
+
+ALWAYS_INLINE void store_sample(uint_8 *out, FLAC__int32 v, const int fmt)
+{
+    switch (fmt) {
+    case CONV_U8:
+	/* 8 bit pcm is unsigned */
+	out[0] = (uint_8) (v + 0x80);
+	break;
+    case CONV_S16:
+	*(sint_16 *) out = (sint_16) v;
+	break;
+    case CONV_S24:
+	out[0] = (v >>  0) & 0xFF;
+	out[1] = (v >>  8) & 0xFF;
+	out[2] = (v >> 16) & 0xFF;
+	break;
+    case CONV_S32:
+	*(sint_32 *) out = v;
+	break;
+    }
+}
+
+/* nch is the channel count when known at compile time, otherwise 0.
+ * noise holds one value per output sample, in interleaved order. */
+ALWAYS_INLINE void convert_scalar(uint_8 *out, const FLAC__int32 * const buf[],
+				  unsigned channels, unsigned samples,
+				  FLAC__int32 gain, const FLAC__int32 *noise,
+				  const int fmt, const unsigned nch, const int mode)
+{
+    unsigned sample, channel;
+
+    if (nch)
+	channels = nch;
+
+    for (sample = 0; sample < samples; sample++) {
+	for (channel = 0; channel < channels; channel++) {
+	    FLAC__int32 v = buf[channel][sample];
+
+	    if (mode != CONVERT_UNITY)
+		v = gain_sample(v, gain, mode == CONVERT_DITHER ? *noise++ : 0, fmt);
+	    store_sample(out, v, fmt);
+	    out += fmt + 1;
+	}
+    }
+}
+
+/* convert the samples from offset on with the scalar kernel */
+ALWAYS_INLINE void convert_tail(uint_8 *out, const FLAC__int32 * const buf[],
+				unsigned offset, unsigned samples,
+				FLAC__int32 gain, const FLAC__int32 *noise,
+				const int fmt, const unsigned nch, const int mode)
+{
+    const FLAC__int32 *tail[2];
+
+    tail[0] = buf[0] + offset;
+    if (nch == 2)
+	tail[1] = buf[1] + offset;
+
+    convert_scalar(out + offset * nch * (fmt + 1), tail, nch, samples - offset,
+		   gain, mode == CONVERT_DITHER ? noise + offset * nch : NULL,
+		   fmt, nch, mode);
+}
+
+#define SCALAR_KERNEL(name, fmt, nch, mode) \
+static void name(uint_8 *out, const FLAC__int32 * const buf[], \
+		 unsigned channels, unsigned samples, \
+		 FLAC__int32 gain, const FLAC__int32 *noise) \
+{ \
+    convert_scalar(out, buf, channels, samples, gain, noise, fmt, nch, mode); \
+}
+
+#define SCALAR_KERNELS(fmt, suffix) \
+SCALAR_KERNEL(scalar_##suffix##_1, fmt, 1, CONVERT_GAIN) \
+SCALAR_KERNEL(scalar_##suffix##_1u, fmt, 1, CONVERT_UNITY) \
+SCALAR_KERNEL(scalar_##suffix##_1d, fmt, 1, CONVERT_DITHER) \
+SCALAR_KERNEL(scalar_##suffix##_2, fmt, 2, CONVERT_GAIN) \
+SCALAR_KERNEL(scalar_##suffix##_2u, fmt, 2, CONVERT_UNITY) \
+SCALAR_KERNEL(scalar_##suffix##_2d, fmt, 2, CONVERT_DITHER) \
+SCALAR_KERNEL(scalar_##suffix##_n, fmt, 0, CONVERT_GAIN) \
+SCALAR_KERNEL(scalar_##suffix##_nu, fmt, 0, CONVERT_UNITY) \
+SCALAR_KERNEL(scalar_##suffix##_nd, fmt, 0, CONVERT_DITHER)
+
+SCALAR_KERNELS(CONV_U8, u8)
+SCALAR_KERNELS(CONV_S16, s16)
+SCALAR_KERNELS(CONV_S24, s24)
+SCALAR_KERNELS(CONV_S32, s32)
+
+#define SCALAR_ROW(suffix) \
+    { { scalar_##suffix##_1, scalar_##suffix##_1u, scalar_##suffix##_1d }, \
+      { scalar_##suffix##_2, scalar_##suffix##_2u, scalar_##suffix##_2d }, \
+      { scalar_##suffix##_n, scalar_##suffix##_nu, scalar_##suffix##_nd } }
+
+/* [format][mono, stereo, any][gain, unity, dither] */
+static convert_fn kernels[4][3][3] = {
+    SCALAR_ROW(u8),
+    SCALAR_ROW(s16),
+    SCALAR_ROW(s24),
+    SCALAR_ROW(s32),
+};
+
+/*
+ * TPDF dither: the difference of two independent uniform 16 bit values,
+ * i.e. +-1 LSB of the output in units of 1/65536 LSB.  Eight xorshift32
+ * generators run side by side so the SIMD versions below can step them
+ * all at once and still produce the same sequence.
+ */
+static void dither_fill_scalar(FLAC__int32 *noise, unsigned n, uint_32 state[8])
+{
+    unsigned i, lane;
+
+    for (i = 0; i < n; i += 8) {
+	for (lane = 0; lane < 8; lane++) {
+	    uint_32 x = state[lane];
+
+	    x ^= x << 13;
+	    x ^= x >> 17;
+	    x ^= x << 5;
+	    state[lane] = x;
+	    noise[i + lane] = (FLAC__int32) (x & 0xFFFF) - (FLAC__int32) (x >> 16);
+	}
+    }
+}
+
+static void (*dither_kernel)(FLAC__int32 *, unsigned, uint_32 *) = dither_fill_scalar;
+
+#ifdef CONVERT_X86
+
+/*
+ * SSE2.  Every pass emits 8 output samples: 8 mono or 4 stereo frames.
+ * The 24 bit store writes 2 bytes past the end of the 24 it produces;
+ * the next pass overwrites them and aobuf has plenty of room after the
+ * last frame.
+ */
+#define SSE2 __attribute__((target("sse2")))
+
+SSE2 ALWAYS_INLINE __m128i sse2_clamp(__m128i x, FLAC__int32 hi)
+{
+    const __m128i max = _mm_set1_epi32(hi), min = _mm_set1_epi32(-hi - 1);
+    __m128i m;
+
+    m = _mm_cmpgt_epi32(x, max);
+    x = _mm_or_si128(_mm_and_si128(m, max), _mm_andnot_si128(m, x));
+    m = _mm_cmpgt_epi32(min, x);
+    return _mm_or_si128(_mm_and_si128(m, min), _mm_andnot_si128(m, x));
+}
+
+/* SSE2 has no signed 32x32->64 multiply; the gain is never negative, so
+ * the unsigned one is corrected by subtracting gain << 32 for x < 0 */
+SSE2 ALWAYS_INLINE __m128i sse2_mul(__m128i x, FLAC__int32 gain)
+{
+    const __m128i g = _mm_set1_epi32(gain);
+    const __m128i g32 = _mm_set1_epi64x((long long) gain << 32);
+
+    return _mm_sub_epi64(_mm_mul_epu32(x, g),
+			 _mm_and_si128(_mm_srai_epi32(x, 31), g32));
+}
+
+SSE2 ALWAYS_INLINE __m128i sse2_gain(__m128i x, FLAC__int32 gain, const FLAC__int32 *noise,
+				     const int fmt, const int mode)
+{
+    const __m128i round = _mm_set1_epi64x(GAIN_ROUND);
+    /* [x0 x0 x1 x1] and [x2 x2 x3 x3]: one sample per qword, in order */
+    __m128i p01 = sse2_mul(_mm_unpacklo_epi32(x, x), gain);
+    __m128i p23 = sse2_mul(_mm_unpackhi_epi32(x, x), gain);
+
+    p01 = _mm_add_epi64(p01, round);
+    p23 = _mm_add_epi64(p23, round);
+    if (mode == CONVERT_DITHER) {
+	__m128i n = _mm_loadu_si128((const __m128i *) noise);
+	__m128i s = _mm_srai_epi32(n, 31);
+
+	p01 = _mm_add_epi64(p01, _mm_unpacklo_epi32(n, s));
+	p23 = _mm_add_epi64(p23, _mm_unpackhi_epi32(n, s));
+    }
+    /* the results are in the low dword of every qword */
+    p01 = _mm_shuffle_epi32(_mm_srli_epi64(p01, GAIN_BITS), _MM_SHUFFLE(3, 1, 2, 0));
+    p23 = _mm_shuffle_epi32(_mm_srli_epi64(p23, GAIN_BITS), _MM_SHUFFLE(3, 1, 2, 0));
+    x = _mm_unpacklo_epi64(p01, p23);
+
+    /* packs saturates 16 bit output by itself */
+    if (fmt == CONV_S24)
+	x = sse2_clamp(x, 0x7FFFFF);
+    return x;
+}
+
+SSE2 ALWAYS_INLINE void sse2_store24(uint_8 *out, __m128i v)
+{
+    const __m128i lo32 = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+    const __m128i hi32 = _mm_set_epi32(0x00FFFFFF, 0, 0x00FFFFFF, 0);
+
+    /* squeeze each pair of samples into the low 6 bytes of its qword */
+    v = _mm_or_si128(_mm_and_si128(v, lo32),
+		     _mm_srli_epi64(_mm_and_si128(v, hi32), 8));
+    _mm_storel_epi64((__m128i *) out, v);
+    _mm_storel_epi64((__m128i *) (out + 6), _mm_srli_si128(v, 8));
+}
+
+SSE2 ALWAYS_INLINE void convert_sse2(uint_8 *out, const FLAC__int32 * const buf[],
+				     unsigned samples, FLAC__int32 gain, const FLAC__int32 *noise,
+				     const int fmt, const unsigned nch, const int mode)
+{
+    const unsigned step = 8 / nch;
+    unsigned sample = 0;
+    __m128i v0, v1;
+
+    for (; sample + step <= samples; sample += step, out += 8 * (fmt + 1)) {
+	if (nch == 1) {
+	    v0 = _mm_loadu_si128((const __m128i *) (buf[0] + sample));
+	    v1 = _mm_loadu_si128((const __m128i *) (buf[0] + sample + 4));
+	} else {
+	    __m128i l = _mm_loadu_si128((const __m128i *) (buf[0] + sample));
+	    __m128i r = _mm_loadu_si128((const __m128i *) (buf[1] + sample));
+
+	    v0 = _mm_unpacklo_epi32(l, r);
+	    v1 = _mm_unpackhi_epi32(l, r);
+	}
+
+	if (mode != CONVERT_UNITY) {
+	    v0 = sse2_gain(v0, gain, noise + sample * nch, fmt, mode);
+	    v1 = sse2_gain(v1, gain, noise + sample * nch + 4, fmt, mode);
+	}
+
+	if (fmt == CONV_S16) {
+	    _mm_storeu_si128((__m128i *) out, _mm_packs_epi32(v0, v1));
+	} else if (fmt == CONV_S24) {
+	    sse2_store24(out, v0);
+	    sse2_store24(out + 12, v1);
+	} else {
+	    _mm_storeu_si128((__m128i *) out, v0);
+	    _mm_storeu_si128((__m128i *) (out + 16), v1);
+	}
+    }
+
+    convert_tail(out - sample * nch * (fmt + 1), buf, sample, samples, gain, noise, fmt, nch, mode);
+}
+
+SSE2 static void dither_fill_sse2(FLAC__int32 *noise, unsigned n, uint_32 state[8])
+{
+    const __m128i mask = _mm_set1_epi32(0xFFFF);
+    __m128i s0 = _mm_loadu_si128((const __m128i *) state);
+    __m128i s1 = _mm_loadu_si128((const __m128i *) (state + 4));
+    unsigned i;
+
+    for (i = 0; i < n; i += 8) {
+	s0 = _mm_xor_si128(s0, _mm_slli_epi32(s0, 13));
+	s1 = _mm_xor_si128(s1, _mm_slli_epi32(s1, 13));
+	s0 = _mm_xor_si128(s0, _mm_srli_epi32(s0, 17));
+	s1 = _mm_xor_si128(s1, _mm_srli_epi32(s1, 17));
+	s0 = _mm_xor_si128(s0, _mm_slli_epi32(s0, 5));
+	s1 = _mm_xor_si128(s1, _mm_slli_epi32(s1, 5));
+	_mm_storeu_si128((__m128i *) (noise + i),
+			 _mm_sub_epi32(_mm_and_si128(s0, mask), _mm_srli_epi32(s0, 16)));
+	_mm_storeu_si128((__m128i *) (noise + i + 4),
+			 _mm_sub_epi32(_mm_and_si128(s1, mask), _mm_srli_epi32(s1, 16)));
+    }
+    _mm_storeu_si128((__m128i *) state, s0);
+    _mm_storeu_si128((__m128i *) (state + 4), s1);
+}
+
+/*
+ * AVX2.  Every pass emits 16 output samples.  The 24 bit store writes 4
+ * bytes past the 48 it produces.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 ALWAYS_INLINE __m256i avx2_gain(__m256i x, FLAC__int32 gain, const FLAC__int32 *noise,
+				     const int fmt, const int mode)
+{
+    const __m256i g = _mm256_set1_epi32(gain);
+    const __m256i round = _mm256_set1_epi64x(GAIN_ROUND);
+    /* unpack works within 128 bit lanes, and so does everything below */
+    __m256i p01 = _mm256_mul_epi32(_mm256_unpacklo_epi32(x, x), g);
+    __m256i p23 = _mm256_mul_epi32(_mm256_unpackhi_epi32(x, x), g);
+
+    p01 = _mm256_add_epi64(p01, round);
+    p23 = _mm256_add_epi64(p23, round);
+    if (mode == CONVERT_DITHER) {
+	__m256i n = _mm256_loadu_si256((const __m256i *) noise);
+	__m256i s = _mm256_srai_epi32(n, 31);
+
+	p01 = _mm256_add_epi64(p01, _mm256_unpacklo_epi32(n, s));
+	p23 = _mm256_add_epi64(p23, _mm256_unpackhi_epi32(n, s));
+    }
+    p01 = _mm256_shuffle_epi32(_mm256_srli_epi64(p01, GAIN_BITS), _MM_SHUFFLE(3, 1, 2, 0));
+    p23 = _mm256_shuffle_epi32(_mm256_srli_epi64(p23, GAIN_BITS), _MM_SHUFFLE(3, 1, 2, 0));
+    x = _mm256_unpacklo_epi64(p01, p23);
+
+    if (fmt == CONV_S24)
+	x = _mm256_max_epi32(_mm256_min_epi32(x, _mm256_set1_epi32(0x7FFFFF)),
+			     _mm256_set1_epi32(-0x800000));
+    return x;
+}
+
+AVX2 ALWAYS_INLINE void avx2_store24(uint_8 *out, __m256i v)
+{
+    /* drop the top byte of every sample, 12 bytes left in each lane */
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+					  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    v = _mm256_shuffle_epi8(v, pack);
+    _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *) (out + 12), _mm256_extracti128_si256(v, 1));
+}
+
+AVX2 ALWAYS_INLINE void convert_avx2(uint_8 *out, const FLAC__int32 * const buf[],
+				     unsigned samples, FLAC__int32 gain, const FLAC__int32 *noise,
+				     const int fmt, const unsigned nch, const int mode)
+{
+    const unsigned step = 16 / nch;
+    unsigned sample = 0;
+    __m256i v0, v1;
+
+    for (; sample + step <= samples; sample += step, out += 16 * (fmt + 1)) {
+	if (nch == 1) {
+	    v0 = _mm256_loadu_si256((const __m256i *) (buf[0] + sample));
+	    v1 = _mm256_loadu_si256((const __m256i *) (buf[0] + sample + 8));
+	} else {
+	    __m256i l = _mm256_loadu_si256((const __m256i *) (buf[0] + sample));
+	    __m256i r = _mm256_loadu_si256((const __m256i *) (buf[1] + sample));
+	    __m256i lo, hi;
+
+	    /* unpack works within 128 bit lanes, put the halves back in order */
+	    lo = _mm256_unpacklo_epi32(l, r);
+	    hi = _mm256_unpackhi_epi32(l, r);
+	    v0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+	    v1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+	}
+
+	if (mode != CONVERT_UNITY) {
+	    v0 = avx2_gain(v0, gain, noise + sample * nch, fmt, mode);
+	    v1 = avx2_gain(v1, gain, noise + sample * nch + 8, fmt, mode);
+	}
+
+	if (fmt == CONV_S16) {
+	    _mm256_storeu_si256((__m256i *) out,
+				_mm256_permute4x64_epi64(_mm256_packs_epi32(v0, v1), 0xD8));
+	} else if (fmt == CONV_S24) {
+	    avx2_store24(out, v0);
+	    avx2_store24(out + 24, v1);
+	} else {
+	    _mm256_storeu_si256((__m256i *) out, v0);
+	    _mm256_storeu_si256((__m256i *) (out + 32), v1);
+	}
+    }
+
+    convert_tail(out - sample * nch * (fmt + 1), buf, sample, samples, gain, noise, fmt, nch, mode);
+}
+
+#define X86_KERNEL(isa, attr, name, fmt, nch, mode) \
+attr static void isa##_##name(uint_8 *out, const FLAC__int32 * const buf[], \
+			     unsigned channels, unsigned samples, \
+			     FLAC__int32 gain, const FLAC__int32 *noise) \
+{ \
+    convert_##isa(out, buf, samples, gain, noise, fmt, nch, mode); \
+}
+
+#define X86_KERNELS(isa, attr, fmt, suffix) \
+X86_KERNEL(isa, attr, suffix##_1, fmt, 1, CONVERT_GAIN) \
+X86_KERNEL(isa, attr, suffix##_1u, fmt, 1, CONVERT_UNITY) \
+X86_KERNEL(isa, attr, suffix##_1d, fmt, 1, CONVERT_DITHER) \
+X86_KERNEL(isa, attr, suffix##_2, fmt, 2, CONVERT_GAIN) \
+X86_KERNEL(isa, attr, suffix##_2u, fmt, 2, CONVERT_UNITY) \
+X86_KERNEL(isa, attr, suffix##_2d, fmt, 2, CONVERT_DITHER)
+
+X86_KERNELS(sse2, SSE2, CONV_S16, s16)
+X86_KERNELS(sse2, SSE2, CONV_S24, s24)
+X86_KERNELS(sse2, SSE2, CONV_S32, s32)
+X86_KERNELS(avx2, AVX2, CONV_S16, s16)
+X86_KERNELS(avx2, AVX2, CONV_S24, s24)
+X86_KERNELS(avx2, AVX2, CONV_S32, s32)
+
+#endif /* CONVERT_X86 */
+
+#ifdef CONVERT_NEON
+
+/* NEON is always there on aarch64.  Every pass emits 8 output samples. */
+ALWAYS_INLINE int32x4_t neon_gain(int32x4_t x, FLAC__int32 gain, const FLAC__int32 *noise,
+				  const int fmt, const int mode)
+{
+    const int64x2_t round = vdupq_n_s64(GAIN_ROUND);
+    int64x2_t lo = vaddq_s64(vmull_n_s32(vget_low_s32(x), gain), round);
+    int64x2_t hi = vaddq_s64(vmull_high_n_s32(x, gain), round);
+
+    if (mode == CONVERT_DITHER) {
+	int32x4_t n = vld1q_s32(noise);
+
+	lo = vaddw_s32(lo, vget_low_s32(n));
+	hi = vaddw_high_s32(hi, n);
+    }
+    x = vcombine_s32(vshrn_n_s64(lo, GAIN_BITS), vshrn_n_s64(hi, GAIN_BITS));
+
+    /* vqmovn saturates 16 bit output by itself */
+    if (fmt == CONV_S24)
+	x = vmaxq_s32(vminq_s32(x, vdupq_n_s32(0x7FFFFF)), vdupq_n_s32(-0x800000));
+    return x;
+}
+
+ALWAYS_INLINE void neon_store24(uint_8 *out, int32x4_t v0, int32x4_t v1)
+{
+    static const uint8_t pack[32] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 16, 17, 18, 20,
+				      21, 22, 24, 25, 26, 28, 29, 30, 255, 255, 255, 255, 255, 255, 255, 255 };
+    uint8x16x2_t t = { { vreinterpretq_u8_s32(v0), vreinterpretq_u8_s32(v1) } };
+
+    vst1q_u8(out, vqtbl2q_u8(t, vld1q_u8(pack)));
+    vst1_u8(out + 16, vget_low_u8(vqtbl2q_u8(t, vld1q_u8(pack + 16))));
+}
+
+ALWAYS_INLINE void convert_neon(uint_8 *out, const FLAC__int32 * const buf[],
+				unsigned samples, FLAC__int32 gain, const FLAC__int32 *noise,
+				const int fmt, const unsigned nch, const int mode)
+{
+    const unsigned step = 8 / nch;
+    unsigned sample = 0;
+    int32x4_t v0, v1;
+
+    for (; sample + step <= samples; sample += step, out += 8 * (fmt + 1)) {
+	if (nch == 1) {
+	    v0 = vld1q_s32(buf[0] + sample);
+	    v1 = vld1q_s32(buf[0] + sample + 4);
+	} else {
+	    int32x4_t l = vld1q_s32(buf[0] + sample);
+	    int32x4_t r = vld1q_s32(buf[1] + sample);
+
+	    v0 = vzip1q_s32(l, r);
+	    v1 = vzip2q_s32(l, r);
+	}
+
+	if (mode != CONVERT_UNITY) {
+	    v0 = neon_gain(v0, gain, noise + sample * nch, fmt, mode);
+	    v1 = neon_gain(v1, gain, noise + sample * nch + 4, fmt, mode);
+	}
+
+	if (fmt == CONV_S16) {
+	    vst1q_s16((int16_t *) out, vcombine_s16(vqmovn_s32(v0), vqmovn_s32(v1)));
+	} else if (fmt == CONV_S24) {
+	    neon_store24(out, v0, v1);
+	} else {
+	    vst1q_s32((int32_t *) out, v0);
+	    vst1q_s32((int32_t *) (out + 16), v1);
+	}
+    }
+
+    convert_tail(out - sample * nch * (fmt + 1), buf, sample, samples, gain, noise, fmt, nch, mode);
+}
+
+static void dither_fill_neon(FLAC__int32 *noise, unsigned n, uint_32 state[8])
+{
+    const uint32x4_t mask = vdupq_n_u32(0xFFFF);
+    uint32x4_t s0 = vld1q_u32(state);
+    uint32x4_t s1 = vld1q_u32(state + 4);
+    unsigned i;
+
+    for (i = 0; i < n; i += 8) {
+	s0 = veorq_u32(s0, vshlq_n_u32(s0, 13));
+	s1 = veorq_u32(s1, vshlq_n_u32(s1, 13));
+	s0 = veorq_u32(s0, vshrq_n_u32(s0, 17));
+	s1 = veorq_u32(s1, vshrq_n_u32(s1, 17));
+	s0 = veorq_u32(s0, vshlq_n_u32(s0, 5));
+	s1 = veorq_u32(s1, vshlq_n_u32(s1, 5));
+	vst1q_s32(noise + i, vreinterpretq_s32_u32(vsubq_u32(vandq_u32(s0, mask), vshrq_n_u32(s0, 16))));
+	vst1q_s32(noise + i + 4, vreinterpretq_s32_u32(vsubq_u32(vandq_u32(s1, mask), vshrq_n_u32(s1, 16))));
+    }
+    vst1q_u32(state, s0);
+    vst1q_u32(state + 4, s1);
+}
+
+#define NEON_KERNEL(name, fmt, nch, mode) \
+static void neon_##name(uint_8 *out, const FLAC__int32 * const buf[], \
+			unsigned channels, unsigned samples, \
+			FLAC__int32 gain, const FLAC__int32 *noise) \
+{ \
+    convert_neon(out, buf, samples, gain, noise, fmt, nch, mode); \
+}
+
+#define NEON_KERNELS(fmt, suffix) \
+NEON_KERNEL(suffix##_1, fmt, 1, CONVERT_GAIN) \
+NEON_KERNEL(suffix##_1u, fmt, 1, CONVERT_UNITY) \
+NEON_KERNEL(suffix##_1d, fmt, 1, CONVERT_DITHER) \
+NEON_KERNEL(suffix##_2, fmt, 2, CONVERT_GAIN) \
+NEON_KERNEL(suffix##_2u, fmt, 2, CONVERT_UNITY) \
+NEON_KERNEL(suffix##_2d, fmt, 2, CONVERT_DITHER)
+
+NEON_KERNELS(CONV_S16, s16)
+NEON_KERNELS(CONV_S24, s24)
+NEON_KERNELS(CONV_S32, s32)
+
+#endif /* CONVERT_NEON */
+
+/* install the mono and stereo kernels of one instruction set */
+#define SET_KERNELS(fmt, prefix) \
+    do { \
+	kernels[fmt][0][CONVERT_GAIN] = prefix##_1; \
+	kernels[fmt][0][CONVERT_UNITY] = prefix##_1u; \
+	kernels[fmt][0][CONVERT_DITHER] = prefix##_1d; \
+	kernels[fmt][1][CONVERT_GAIN] = prefix##_2; \
+	kernels[fmt][1][CONVERT_UNITY] = prefix##_2u; \
+	kernels[fmt][1][CONVERT_DITHER] = prefix##_2d; \
+    } while (0)
+
+/* pick the fastest kernels this cpu can run */
+void convert_init(void)
+{
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+	SET_KERNELS(CONV_S16, sse2_s16);
+	SET_KERNELS(CONV_S24, sse2_s24);
+	SET_KERNELS(CONV_S32, sse2_s32);
+	dither_kernel = dither_fill_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+	SET_KERNELS(CONV_S16, avx2_s16);
+	SET_KERNELS(CONV_S24, avx2_s24);
+	SET_KERNELS(CONV_S32, avx2_s32);
+    }
+#endif
+#ifdef CONVERT_NEON
+    SET_KERNELS(CONV_S16, neon_s16);
+    SET_KERNELS(CONV_S24, neon_s24);
+    SET_KERNELS(CONV_S32, neon_s32);
+    dither_kernel = dither_fill_neon;
+#endif
+}
+
+/* the kernel for out_bits (8, 16, 24 or 32) wide output */
+convert_fn convert_select(int out_bits, unsigned channels, int mode)
+{
+    return kernels[(out_bits - 1) / 8][channels < 3 ? channels - 1 : 2][mode];
+}
+
+/* fill noise with n (rounded up to a multiple of 8) TPDF dither values */
+void dither_fill(FLAC__int32 *noise, unsigned n, uint_32 state[8])
+{
+    dither_kernel(noise, n, state);
+}
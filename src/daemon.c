@@ -0,0 +1,398 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This daemon.c module implements --daemon: flac123 listens on a unix
+ *  domain socket, and every connection is a remote mode session of its
+ *  own, with its own decoder, output and commands.  One thread reads the
+ *  commands of all sessions, and the sessions take turns decoding on a
+ *  shared pool of --jobs threads.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "flac123.h"
+
+/* frames a session decodes in one turn before the others get theirs */
+#define DAEMON_SLICE 32
+
+/* the longest the daemon thread sleeps without looking at the sessions,
+ * in milliseconds */
+#define DAEMON_TICK 250
+
+/* wake_at of a session that only a command can wake */
+#define NEVER 1e30
+
+typedef struct daemon_session {
+    remote_session remote;
+    file_info_struct info;
+    file_info_struct next;   /* the QUEUEd track */
+    player_stats stats;
+    int fd;
+    char buf[REMOTE_LINE_MAX]; /* what has been read of the next command */
+    size_t used;
+    FLAC__bool eof;          /* the client has closed its end */
+    FLAC__bool eof_queued;
+    FLAC__bool draining;     /* track decoded, output still playing */
+    FLAC__bool done;         /* QUIT or the end of input has been run */
+    double wake_at;          /* when it wants another turn */
+    atomic_int running;      /* a turn is on the pool */
+    struct daemon_session *link;
+} daemon_session;
+
+static volatile sig_atomic_t stop;
+
+/* written to by every turn that ends, so the daemon thread hands out the
+ * next one */
+static int wake_pipe[2] = { -1, -1 };
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void daemon_signal(int sig)
+{
+    stop = 1;
+}
+
+/* a turn of d on the pool: its commands, then up to DAEMON_SLICE frames
+ * as long as its ring is less than half full */
+static void session_turn(void *arg)
+{
+    daemon_session *d = (daemon_session *) arg;
+    file_info_struct *p = &d->info;
+    unsigned frames, pending, want = cli_args.ring_time / 2;
+    int status = remote_run(&d->remote);
+
+    for (frames = 0; status == 0 && p->is_playing && frames < DAEMON_SLICE; frames++)
+    {
+	if (p->ring && ring_pending_ms(p->ring) >= want)
+	    break;
+
+	d->draining = remote_decode(p);
+	status = remote_run(&d->remote);
+    }
+
+    d->wake_at = NEVER;
+    if (status != 0)
+    {
+	d->done = true;
+    }
+    else if (p->is_playing)
+    {
+	/* back when the ring is down to half full */
+	pending = p->ring ? ring_pending_ms(p->ring) : 0;
+	d->wake_at = now() + (pending > want ? (pending - want) / 1000.0 : 0);
+    }
+    else if (d->draining && !p->is_loaded)
+    {
+	/* report the end of the track once it has actually been heard */
+	if ((pending = ring_pending_ms(p->ring)) > 0)
+	{
+	    d->wake_at = now() + pending / 1000.0;
+	}
+	else
+	{
+	    status_state(&d->remote, 0);
+	    d->draining = false;
+	}
+    }
+
+    status_flush(&d->remote);
+    atomic_store(&d->running, 0);
+
+    if (write(wake_pipe[1], "", 1) < 0)
+    {
+	/* the pipe is full, so the daemon thread is awake already */
+    }
+}
+
+static daemon_session *session_new(int fd)
+{
+    daemon_session *d = calloc(1, sizeof(daemon_session));
+    FILE *out = NULL;
+    int copy;
+
+    if (d && (copy = dup(fd)) >= 0 && !(out = fdopen(copy, "w")))
+	close(copy);
+    if (!d || !out)
+    {
+	fprintf(stderr, "Error starting a session: %s\n", strerror(errno));
+	free(d);
+	return NULL;
+    }
+
+    d->fd = fd;
+    d->info.next = &d->next;
+    d->info.stats = d->next.stats = &d->stats;
+    d->wake_at = NEVER;
+    if (!remote_open(&d->remote, &d->info, out, out))
+    {
+	fprintf(stderr, "Out of memory\n");
+	fclose(out);
+	free(d);
+	return NULL;
+    }
+
+    /* ring_new() falls back to synchronous output by itself */
+    if (cli_args.ring_time > 0)
+	d->info.ring = ring_new(cli_args.ring_time, &d->stats.output);
+
+    status_ready(&d->remote);
+    status_flush(&d->remote);
+
+    return d;
+}
+
+/* end a session that is not having a turn */
+static void session_free(daemon_session *d)
+{
+    file_info_struct *p = &d->info;
+
+    if (p->is_loaded)
+	decoder_destructor(p);
+    preload_discard(p);
+
+    if (p->ring)
+    {
+	ring_flush(p->ring);
+	ring_free(p->ring);
+    }
+    if (p->writer)
+	writer_close(p->writer);
+    if (p->ao_dev)
+    {
+	pthread_mutex_lock(&ao_lock);
+	ao_close(p->ao_dev);
+	pthread_mutex_unlock(&ao_lock);
+    }
+
+    remote_close(&d->remote);
+    fclose(d->remote.out);
+    close(d->fd);
+
+    free(p->aobuf);
+    free(p->noise);
+    free(d->next.aobuf);
+    free(d->next.noise);
+    free(d);
+}
+
+/* read what the client sent and queue its commands */
+static void session_read(daemon_session *d, FLAC__bool readable)
+{
+    ssize_t num_read;
+
+    if (readable && !d->eof)
+    {
+	num_read = read(d->fd, d->buf + d->used, (REMOTE_LINE_MAX - 1) - d->used);
+	if (num_read > 0)
+	    d->used += num_read;
+	else if (num_read == 0 || (errno != EINTR && errno != EAGAIN))
+	    d->eof = true;
+    }
+
+    /* a full queue leaves lines in buf, they are tried again next time */
+    if ((d->used > 0 || d->eof) && !d->eof_queued &&
+	remote_input(&d->remote, d->buf, &d->used, d->eof, false) && d->eof)
+    {
+	d->eof_queued = true;
+    }
+}
+
+static int daemon_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+	fprintf(stderr, "Socket path %s is too long\n", path);
+	return -1;
+    }
+
+    /* a socket left behind by an earlier daemon, but nothing else */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+	unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	listen(fd, SOMAXCONN) != 0)
+    {
+	fprintf(stderr, "Error listening on %s: %s\n", path, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+/* serve sessions on the socket at path until SIGINT or SIGTERM */
+int daemon_run(const char *path)
+{
+    daemon_session *sessions = NULL, *d, **link;
+    thread_pool *pool;
+    struct pollfd *fds = NULL, *grown;
+    unsigned i, count = 0, size = 0;
+    unsigned threads = cli_args.jobs > 0 ? (unsigned) cli_args.jobs : pool_cpus();
+    int listener, fd, timeout;
+    char drain[64];
+    double t;
+
+    if ((listener = daemon_listen(path)) < 0)
+	return 1;
+
+    if (pipe(wake_pipe) != 0 ||
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) != 0 ||
+	!(pool = pool_new(threads)))
+    {
+	fprintf(stderr, "Error starting decoder threads\n");
+	close(listener);
+	unlink(path);
+	return 1;
+    }
+
+    /* a client that goes away must not take the daemon with it */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, daemon_signal);
+    signal(SIGTERM, daemon_signal);
+
+    while (!stop)
+    {
+	if (count + 2 > size)
+	{
+	    if (!(grown = realloc(fds, (count + 16) * sizeof(struct pollfd))))
+	    {
+		fprintf(stderr, "Out of memory\n");
+		break;
+	    }
+	    fds = grown;
+	    size = count + 16;
+	}
+
+	/* hand out turns, and find out how long nobody needs one */
+	t = now();
+	timeout = DAEMON_TICK;
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	fds[1].fd = wake_pipe[0];
+	fds[1].events = POLLIN;
+	for (d = sessions, i = 2; d; d = d->link, i++)
+	{
+	    if (!atomic_load(&d->running) && !d->done)
+	    {
+		if (remote_has_commands(&d->remote) || d->wake_at <= t)
+		{
+		    atomic_store(&d->running, 1);
+		    pool_submit(pool, session_turn, d);
+		}
+		else if (d->wake_at < t + timeout / 1000.0)
+		{
+		    timeout = (int) ((d->wake_at - t) * 1000) + 1;
+		}
+	    }
+
+	    /* a full buffer waits until the queue has room again */
+	    fds[i].fd = d->fd;
+	    fds[i].events = d->eof || d->used == REMOTE_LINE_MAX - 1 ? 0 : POLLIN;
+	    fds[i].revents = 0;
+	}
+
+	if (poll(fds, i, timeout) < 0 && errno != EINTR)
+	{
+	    fprintf(stderr, "Error waiting for sessions: %s\n", strerror(errno));
+	    break;
+	}
+
+	while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+	{
+	}
+
+	for (link = &sessions, i = 2; (d = *link); i++)
+	{
+	    session_read(d, (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0);
+
+	    if (!atomic_load(&d->running) && d->done)
+	    {
+		*link = d->link;
+		session_free(d);
+		count--;
+	    }
+	    else
+	    {
+		link = &d->link;
+	    }
+	}
+
+	/* new sessions go to the end, after those polled above */
+	if (fds[0].revents & POLLIN)
+	{
+	    if ((fd = accept(listener, NULL, NULL)) < 0)
+	    {
+		if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+		    fprintf(stderr, "Error accepting a session: %s\n", strerror(errno));
+	    }
+	    else if ((d = session_new(fd)))
+	    {
+		*link = d;
+		count++;
+	    }
+	    else
+	    {
+		close(fd);
+	    }
+	}
+    }
+
+    /* let the turns on the pool finish, then end every session */
+    pool_wait(pool);
+    while ((d = sessions))
+    {
+	sessions = d->link;
+	session_free(d);
+    }
+    pool_free(pool);
+
+    close(listener);
+    unlink(path);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    free(fds);
+
+    return 0;
+}
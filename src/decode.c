@@ -0,0 +1,528 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This decode.c module is the decoder of flac123 and of libflac123:
+ *  opening a file and its decoder, seeking, and the decoder callbacks
+ *  with the conversion of every frame, which then goes to the pcm_fn of
+ *  the track.  All state is in the file_info_struct that is passed in,
+ *  so any number of tracks can be decoded on threads of their own.  It
+ *  reads decode_args, never cli_args, and nothing of the output.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+
+/* set by main(); libflac123 keeps these defaults */
+decode_var_struct decode_args = { REPLAYGAIN_OFF, 0, 0, 0, 0, { 0 }, 0 };
+
+/* how far decoder_seek() reads ahead to extend the frame table */
+#define SEEK_SCAN_BYTES (2 << 20)
+
+/* release the decoder of t and its input, or its --pcm-cache samples */
+void decoder_close(file_info_struct *t)
+{
+    FLAC__bool md5_ok;
+
+    index_store(t);
+    frames_free(&t->frames);
+    t->skip_samples = 0;
+    pcmcache_release(t);
+
+    /* libFLAC stops checking the MD5 once the decoder seeks, and a
+     * --start or --end clip is not all of the audio */
+    if (t->decoder) {
+	md5_ok = FLAC__stream_decoder_finish(t->decoder);
+	if (!md5_ok && !t->md5_checked && t->total_samples &&
+	    t->current_sample >= t->total_samples && !t->start_sample && !t->end_sample)
+	{
+	    fprintf(t->session ? t->session->err : stderr, "%sMD5 signature mismatch in %s\n",
+		    t->session ? "@E " : "", t->filename);
+	}
+	pcmcache_end(t, md5_ok);
+	FLAC__stream_decoder_delete(t->decoder);
+	t->decoder = NULL;
+    }
+    t->start_sample = t->end_sample = 0;
+    input_close(t->input);
+    t->input = NULL;
+    resample_free(t->resampler);
+    t->resampler = NULL;
+}
+
+/* the PCM flac_write_hdl() makes of the largest frame of t */
+size_t frame_bytes(const file_info_struct *t)
+{
+    if (t->resampler)
+	return resample_bytes(t->resampler, t->max_blocksize);
+    return (size_t) t->max_blocksize * t->ao_fmt.channels * ((t->ao_fmt.bits + 7) / 8);
+}
+
+/* set up the --output-format conversion of t, if it needs one, and size
+ * the scratch buffers of flac_write_hdl for its largest frame, so that
+ * decoding does not have to allocate.  --realtime also makes room for
+ * the frame table of the whole file.  False if out of memory. */
+FLAC__bool decoder_reserve(file_info_struct *t)
+{
+    const ao_sample_format *fmt = output_format(t);
+    unsigned values = t->max_blocksize * t->ao_fmt.channels;
+    size_t size;
+    uint_8 *grown;
+
+    if (!t->resampler && (fmt->rate != t->ao_fmt.rate || fmt->bits != t->ao_fmt.bits ||
+			  fmt->channels != t->ao_fmt.channels))
+    {
+	t->resampler = resample_new(t->ao_fmt.rate, t->ao_fmt.channels,
+				    t->ao_fmt.bits, t->max_blocksize);
+	if (!t->resampler)
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    return false;
+	}
+    }
+
+    size = frame_bytes(t) + CONVERT_SLACK;
+    if (size > t->aobuf_size && (grown = realloc(t->aobuf, size)))
+    {
+	t->aobuf = grown;
+	t->aobuf_size = size;
+	realtime_prefault(t->aobuf, t->aobuf_size);
+    }
+
+    /* the volume may still make the gain fractional */
+    if (decode_args.dither)
+	gain_reserve(t, values);
+
+    if (decode_args.realtime && t->total_samples && t->max_blocksize)
+	frames_reserve(&t->frames, t->total_samples / t->max_blocksize + 2);
+
+    return true;
+}
+
+/* create a decoder for filename and read its metadata and tags.  The
+ * decoder callbacks always get p; while p->preloading is set they and
+ * this function fill in p->next instead. */
+FLAC__bool decoder_open(file_info_struct *p, const char *filename)
+{
+    file_info_struct *t = p->preloading ? p->next : p;
+    FLAC__StreamDecoderInitStatus status;
+    FLAC__uint64 first_frame, start = stats_clock();
+    FLAC__bool indexed;
+    int len = strlen(filename);
+    int max_len = len < PATH_MAX ? len : PATH_MAX-1;
+
+    t->filename[max_len] = '\0';
+    strncpy(t->filename, filename, max_len);
+
+    memset(t->title, ' ', VORBIS_TAG_LEN);
+    t->title[VORBIS_TAG_LEN] = '\0';
+    memset(t->artist, ' ', VORBIS_TAG_LEN);
+    t->artist[VORBIS_TAG_LEN] = '\0';
+    memset(t->album, ' ', VORBIS_TAG_LEN);
+    t->album[VORBIS_TAG_LEN] = '\0';
+    memset(t->genre, ' ', VORBIS_TAG_LEN);
+    t->genre[VORBIS_TAG_LEN] = '\0';
+    memset(t->comment, ' ', VORBIS_TAG_LEN);
+    t->comment[VORBIS_TAG_LEN] = '\0';
+    memset(t->year, ' ', VORBIS_YEAR_LEN);
+    t->year[VORBIS_YEAR_LEN] = '\0';
+    t->has_tags = t->has_track_gain = t->has_album_gain = false;
+    t->track_peak = t->album_peak = 0;
+    t->errors = 0;
+    t->md5_checked = false;
+
+    /* tags and frame offsets of a file played before */
+    indexed = index_lookup(t, filename);
+
+    /* create and initialize flac decoder object.  The tags come with
+     * the rest of the metadata, so the file is not read twice. */
+    t->decoder = FLAC__stream_decoder_new();
+    FLAC__stream_decoder_set_md5_checking(t->decoder, t->testing || !decode_args.no_md5);
+    FLAC__stream_decoder_set_metadata_respond(t->decoder, FLAC__METADATA_TYPE_VORBIS_COMMENT);
+
+    /* serve the file from memory, or a pipe from the read-ahead thread,
+     * unless it cannot be mapped */
+    if ((t->input = input_open(filename))) {
+	if (indexed)
+	    input_skip_metadata(t->input, t->frames.offset[0]);
+	status = (input_is_ogg(t->input) ? FLAC__stream_decoder_init_ogg_stream :
+		  FLAC__stream_decoder_init_stream)(t->decoder, input_read_hdl,
+						    input_seek_hdl, input_tell_hdl,
+						    input_length_hdl, input_eof_hdl,
+						    flac_write_hdl, flac_metadata_hdl,
+						    flac_error_hdl, (void *)p);
+	if (status == FLAC__STREAM_DECODER_INIT_STATUS_UNSUPPORTED_CONTAINER)
+	    fprintf(stderr, "%s is Ogg FLAC, which this libFLAC cannot read\n", filename);
+    } else if (input_is_stream(filename)) {
+	status = FLAC__STREAM_DECODER_INIT_STATUS_ERROR_OPENING_FILE;
+    } else {
+	status = FLAC__stream_decoder_init_file(t->decoder, filename, flac_write_hdl, flac_metadata_hdl, flac_error_hdl, (void *)p);
+    }
+
+    /* read metadata */
+    if ((status != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+	|| (!FLAC__stream_decoder_process_until_end_of_metadata(t->decoder)))
+    {
+	decoder_close(t);
+	return false;
+    }
+
+    /* the index db skipped the metadata, but it was not this file */
+    if (indexed && !index_verify(t))
+	t->has_tags = get_vorbis_comments(t, filename);
+    if (t->frames.count == 0 &&
+	FLAC__stream_decoder_get_decode_position(t->decoder, &first_frame))
+    {
+	frames_add(&t->frames, 0, first_frame);
+    }
+    gain_update(t);
+    if (!decoder_reserve(t))
+    {
+	decoder_close(t);
+	return false;
+    }
+
+    if (p->stats)
+	stats_since(&p->stats->open, start);
+
+    return true;
+}
+
+/* what the output of p is opened for: --output-format, or the format
+ * of the file */
+const ao_sample_format *output_format(const file_info_struct *p)
+{
+    return decode_args.output_fmt.rate ? &decode_args.output_fmt : &p->ao_fmt;
+}
+
+/* decode the next frame of p, or of p->next while preloading */
+FLAC__bool decoder_process(file_info_struct *p)
+{
+    file_info_struct *t = p->preloading ? p->next : p;
+    FLAC__uint64 start;
+    FLAC__bool ok;
+
+    /* --pcm-cache has the samples already */
+    if (!p->stats)
+	return t->cached ? pcmcache_decode(p) : FLAC__stream_decoder_process_single(t->decoder);
+
+    start = stats_clock();
+    ok = t->cached ? pcmcache_decode(p) : FLAC__stream_decoder_process_single(t->decoder);
+    stats_since(&p->stats->decode, start);
+
+    return ok;
+}
+
+/* the state of the decoder of p, or as good as, when it plays from
+ * --pcm-cache */
+FLAC__StreamDecoderState decoder_state(const file_info_struct *p)
+{
+    if (p->cached)
+	return pcmcache_ended(p) ? FLAC__STREAM_DECODER_END_OF_STREAM :
+	    FLAC__STREAM_DECODER_READ_FRAME;
+    return FLAC__stream_decoder_get_state(p->decoder);
+}
+
+void decoder_destructor(file_info_struct *p)
+{
+    decoder_close(p);
+    p->pending_len = 0;
+    p->is_loaded  = false;
+    p->is_playing = false;
+    p->filename[0] = '\0';
+}
+
+/* continue decoding p at the frame starting at offset with frame_sample,
+ * from sample on */
+static FLAC__bool decoder_jump(file_info_struct *p, FLAC__uint64 offset,
+			       FLAC__uint64 frame_sample, FLAC__uint64 sample)
+{
+    if (!FLAC__stream_decoder_flush(p->decoder))
+	return false;
+
+    input_set_position(p->input, offset);
+    p->skip_samples = sample - frame_sample;
+    return true;
+}
+
+/*
+ * Seek the track of p to sample.  A frame the frame table covers, or
+ * does after reading ahead a little, is just jumped to and the rest of
+ * it skipped in flac_write_hdl().  Frames farther away are looked for by
+ * their headers in the mapped file.  Only when the file is not mapped
+ * does libFLAC have to search, decoding frames as it goes.
+ */
+static FLAC__bool decoder_find(file_info_struct *p, FLAC__uint64 sample)
+{
+    FLAC__uint64 offset, frame_sample;
+    unsigned frame;
+    FLAC__bool ok;
+
+    /* with --pcm-cache, every sample is at hand */
+    if (p->cached)
+	return pcmcache_seek(p, sample);
+
+    /* the read-ahead thread of a pipe cannot go back */
+    if (p->input && !input_seekable(p->input))
+	return false;
+
+    if (p->input) {
+	if (frames_find(&p->frames, sample, &frame) ||
+	    (frames_scan(p, sample, SEEK_SCAN_BYTES) &&
+	     frames_find(&p->frames, sample, &frame)))
+	{
+	    return decoder_jump(p, p->frames.offset[frame], p->frames.sample[frame], sample);
+	}
+	if (frames_locate(p, sample, &offset, &frame_sample))
+	    return decoder_jump(p, offset, frame_sample, sample);
+    }
+
+    p->skip_samples = 0;
+    input_advise(p->input, INPUT_RANDOM);
+    ok = FLAC__stream_decoder_seek_absolute(p->decoder, sample);
+    input_advise(p->input, INPUT_SEQUENTIAL);
+
+    /* out of SEEK_ERROR, decoding goes on at the next frame found */
+    if (!ok && FLAC__stream_decoder_get_state(p->decoder) == FLAC__STREAM_DECODER_SEEK_ERROR)
+	FLAC__stream_decoder_flush(p->decoder);
+
+    return ok;
+}
+
+/* decoder_find(), counted in the seek stats */
+FLAC__bool decoder_seek(file_info_struct *p, FLAC__uint64 sample)
+{
+    FLAC__uint64 start = stats_clock();
+    FLAC__bool ok;
+
+    /* --pcm-cache keeps a file decoded straight through only */
+    pcmcache_end(p, false);
+    ok = decoder_find(p, sample);
+
+    /* the filter must not blend the old position into the new one */
+    resample_reset(p->resampler);
+    if (p->stats)
+	stats_since(&p->stats->seek, start);
+    return ok;
+}
+
+void flac_error_hdl(const FLAC__StreamDecoder *dec, 
+		    FLAC__StreamDecoderErrorStatus status, void *data)
+{
+    file_info_struct *p = (file_info_struct *) data;
+    FILE *err = p->session ? p->session->err : stderr;
+    const frame_table *f;
+    FLAC__uint64 offset;
+    unsigned frame;
+
+    if (p->stats)
+	stats_error(p->stats, status);
+    if (p->preloading)
+	p = p->next;
+    p->errors++;
+    pcmcache_end(p, false);
+
+    /* where the frame starts if the frame table knows, otherwise how far
+     * libFLAC got */
+    f = &p->frames;
+    if (frames_find(f, p->current_sample, &frame)) {
+	offset = f->offset[frame];
+    } else if (f->count && f->sample[f->count - 1] == p->current_sample) {
+	offset = f->offset[f->count - 1];
+    } else if (!FLAC__stream_decoder_get_decode_position(dec, &offset)) {
+	fprintf(err, "%sError decoding %s after sample %lu: %s\n", p->session ? "@E " : "",
+		p->filename, p->current_sample, FLAC__StreamDecoderErrorStatusString[status]);
+	return;
+    }
+
+    fprintf(err, "%sError decoding %s after sample %lu, at byte %llu: %s\n",
+	    p->session ? "@E " : "", p->filename, p->current_sample,
+	    (unsigned long long) offset, FLAC__StreamDecoderErrorStatusString[status]);
+}
+
+void flac_metadata_hdl(const FLAC__StreamDecoder *dec, 
+		       const FLAC__StreamMetadata *meta, void *data)
+{
+    file_info_struct *p = (file_info_struct *) data;
+
+    if (p->preloading)
+	p = p->next;
+
+    if(meta->type == FLAC__METADATA_TYPE_STREAMINFO) {
+	p->max_blocksize = meta->data.stream_info.max_blocksize;
+	p->sam_fmt.bits = meta->data.stream_info.bits_per_sample;
+	/* round odd sizes such as 12 or 20 bit up to whole bytes */
+	p->ao_fmt.bits = (p->sam_fmt.bits + 7) / 8 * 8;
+	if (p->sam_fmt.bits == 8 && decode_args.wide_8bit)
+	    p->ao_fmt.bits = 16;
+	p->ao_fmt.rate = meta->data.stream_info.sample_rate;
+	p->ao_fmt.channels = meta->data.stream_info.channels;
+	p->ao_fmt.byte_format = AO_FMT_NATIVE;
+	FLAC__ASSERT(meta->data.stream_info.total_samples <
+		     0x100000000); /* we can handle < 4 gigasamples */
+	p->total_samples = (unsigned) 
+	    (meta->data.stream_info.total_samples & 0xffffffff);
+	p->current_sample = 0;
+	p->total_time = (((float) p->total_samples) / p->ao_fmt.rate);
+	p->elapsed_time = 0;
+    }
+    else if (meta->type == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
+	if (vorbis_comment_parse(p, &meta->data.vorbis_comment))
+	    p->has_tags = true;
+    }
+}
+
+FLAC__StreamDecoderWriteStatus flac_write_hdl(const FLAC__StreamDecoder *dec, 
+					      const FLAC__Frame *frame, 
+					      const FLAC__int32 * const buf[], 
+					      void *data)
+{
+    uint_32 num_samples = frame->header.blocksize;
+    file_info_struct *p = (file_info_struct *) data;
+    FLAC__bool preloading = p->preloading;
+    uint_32 decoded_size;
+    float elapsed;
+    const FLAC__int32 *trimmed[FLAC__MAX_CHANNELS];
+    FLAC__uint64 sample, offset;
+    unsigned channel, skip;
+    FLAC__uint64 start = 0, stage = 0, lap;
+    FLAC__bool timed;
+
+    if (preloading)
+	p = p->next;
+
+    /* p->next shares the stats of p */
+    if ((timed = p->bench || p->stats))
+	start = stage = stats_clock();
+
+    /* extend the frame table while decoding straight through the file.
+     * --realtime only fills what decoder_reserve() made room for, and
+     * only for a mapped file, whose position costs no system call. */
+    if (frame->header.number_type == FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER &&
+	p->frames.count && !p->frames.complete &&
+	(!decode_args.realtime || (p->input && p->frames.count < p->frames.size)) &&
+	(sample = frame->header.number.sample_number) ==
+	p->frames.sample[p->frames.count - 1] &&
+	FLAC__stream_decoder_get_decode_position(dec, &offset))
+    {
+	/* the position is already past this frame */
+	frames_add(&p->frames, sample + num_samples, offset);
+	if (p->total_samples && sample + num_samples >= p->total_samples)
+	    p->frames.complete = true;
+    }
+
+    /* decoder_seek() landed at the start of the frame */
+    if (p->skip_samples) {
+	skip = p->skip_samples < num_samples ? (unsigned) p->skip_samples : num_samples;
+	for (channel = 0; channel < frame->header.channels; channel++)
+	    trimmed[channel] = buf[channel] + skip;
+	buf = trimmed;
+	num_samples -= skip;
+	p->skip_samples -= skip;
+    }
+
+    /* --end cuts the last frame short.  Of a pipe that could not seek to
+     * --start whole frames are skipped. */
+    if (p->end_sample && p->current_sample + num_samples > p->end_sample)
+	num_samples = p->current_sample < p->end_sample ? p->end_sample - p->current_sample : 0;
+    if (num_samples == 0)
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+
+    /* --analyze measures the samples instead of playing them, --test
+     * only decodes them */
+    if (p->sample_fn) {
+	if (!p->sample_fn(p, buf, num_samples))
+	    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	p->current_sample += num_samples;
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    /* --pcm-cache keeps them for playing from memory next time */
+    if (p->caching && !pcmcache_store(p->caching, buf, p->current_sample, num_samples))
+	pcmcache_end(p, false);
+
+    if (p->resampler)
+	decoded_size = resample_bytes(p->resampler, num_samples);
+    else
+	decoded_size = num_samples * frame->header.channels * (p->ao_fmt.bits / 8);
+
+    /* every decoder converts into its own buffer, see decoder_reserve() */
+    if (decoded_size + CONVERT_SLACK > p->aobuf_size) {
+	uint_8 *grown = realloc(p->aobuf, decoded_size + CONVERT_SLACK);
+
+	if (!grown)
+	    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	p->aobuf = grown;
+	p->aobuf_size = decoded_size + CONVERT_SLACK;
+    }
+
+    /* the last frame of the file or clip also empties the resampler's
+     * filter */
+    if (p->resampler)
+	decoded_size = resample_frame(p->resampler, p->aobuf, buf, num_samples, p->gain,
+				      p->end_sample ?
+				      p->current_sample + num_samples >= p->end_sample :
+				      p->total_samples &&
+				      p->current_sample + num_samples >= p->total_samples);
+    else
+	gain_convert(p, p->aobuf, buf, frame->header.channels, num_samples);
+    if (timed) {
+	lap = stats_lap(&stage);
+	if (p->bench)
+	    p->bench->convert_ns += lap;
+	if (p->stats)
+	    stats_record(&p->stats->convert, lap);
+    }
+
+    if (preloading) {
+	/* held back until preload_splice().  The tail of the resampler, or
+	 * a frame above max_blocksize, may not fit. */
+	if (p->prefetch_len + decoded_size > p->prefetch_size) {
+	    uint_8 *grown = realloc(p->prefetch, p->prefetch_len + decoded_size);
+
+	    if (!grown)
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	    p->prefetch = grown;
+	    p->prefetch_size = p->prefetch_len + decoded_size;
+	}
+	memcpy(p->prefetch + p->prefetch_len, p->aobuf, decoded_size);
+	p->prefetch_len += decoded_size;
+    } else if (p->pcm_fn) {
+	p->pcm_fn(p, p->aobuf, decoded_size);
+    } else {
+	/* flac123_read() copies it out */
+	p->pending = p->aobuf;
+	p->pending_len = decoded_size;
+    }
+    if (p->bench)
+	p->bench->output_ns += stats_lap(&stage);
+
+    p->current_sample += num_samples;
+    elapsed = ((float) num_samples) / frame->header.sample_rate;
+    p->elapsed_time += elapsed;
+
+    /* remote_decode() prints the status line */
+    p->frame_samples = num_samples;
+
+    if (p->stats)
+	stats_frame(p->stats, num_samples);
+    if (p->bench)
+	p->bench->write_ns += stats_clock() - start;
+
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
@@ -0,0 +1,389 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This export.c module speeds up writing a long file with --wav by
+ *  decoding it on several threads.  FLAC frames decode independently, so
+ *  the file is cut at frame boundaries, taken from the frame table of the
+ *  index db, the SEEKTABLE or a scan for frame headers, and every stretch
+ *  gets its own decoder.  The stretches are written out in order and the
+ *  result is the same as that of a single decoder, MD5 check included.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+
+/* compressed bytes per stretch, and the least worth splitting off */
+#define EXPORT_CHUNK_BYTES (4 << 20)
+#define EXPORT_MIN_CHUNK_BYTES (256 << 10)
+
+/* stretches decoded ahead of the one being written, per thread */
+#define EXPORT_AHEAD 2
+
+typedef struct {
+    FLAC__uint64 offset;     /* of a frame header */
+    FLAC__uint64 sample;     /* its first sample */
+} split_point;
+
+typedef struct {
+    file_info_struct info;   /* first: the decoder callbacks get a chunk */
+    input_source *source;
+    FLAC__uint64 start, end; /* bytes */
+    FLAC__uint64 first_sample, samples;
+    FLAC__uint64 decoded;
+    unsigned md5_bytes;      /* per sample, 0 if pcm is the MD5 input */
+    uint_8 *pcm;             /* converted for output */
+    size_t pcm_len;
+    uint_8 *md5;             /* laid out for the signature */
+    size_t md5_len;
+    FLAC__bool ok;
+    FLAC__bool done;
+    pthread_mutex_t *lock;
+    pthread_cond_t *finished;
+} export_chunk;
+
+static FLAC__bool host_little_endian(void)
+{
+    const uint_16 one = 1;
+
+    return *(const uint_8 *) &one == 1;
+}
+
+/* the seek points of the SEEKTABLE that really point at frame headers */
+static unsigned seektable_points(const file_info_struct *p, const FLAC__byte *map,
+				 size_t size, FLAC__uint64 first_frame,
+				 FLAC__bool variable, split_point *points, unsigned max)
+{
+    FLAC__uint64 sample, offset, found;
+    size_t pos = 4, len, i;
+    unsigned count = 0, j, type, blocksize;
+    FLAC__bool last = false;
+
+    while (!last && pos + 4 <= size) {
+	type = map[pos] & 0x7F;
+	last = (map[pos] & 0x80) != 0;
+	len = (size_t) map[pos + 1] << 16 | (size_t) map[pos + 2] << 8 | map[pos + 3];
+	pos += 4;
+	if (pos + len > size)
+	    break;
+
+	if (type == FLAC__METADATA_TYPE_SEEKTABLE) {
+	    for (i = 0; i + 18 <= len && count < max; i += 18) {
+		sample = offset = 0;
+		for (j = 0; j < 8; j++) {
+		    sample = sample << 8 | map[pos + i + j];
+		    offset = offset << 8 | map[pos + i + 8 + j];
+		}
+		if (sample == FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER ||
+		    offset >= size - first_frame ||
+		    !frame_header_at(map + first_frame + offset, size - first_frame - offset,
+				     p, variable, &found, &blocksize) || found != sample)
+		{
+		    continue;
+		}
+		points[count].offset = first_frame + offset;
+		points[count].sample = sample;
+		count++;
+	    }
+	    break;
+	}
+	pos += len;
+    }
+    return count;
+}
+
+/*
+ * Cut the frames between first_frame and size into about want stretches.
+ * split[0] is the first frame and split[count] the end of the stream;
+ * returns count.  Known frame offsets are used when there are any,
+ * otherwise the file is searched for frame headers.
+ */
+static unsigned export_splits(const file_info_struct *p, const FLAC__byte *map,
+			      size_t size, FLAC__uint64 first_frame, unsigned want,
+			      split_point *split)
+{
+    const frame_table *f = &p->frames;
+    FLAC__bool variable = (map[first_frame + 1] & 1) != 0;
+    split_point *known = NULL;
+    unsigned n = 0, count = 1, k = 0, i, blocksize;
+    FLAC__uint64 target, o, sample;
+
+    split[0].offset = first_frame;
+    split[0].sample = 0;
+
+    if (f->complete && f->count > 2 && (known = malloc(f->count * sizeof(split_point)))) {
+	for (i = 1; i + 1 < f->count; i++) {
+	    known[n].offset = f->offset[i];
+	    known[n].sample = f->sample[i];
+	    n++;
+	}
+    } else if ((known = malloc(65536 * sizeof(split_point)))) {
+	n = seektable_points(p, map, size, first_frame, variable, known, 65536);
+    }
+    if (n < want)
+	n = 0; /* too sparse, look for frame headers instead */
+
+    for (i = 1; i < want; i++) {
+	target = first_frame + (size - first_frame) / want * i;
+
+	if (n) {
+	    while (k < n && (known[k].offset < target ||
+			     known[k].sample <= split[count - 1].sample))
+		k++;
+	    if (k == n)
+		break;
+	    split[count++] = known[k];
+	    continue;
+	}
+
+	/* stop at the next target, the stretch just gets longer */
+	for (o = target; o < size && o < target + (size - first_frame) / want; o++) {
+	    if (map[o] == 0xFF &&
+		frame_header_at(map + o, size - o, p, variable, &sample, &blocksize) &&
+		sample > split[count - 1].sample)
+	    {
+		split[count].offset = o;
+		split[count].sample = sample;
+		count++;
+		break;
+	    }
+	}
+    }
+    free(known);
+
+    split[count].offset = size;
+    split[count].sample = p->total_samples;
+    return count;
+}
+
+static FLAC__StreamDecoderWriteStatus export_write_hdl(const FLAC__StreamDecoder *dec,
+						       const FLAC__Frame *frame,
+						       const FLAC__int32 * const buf[],
+						       void *data)
+{
+    export_chunk *c = (export_chunk *) data;
+    unsigned samples = frame->header.blocksize;
+    unsigned channels = frame->header.channels;
+
+    /* a split point that was not a frame boundary after all */
+    if ((c->decoded == 0 &&
+	 (frame->header.number_type != FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER ||
+	  frame->header.number.sample_number != c->first_sample)) ||
+	c->decoded + samples > c->samples || channels != c->info.ao_fmt.channels)
+    {
+	c->ok = false;
+	return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+
+    gain_convert(&c->info, c->pcm + c->pcm_len, buf, channels, samples);
+    c->pcm_len += (size_t) samples * channels * (c->info.ao_fmt.bits / 8);
+    if (c->md5_bytes)
+	c->md5_len += md5_pack(c->md5 + c->md5_len, buf, channels, samples, c->md5_bytes);
+    c->decoded += samples;
+
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void export_error_hdl(const FLAC__StreamDecoder *dec,
+			     FLAC__StreamDecoderErrorStatus status, void *data)
+{
+    ((export_chunk *) data)->ok = false;
+}
+
+/* pool task: decode one stretch into memory */
+static void export_chunk_run(void *arg)
+{
+    export_chunk *c = (export_chunk *) arg;
+    FLAC__StreamDecoder *dec = FLAC__stream_decoder_new();
+
+    c->ok = dec && (c->info.input = input_slice(c->source, c->start, c->end)) &&
+	FLAC__stream_decoder_init_stream(dec, input_read_hdl, input_seek_hdl,
+					 input_tell_hdl, input_length_hdl,
+					 input_eof_hdl, export_write_hdl, NULL,
+					 export_error_hdl, c) == FLAC__STREAM_DECODER_INIT_STATUS_OK;
+    if (c->ok && !FLAC__stream_decoder_process_until_end_of_stream(dec))
+	c->ok = false;
+    if (c->decoded != c->samples)
+	c->ok = false;
+
+    if (dec)
+	FLAC__stream_decoder_delete(dec);
+    input_close(c->info.input);
+    c->info.input = NULL;
+
+    pthread_mutex_lock(c->lock);
+    c->done = true;
+    pthread_cond_broadcast(c->finished);
+    pthread_mutex_unlock(c->lock);
+}
+
+static void export_chunk_free(export_chunk *c)
+{
+    free(c->pcm);
+    free(c->md5);
+    c->pcm = c->md5 = NULL;
+}
+
+/*
+ * Write all of the file p has just opened to the output, decoding it on
+ * --jobs threads.  Returns false when it is left to the caller to decode
+ * the file, or the rest of it: when the file is too short to be worth it
+ * or cannot be split, or when a stretch failed to decode, in which case p
+ * has been moved to its start.  *stop ends the export early.
+ */
+FLAC__bool export_parallel(file_info_struct *p, volatile int *stop)
+{
+    unsigned threads = cli_args.jobs > 0 ? (unsigned) cli_args.jobs : pool_cpus();
+    unsigned bytes = (p->sam_fmt.bits + 7) / 8;
+    unsigned want, count, next = 0, written = 0, i;
+    size_t size, values;
+    const FLAC__byte *map;
+    FLAC__uint64 first_frame;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+    split_point *split;
+    export_chunk *chunks;
+    thread_pool *pool;
+    md5_context md5;
+    uint_8 digest[16];
+    static const uint_8 no_md5[16];
+    FLAC__bool check_md5 = !decode_args.no_md5;
+    FLAC__bool separate_md5 = check_md5 && !(p->gain == GAIN_UNITY && p->ao_fmt.bits == 8 * bytes &&
+				bytes > 1 && host_little_endian());
+
+    /* the dither of one decoder is a single random sequence, and the
+     * filter of the resampler runs across frames */
+    if (threads < 2 || p->resampler || !p->input || p->frames.count == 0 || p->total_samples == 0 ||
+	p->skip_samples || p->start_sample || p->end_sample || (decode_args.dither && (p->gain & (GAIN_UNITY - 1))))
+    {
+	return false;
+    }
+
+    map = input_map(p->input, &size);
+    first_frame = p->frames.offset[0];
+    if (size < 42 || memcmp(map, "fLaC", 4) != 0 || first_frame + 16 > size)
+	return false;
+
+    /* enough stretches to keep every thread busy, if they are not tiny */
+    if ((want = (size - first_frame) / EXPORT_CHUNK_BYTES) < EXPORT_AHEAD * threads) {
+	want = (size - first_frame) / EXPORT_MIN_CHUNK_BYTES;
+	if (want > EXPORT_AHEAD * threads)
+	    want = EXPORT_AHEAD * threads;
+    }
+    if (want < 2)
+	return false;
+
+    if (!(split = malloc((want + 1) * sizeof(split_point))))
+	return false;
+    if ((count = export_splits(p, map, size, first_frame, want, split)) < 2 ||
+	!(chunks = calloc(count, sizeof(export_chunk))))
+    {
+	free(split);
+	return false;
+    }
+    if (!(pool = pool_new(threads))) {
+	free(chunks);
+	free(split);
+	return false;
+    }
+
+    md5_init(&md5);
+
+    while (written < count && !*stop) {
+	/* keep a bounded number of stretches in memory */
+	while (next < count && next - written < EXPORT_AHEAD * threads) {
+	    export_chunk *c = &chunks[next];
+
+	    c->info.sam_fmt = p->sam_fmt;
+	    c->info.ao_fmt = p->ao_fmt;
+	    c->info.gain = p->gain;
+	    c->info.max_blocksize = p->max_blocksize;
+	    c->info.total_samples = p->total_samples;
+	    c->source = p->input;
+	    c->start = split[next].offset;
+	    c->end = split[next + 1].offset;
+	    c->first_sample = split[next].sample;
+	    c->samples = split[next + 1].sample - split[next].sample;
+	    c->md5_bytes = separate_md5 ? bytes : 0;
+	    c->lock = &lock;
+	    c->finished = &finished;
+	    values = (size_t) c->samples * p->ao_fmt.channels;
+	    c->pcm = malloc(values * (p->ao_fmt.bits / 8) + CONVERT_SLACK);
+	    c->md5 = separate_md5 ? malloc(values * bytes) : NULL;
+	    if (!c->pcm || (separate_md5 && !c->md5)) {
+		export_chunk_free(c);
+		c->done = true; /* and not ok */
+	    } else {
+		pool_submit(pool, export_chunk_run, c);
+	    }
+	    next++;
+	}
+
+	pthread_mutex_lock(&lock);
+	while (!chunks[written].done)
+	    pthread_cond_wait(&finished, &lock);
+	pthread_mutex_unlock(&lock);
+
+	if (!chunks[written].ok)
+	    break;
+
+	if (separate_md5)
+	    md5_update(&md5, chunks[written].md5, chunks[written].md5_len);
+	else if (check_md5)
+	    md5_update(&md5, chunks[written].pcm, chunks[written].pcm_len);
+	output_write(p, chunks[written].pcm, chunks[written].pcm_len);
+	p->current_sample += chunks[written].decoded;
+	p->elapsed_time = (float) p->current_sample / p->ao_fmt.rate;
+	export_chunk_free(&chunks[written]);
+	written++;
+    }
+
+    /* let the stretches still in flight finish before freeing them */
+    pool_wait(pool);
+    pool_free(pool);
+    for (i = written; i < count; i++)
+	export_chunk_free(&chunks[i]);
+    free(chunks);
+
+    if (*stop) {
+	free(split);
+	return true;
+    }
+
+    if (written < count) {
+	fprintf(stderr, "Parallel decoding of %s failed at sample %llu, "
+		"continuing on one thread without MD5 check\n", p->filename,
+		(unsigned long long) split[written].sample);
+	if (!decoder_seek(p, split[written].sample))
+	    fprintf(stderr, "Error seeking %s\n", p->filename);
+	free(split);
+	return false;
+    }
+    free(split);
+
+    /* the signature in STREAMINFO, all zero if the encoder did not set
+     * it.  The decoder has only read the metadata, so decoder_close()
+     * must not compare its own, empty MD5. */
+    md5_final(&md5, digest);
+    if (check_md5 && memcmp(map + 26, no_md5, 16) != 0 && memcmp(map + 26, digest, 16) != 0)
+	fprintf(stderr, "MD5 signature mismatch in %s\n", p->filename);
+    p->md5_checked = true;
+
+    return true;
+}
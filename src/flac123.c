@@ -18,52 +18,66 @@
  */
 
 #include <popt.h>
+#include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <signal.h>
 #include "flac123.h"
 #include "version.h"
 
-file_info_struct file_info = { NULL, {0,0,0,0}, {0,0,0,0}, NULL, "", 0,0,0,0, false };
+cli_var_struct cli_args = { NULL, NULL, NULL, 0, 0, 0, RING_TIME_DEFAULT, NULL, NULL, NULL, 0, 0, NULL, 0, 0, NULL, 0, NULL, 0, 0, 0, NULL };
 
-static int ao_output_id;
-
-typedef struct {
-    char *driver;
-    char *buffer_time;
-    char *wavfile;
-    int remote;
-    int quiet;
-    int version;
-} cli_var_struct;
-
-cli_var_struct cli_args = { NULL, NULL, NULL, 0, 0, 0 };
+static file_info_struct file_info = { NULL, NULL, {0,0,0,0}, {0,0,0,0}, NULL, "", 0,0,0,0, false };
+static file_info_struct next_info;
+static player_stats stats;
 
 struct poptOption cli_options[] = {
     /* longName, shortName, argInfo, arg, val, descrip, argDescrip */
     { "driver", 'd', POPT_ARG_STRING, (void *)&(cli_args.driver), 0, "set libao output driver (pulse, macosx, oss, etc).  Default is " AUDIO_DEFAULT, NULL },
-    { "wav", 'w', POPT_ARG_STRING, (void *)&(cli_args.wavfile), 0, "send output to wav file (use --wav=- and -q for stdout)", "FILENAME" },
+    { "wav", 'w', POPT_ARG_STRING, (void *)&(cli_args.wavfile), 0, "send output to wav file (use --wav=- and -q for stdout, --wav=fd:N for an open file descriptor)", "FILENAME" },
     { "remote", 'R', POPT_ARG_NONE, (void *)&(cli_args.remote), 0, "set remote mode for programmatic control", NULL },
     { "buffer-time", 'b', POPT_ARG_STRING, (void *)&(cli_args.buffer_time), 0, "override default hardware buffer size (in milliseconds)", "INT" },
+    { "ring-time", '\0', POPT_ARG_INT, (void *)&(cli_args.ring_time), 0, "decode this far ahead of the output device (in milliseconds, 0 disables)", "INT" },
+    { "read-ahead", '\0', POPT_ARG_INT, (void *)&(decode_args.read_ahead), 0, "buffer this much of a FILE that is - (stdin), fd:N, a FIFO or a device ahead of the decoder (in KiB, default 1024)", "INT" },
+    { "replaygain", '\0', POPT_ARG_STRING, (void *)&(cli_args.replaygain), 0, "apply the ReplayGain tags, clipping is prevented using the peak tags", "track|album" },
+    { "dither", '\0', POPT_ARG_NONE, (void *)&(decode_args.dither), 0, "add TPDF dither when the volume or ReplayGain requantizes the samples", NULL },
+    { "index-db", '\0', POPT_ARG_STRING, (void *)&(cli_args.index_db), 0, "remember metadata, tags and frame offsets of played files in this file", "PATH" },
+    { "outdir", 'o', POPT_ARG_STRING, (void *)&(cli_args.outdir), 0, "decode all FILES into wav files in this directory instead of playing them", "DIR" },
+    { "jobs", 'j', POPT_ARG_INT, (void *)&(cli_args.jobs), 0, "decode this many files (--outdir, --analyze, --test), scan this many directories (--scan), parts of a file (--wav) or sessions (--daemon) at once (default: one per cpu)", "INT" },
+    { "raw", '\0', POPT_ARG_NONE, (void *)&(cli_args.raw), 0, "with --wav or --outdir, write raw native endian PCM instead of wav", NULL },
+    { "rf64", '\0', POPT_ARG_NONE, (void *)&(cli_args.rf64), 0, "with --wav or --outdir, write RF64 even when the file stays below 4 GB", NULL },
+    { "progress-interval", '\0', POPT_ARG_STRING, (void *)&(cli_args.progress_interval), 0, "in remote mode, report the position every this many milliseconds, or samples after s: (default: every frame)", "[s:]INT" },
+    { "status-format", '\0', POPT_ARG_STRING, (void *)&(cli_args.status_format), 0, "print remote mode status lines as mpg123 text or as JSON objects", "text|json" },
+    { "daemon", '\0', POPT_ARG_STRING, (void *)&(cli_args.daemon), 0, "serve remote mode sessions to every connection to this unix socket", "PATH" },
+    { "bench", '\0', POPT_ARG_NONE, (void *)&(cli_args.bench), 0, "decode a generated corpus, or FILES, into the null driver and print the timings as JSON", NULL },
+    { "shm", '\0', POPT_ARG_STRING, (void *)&(cli_args.shm), 0, "write the PCM to a ring in this POSIX shared memory object instead of an audio device, see README.shm", "NAME" },
+    { "pcm-cache", '\0', POPT_ARG_STRING, (void *)&(cli_args.pcm_cache), 0, "keep the decoded audio of files played, up to this size in total, and play them from memory next time", "SIZE[K|M|G]" },
+    { "stats", '\0', POPT_ARG_NONE, (void *)&(cli_args.stats), 0, "print the performance counters to stderr when done (remote mode: at the end of a session)", NULL },
+    { "output-format", '\0', POPT_ARG_STRING, (void *)&(cli_args.output_format), 0, "convert every file to this sample rate, bit depth and channel count, so the device is never reopened", "RATE:BITS:CHANNELS" },
+    { "scan", '\0', POPT_ARG_NONE, (void *)&(cli_args.scan), 0, "print STREAMINFO, tags, SEEKTABLE and CUESHEET of every FLAC file in or under FILES as JSON lines, without decoding", NULL },
+    { "analyze", '\0', POPT_ARG_NONE, (void *)&(cli_args.analyze), 0, "instead of playing, measure the EBU R128 loudness, loudness range and peaks of FILES, and of all of them as an album, and print them as JSON", NULL },
+    { "write-replaygain", '\0', POPT_ARG_NONE, (void *)&(cli_args.write_replaygain), 0, "with --analyze, store the results as REPLAYGAIN_* tags (ReplayGain 2.0, -18 LUFS)", NULL },
+    { "test", 't', POPT_ARG_NONE, (void *)&(cli_args.test), 0, "instead of playing, decode FILES without output and check their MD5 signatures and frame CRCs; with --index-db, files tested before and not changed since are skipped", NULL },
+    { "no-md5", '\0', POPT_ARG_NONE, (void *)&(decode_args.no_md5), 0, "do not check the MD5 signature of the audio while playing", NULL },
+    { "start", '\0', POPT_ARG_STRING, (void *)&(cli_args.start), 0, "play or write out every file from this time or sample on", "[[H:]M:]S[.F]|s:SAMPLE" },
+    { "end", '\0', POPT_ARG_STRING, (void *)&(cli_args.end), 0, "stop every file at this time or sample", "[[H:]M:]S[.F]|s:SAMPLE" },
+    { "realtime", '\0', POPT_ARG_NONE, (void *)&(decode_args.realtime), 0, "lock memory, preallocate the buffers of the decoder and write to the device at SCHED_FIFO priority where permitted", NULL },
     { "quiet", 'q', POPT_ARG_NONE, (void *)&(cli_args.quiet), 0, "suppress text output", NULL },
     { "version", 'v', POPT_ARG_NONE, (void *)&(cli_args.version), 0, "version info", NULL},
     POPT_AUTOHELP
     POPT_TABLEEND
 };
 
-static void play_file(const char *);
+static void play_file(const char *, const char *);
 static void play_remote_file(void);
-void flac_error_hdl(const FLAC__StreamDecoder *, FLAC__StreamDecoderErrorStatus, void *);
-void flac_metadata_hdl(const FLAC__StreamDecoder *, const FLAC__StreamMetadata *, void *);
-FLAC__StreamDecoderWriteStatus flac_write_hdl(const FLAC__StreamDecoder *,
-	const FLAC__Frame *, const FLAC__int32 * const buf[], void *);
-
 static void signal_handler(int);
-static int quit_now = 0;
-static int interrupted = 0;
 
-float scale = 1;
-ao_option **ao_options = NULL;
+/* seconds before the end of a track at which the next one is preloaded */
+#define PRELOAD_TIME 2.0
+
+static int quit_now = 0;
+static volatile int interrupted = 0;
 
 int main(int argc, const char **argv)
 {
@@ -84,16 +98,88 @@ int main(int argc, const char **argv)
 	exit(1);
     }
 
+    if (cli_args.replaygain) {
+	if (strcasecmp(cli_args.replaygain, "track") == 0)
+	    decode_args.replaygain_mode = REPLAYGAIN_TRACK;
+	else if (strcasecmp(cli_args.replaygain, "album") == 0)
+	    decode_args.replaygain_mode = REPLAYGAIN_ALBUM;
+	else {
+	    fprintf(stderr, "--replaygain must be track or album\n");
+	    exit(1);
+	}
+    }
+
+    if (cli_args.progress_interval && !status_parse_interval(cli_args.progress_interval)) {
+	fprintf(stderr, "--progress-interval must be milliseconds or s:samples\n");
+	exit(1);
+    }
+
+    if ((cli_args.start && !clip_parse(cli_args.start, &cli_args.start_pos)) ||
+	(cli_args.end && !clip_parse(cli_args.end, &cli_args.end_pos))) {
+	fprintf(stderr, "--start and --end must be [[hours:]minutes:]seconds or s:sample\n");
+	exit(1);
+    }
+
+    if (cli_args.pcm_cache && !pcmcache_init(cli_args.pcm_cache)) {
+	fprintf(stderr, "--pcm-cache must be a size in bytes, or with K, M or G\n");
+	exit(1);
+    }
+
+    if (cli_args.output_format && !resample_parse_format(cli_args.output_format)) {
+	fprintf(stderr, "--output-format must be rate:bits:channels, with 8, 16, 24 or 32 bits\n");
+	exit(1);
+    }
+
+    if (cli_args.shm && cli_args.daemon) {
+	fprintf(stderr, "--shm cannot be shared by the sessions of --daemon\n");
+	exit(1);
+    }
+
+    if (cli_args.wavfile && cli_args.daemon) {
+	fprintf(stderr, "--wav cannot be shared by the sessions of --daemon, they have OUTPUT\n");
+	exit(1);
+    }
+
+    if (cli_args.status_format) {
+	if (strcasecmp(cli_args.status_format, "json") == 0)
+	    cli_args.status_json = 1;
+	else if (strcasecmp(cli_args.status_format, "text") != 0) {
+	    fprintf(stderr, "--status-format must be text or json\n");
+	    exit(1);
+	}
+    }
+
+    /* remote mode flushes its status lines itself, see status_flush() */
+    if (cli_args.remote || cli_args.daemon)
+	setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+
     if (cli_args.version) {
 	printf("flac123 version %s\n", FLAC123_VERSION);
         exit(0);
     }
 
-    if (!(cli_args.quiet || cli_args.remote)) {
+    if (!(cli_args.quiet || cli_args.remote || cli_args.daemon || cli_args.bench || cli_args.scan ||
+	  cli_args.analyze || cli_args.test)) {
         printf("flac123 version %s   'flac123 --help' for more info\n", FLAC123_VERSION);
     }
 
+    /* only reads metadata, no device or decoder is needed */
+    if (cli_args.scan) {
+	const char **paths = poptGetArgs(pc);
+	unsigned count = 0;
+
+	while (paths && paths[count])
+	    count++;
+	if (count == 0) {
+	    fprintf(stderr, "--scan needs a directory or file\n");
+	    exit(1);
+	}
+	return scan_run(paths, count) ? 1 : 0;
+    }
+
     ao_initialize();
+    convert_init();
+    resample_init();
 
     ao_options = malloc(1024);
     *ao_options = NULL;
@@ -101,6 +187,57 @@ int main(int argc, const char **argv)
 	ao_append_option(ao_options, "buffer_time", cli_args.buffer_time);
     }
 
+    /* every file is played into the null driver, which takes no time */
+    if (cli_args.bench) {
+	cli_args.driver = "null";
+	cli_args.wavfile = NULL;
+    }
+
+#ifdef DARWIN
+    /* the devices of macOS take no 8 bit samples */
+    decode_args.wide_8bit = !(cli_args.wavfile || cli_args.outdir);
+#endif
+
+    if (cli_args.analyze || cli_args.test) {
+	const char **files = poptGetArgs(pc);
+	unsigned count = 0;
+
+	if (cli_args.index_db)
+	    index_open(cli_args.index_db);
+	while (files && files[count])
+	    count++;
+	rc = cli_args.test ? verify_run(files, count) : analyze_run(files, count);
+	index_close();
+
+	ao_shutdown();
+	return rc ? 1 : 0;
+    }
+
+    if (cli_args.outdir && !cli_args.bench) {
+	const char **files = poptGetArgs(pc);
+	unsigned count = 0;
+	struct stat st;
+
+	if (mkdir(cli_args.outdir, 0777) != 0 && errno != EEXIST) {
+	    fprintf(stderr, "Error creating %s: %s\n", cli_args.outdir, strerror(errno));
+	    exit(1);
+	}
+	if (stat(cli_args.outdir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+	    fprintf(stderr, "%s is not a directory\n", cli_args.outdir);
+	    exit(1);
+	}
+
+	if (cli_args.index_db)
+	    index_open(cli_args.index_db);
+	while (files && files[count])
+	    count++;
+	rc = batch_run(files, count);
+	index_close();
+
+	ao_shutdown();
+	return rc ? 1 : 0;
+    }
+
     if (! cli_args.wavfile) {
       if (cli_args.driver) {
 	ao_output_id = ao_driver_id(cli_args.driver);
@@ -119,6 +256,45 @@ int main(int argc, const char **argv)
       }
     }
 
+    file_info.next = &next_info;
+    file_info.wavfile = cli_args.wavfile;
+    file_info.stats = next_info.stats = &stats;
+
+    if (cli_args.index_db)
+	index_open(cli_args.index_db);
+
+    if (cli_args.bench) {
+	const char **files = poptGetArgs(pc);
+	unsigned count = 0;
+
+	while (files && files[count])
+	    count++;
+	rc = bench_run(files, count);
+	index_close();
+	ao_shutdown();
+	return rc ? 1 : 0;
+    }
+
+    if (decode_args.realtime)
+	realtime_init();
+
+    if (cli_args.daemon) {
+	rc = daemon_run(cli_args.daemon);
+	index_close();
+	ao_shutdown();
+	return rc;
+    }
+
+    /* the ring of --shm takes the place of the output ring */
+    if (cli_args.ring_time > 0 && !cli_args.shm) {
+	if (!(file_info.ring = ring_new(cli_args.ring_time, &stats.output)))
+	    fprintf(stderr, "Falling back to synchronous output\n");
+    }
+
+    /* without a ring, this thread writes to the device itself */
+    if (!file_info.ring)
+	realtime_thread();
+
     if (cli_args.remote)
     {
 	play_remote_file();
@@ -130,300 +306,122 @@ int main(int argc, const char **argv)
 
 	do {
 	    if ((filename = poptGetArg(pc)))
-		play_file(filename);
+		play_file(filename, poptPeekArg(pc));
 	} while (filename != NULL && !quit_now);
     }
 
+    preload_discard(&file_info);
+    index_close();
+
+    if (file_info.ring) {
+	if (quit_now)
+	    ring_flush(file_info.ring);
+	ring_free(file_info.ring); /* plays out whatever is left */
+    }
+
     if (file_info.ao_dev)
 	ao_close(file_info.ao_dev);
+    shmring_close(file_info.shm);
+    if (file_info.writer)
+	writer_close(file_info.writer);
     ao_shutdown();
 
+    /* remote mode prints them at the end of the session */
+    if (cli_args.stats && !cli_args.remote)
+	stats_print(stderr, &stats, cli_args.status_json);
+
     return 0;
 }
 
-static void print_file_info(const char *filename)
+static void play_file(const char *filename, const char *next)
 {
-    FLAC__bool got_vorbis = get_vorbis_comments(filename);
+    FLAC__bool preload_tried = false;
+    FLAC__bool exported;
 
-    if (cli_args.remote)
+    /* a spliced track is already loaded and playing */
+    if (!file_info.is_loaded && !decoder_constructor(&file_info, filename))
     {
-	if (got_vorbis)
-	{
-	  fprintf(stderr, "@I ID3:%s%s%s%s%s%s\n",
-		   file_info.title,
-		   file_info.artist,
-		   file_info.album,
-		   file_info.year,
-		   file_info.comment,
-		   file_info.genre
-		);
-	}
-	else
-	{
-	    /* print filename without suffix */
-	    char *dupe = strdup(filename);
-	    char *dot = strrchr(dupe, '.');
-
-	    if (dot && dot == strstr(dupe, ".flac"))
-		*dot = '\0';
-
-	    fprintf(stderr, "@I %s\n", dupe);
-	    free(dupe);
-	}
-    }
-    else if (!cli_args.quiet)
-    {
-        printf("\n"
-	       "Title  : %s Artist: %s\n"
-	       "Album  : %s Year  : %s\n"
-	       "Comment: %s Genre : %s\n",
-	       file_info.title, file_info.artist,
-	       file_info.album, file_info.year,
-	       file_info.comment, file_info.genre);
-	printf("\nPlaying FLAC stream from %s\n", 
-	       strncasecmp(filename, "http://", 7) != 0 && 
-	       strchr(filename, '/') ? strrchr(filename, '/')+1 : filename);
-	printf("%d bit, %d Hz, %d channels, %lu total samples, "
-	       "%.2f total seconds\n", 
-	       file_info.sam_fmt.bits, file_info.ao_fmt.rate, 
-	       file_info.ao_fmt.channels, file_info.total_samples, 
-	       file_info.total_time);
+	fprintf(stderr, "Error opening %s\n", filename);
+	return;
     }
-}
 
-FLAC__bool decoder_constructor(const char *filename)
-{
-    int len = strlen(filename);
-    int max_len = len < PATH_MAX ? len : PATH_MAX-1;
-    static ao_sample_format previous_bitrate;
-    static int first_time = true;
-
-    file_info.filename[max_len] = '\0';
-    strncpy(file_info.filename, filename, max_len);
-
-    memset(file_info.title, ' ', VORBIS_TAG_LEN);
-    file_info.title[VORBIS_TAG_LEN] = '\0';
-    memset(file_info.artist, ' ', VORBIS_TAG_LEN);
-    file_info.artist[VORBIS_TAG_LEN] = '\0';
-    memset(file_info.album, ' ', VORBIS_TAG_LEN);
-    file_info.album[VORBIS_TAG_LEN] = '\0';
-    memset(file_info.genre, ' ', VORBIS_TAG_LEN);
-    file_info.genre[VORBIS_TAG_LEN] = '\0';
-    memset(file_info.comment, ' ', VORBIS_TAG_LEN);
-    file_info.comment[VORBIS_TAG_LEN] = '\0';
-    memset(file_info.year, ' ', VORBIS_YEAR_LEN);
-    file_info.year[VORBIS_YEAR_LEN] = '\0';
-
-    /* create and initialize flac decoder object */
-    file_info.decoder = FLAC__stream_decoder_new();
-    FLAC__stream_decoder_set_md5_checking(file_info.decoder, true);
-
-    /* read metadata */
-    if ((FLAC__stream_decoder_init_file(file_info.decoder, filename, flac_write_hdl, flac_metadata_hdl, flac_error_hdl, (void *)&file_info) != FLAC__STREAM_DECODER_INIT_STATUS_OK)
-	|| (!FLAC__stream_decoder_process_until_end_of_metadata(file_info.decoder)))
-    {
-	FLAC__stream_decoder_delete(file_info.decoder);
-	return false;
-    }
+    /* a file written out on several threads is done right away */
+    exported = cli_args.wavfile && export_parallel(&file_info, &interrupted);
 
-    /* open libao output device */
-    if (cli_args.wavfile) {
-	if (!(file_info.ao_dev = ao_open_file(ao_driver_id("wav"), cli_args.wavfile, /*overwrite*/ 1, &(file_info.ao_fmt), NULL)))
-	{
-	    fprintf(stderr, "Error opening wav file %s\n", cli_args.wavfile);
-	    FLAC__stream_decoder_delete(file_info.decoder);
-	    return false;
-	}
-    }
-    else if (first_time) {
-	if (!(file_info.ao_dev = ao_open_live(ao_output_id, &(file_info.ao_fmt), *ao_options)))
-	{
-	    fprintf(stderr, "Error opening ao device %d\n", ao_output_id);
-	    FLAC__stream_decoder_delete(file_info.decoder);
-	    return false;
-	}
-    }
-    else if (previous_bitrate.bits != file_info.ao_fmt.bits ||
-	previous_bitrate.rate != file_info.ao_fmt.rate ||
-	previous_bitrate.channels != file_info.ao_fmt.channels) 
+    while (!exported && decoder_process(&file_info) == true &&
+	   decoder_state(&file_info) < FLAC__STREAM_DECODER_END_OF_STREAM &&
+	   !clip_done(&file_info) && !interrupted)
     {
-        /* close the ao_device and re-open */
-	ao_close(file_info.ao_dev);
-	if (!(file_info.ao_dev = ao_open_live(ao_output_id, &(file_info.ao_fmt), *ao_options)))
+	if (next && !preload_tried &&
+	    file_info.total_time - file_info.elapsed_time < PRELOAD_TIME)
 	{
-	    fprintf(stderr, "Error opening ao device %d\n", ao_output_id);
-	    FLAC__stream_decoder_delete(file_info.decoder);
-	    return false;
+	    preload_tried = true;
+	    preload_open(&file_info, next);
 	}
     }
+    if (interrupted) {
+	ring_flush(file_info.ring); /* skip what is still queued, too */
+	shmring_flush(file_info.shm);
+    }
+    interrupted = 0; /* more accurate feedback if placed after loop */
 
-    print_file_info(filename);
-
-    previous_bitrate.bits = file_info.ao_fmt.bits;
-    previous_bitrate.rate = file_info.ao_fmt.rate;
-    previous_bitrate.channels = file_info.ao_fmt.channels;
-
-    first_time = false;
-    file_info.is_loaded  = true;
-    file_info.is_playing = true;
-
-    return true;
-}
-
-void decoder_destructor(void)
-{
-    FLAC__stream_decoder_finish(file_info.decoder);
-    FLAC__stream_decoder_delete(file_info.decoder);
-    file_info.is_loaded  = false;
-    file_info.is_playing = false;
-    file_info.filename[0] = '\0';
-}
-
-static void play_file(const char *filename)
-{
-    if (!decoder_constructor(filename))
+    if (next && !quit_now &&
+	(file_info.next->is_loaded || (!preload_tried && preload_open(&file_info, next))))
     {
-	fprintf(stderr, "Error opening %s\n", filename);
-	return;
+	preload_splice(&file_info);
     }
-
-    while (FLAC__stream_decoder_process_single(file_info.decoder) == true &&
-	   FLAC__stream_decoder_get_state(file_info.decoder) <
-	   FLAC__STREAM_DECODER_END_OF_STREAM && !interrupted)
+    else
     {
+	decoder_destructor(&file_info);
     }
-    interrupted = 0; /* more accurate feedback if placed after loop */
-
-    decoder_destructor();
 }
 
 static void play_remote_file(void)
 {
     int status = 0;
+    FLAC__bool draining = false; /* track decoded, output still playing */
+    unsigned pending;
 
-    printf("@R FLAC123\n");
+    /* stdin is read and parsed on a thread of its own */
+    if (!remote_start(&file_info))
+	return;
+
+    status_ready(file_info.session);
+    status_flush(file_info.session);
 
     while (status == 0)
     {
 	if (file_info.is_playing == true)
 	{
-	    if (FLAC__stream_decoder_get_state(file_info.decoder) ==
-		FLAC__STREAM_DECODER_END_OF_STREAM) 
+	    draining = remote_decode(&file_info);
+
+	    /* run the commands that came in meanwhile, if any */
+	    status = remote_get_input_nowait();
+	}
+	else if (draining && file_info.is_loaded == false)
+	{
+	    /* report the end of the track once it has actually been heard */
+	    if ((pending = ring_pending_ms(file_info.ring)) > 0)
 	    {
-		decoder_destructor();
-		printf("@P 0\n");
+		status = remote_get_input_timeout(pending);
 	    }
-	    else if (!FLAC__stream_decoder_process_single(file_info.decoder)) 
+	    else
 	    {
-		fprintf(stderr, "error decoding single frame!\n");
+		status_state(file_info.session, 0);
+		draining = false;
 	    }
-
-	    /* get the next command, no wait */
-	    status = remote_get_input_nowait();
 	}
 	else
 	{
 	    /* get the next command, wait */
 	    status = remote_get_input_wait();
 	}
-    }
-}
-
-void flac_error_hdl(const FLAC__StreamDecoder *dec, 
-		    FLAC__StreamDecoderErrorStatus status, void *data)
-{
-    fprintf(stderr, "error handler called!\n");
-}
-
-void flac_metadata_hdl(const FLAC__StreamDecoder *dec, 
-		       const FLAC__StreamMetadata *meta, void *data)
-{
-    file_info_struct *p = (file_info_struct *) data;
-
-    if(meta->type == FLAC__METADATA_TYPE_STREAMINFO) {
-	p->sam_fmt.bits = p->ao_fmt.bits = meta->data.stream_info.bits_per_sample;
-#ifdef DARWIN
-	if (meta->data.stream_info.bits_per_sample == 8 && !cli_args.wavfile)
-	    p->ao_fmt.bits = 16;
-#endif
-	p->ao_fmt.rate = meta->data.stream_info.sample_rate;
-	p->ao_fmt.channels = meta->data.stream_info.channels;
-	p->ao_fmt.byte_format = AO_FMT_NATIVE;
-	FLAC__ASSERT(meta->data.stream_info.total_samples <
-		     0x100000000); /* we can handle < 4 gigasamples */
-	p->total_samples = (unsigned) 
-	    (meta->data.stream_info.total_samples & 0xffffffff);
-	p->current_sample = 0;
-	p->total_time = (((float) p->total_samples) / p->ao_fmt.rate);
-	p->elapsed_time = 0;
-    }
-}
-
-FLAC__StreamDecoderWriteStatus flac_write_hdl(const FLAC__StreamDecoder *dec, 
-					      const FLAC__Frame *frame, 
-					      const FLAC__int32 * const buf[], 
-					      void *data)
-{
-    int sample, channel, i;
-    unsigned long remaining_samples;
-    uint_32 num_samples = frame->header.blocksize;
-    file_info_struct *p = (file_info_struct *) data;
-    uint_32 decoded_size = frame->header.blocksize * frame->header.channels * (p->ao_fmt.bits / 8);
-    float elapsed, remaining_time;
-    static uint_8 aobuf[FLAC__MAX_BLOCK_SIZE * FLAC__MAX_CHANNELS * sizeof(sint_32)]; /*oink!*/
-    sint_16 *s16aobuf = (sint_16 *) aobuf;
-    sint_32 *s32aobuf = (sint_32 *) aobuf;
-    uint_8   *u8aobuf = (uint_8  *) aobuf;
-
-    if (p->sam_fmt.bits == 8) {
-        for (sample = i = 0; sample < num_samples; sample++) {
-	    for(channel = 0; channel < frame->header.channels; channel++,i++) {
-		if (cli_args.wavfile) {
-		    /* 8 bit wav data is unsigned */
-		    u8aobuf[i] = buf[channel][sample] + 0x80;
-		} else {
-#ifdef DARWIN
-		    /* macosx libao expects 16 bit samples */
-		    s16aobuf[i] = (sint_16)(buf[channel][sample] << 8);
-#else
-		    u8aobuf[i] = buf[channel][sample] + 0x80;
-#endif
-		}
-	    }
-	} 
-    } else if (p->sam_fmt.bits == 16) {
-        for (sample = i = 0; sample < num_samples; sample++) {
-	    for(channel = 0; channel < frame->header.channels; channel++,i++) {
-		s16aobuf[i] = (sint_16)(buf[channel][sample] * scale);
-	    }
-        }
-    } else if (p->sam_fmt.bits == 24) {
-        for (sample = i = 0; sample < num_samples; sample++) {
-	    for(channel = 0; channel < frame->header.channels; channel++,i+=3) {
-                sint_32 scaled_sample = (sint_32)(buf[channel][sample] * scale);
-
-                u8aobuf[i]   = (scaled_sample >>  0) & 0xFF;
-                u8aobuf[i+1] = (scaled_sample >>  8) & 0xFF;
-                u8aobuf[i+2] = (scaled_sample >> 16) & 0xFF;
-	    }
-	} 
-    }
-
-    ao_play(p->ao_dev, (char *)aobuf, decoded_size);
-
-    p->current_sample += num_samples;
-    elapsed = ((float) num_samples) / frame->header.sample_rate;
-    p->elapsed_time += elapsed;
-
-    if (cli_args.remote) {
-	remaining_samples = p->total_samples > 0 ? p->total_samples - p->current_sample : p->current_sample;
-    	if ((remaining_time = p->total_time - p->elapsed_time) < 0)
-	    remaining_time = 0;
 
- 	printf("@F %lu %lu %.2f %.2f\n", p->current_sample, remaining_samples, p->elapsed_time, remaining_time);
+	/* what this turn printed, the answers to commands included */
+	status_flush(file_info.session);
     }
 
-    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    remote_finish();
 }
 
 void signal_handler(int sig) {
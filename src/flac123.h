@@ -18,17 +18,193 @@
  */
 
 #include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <ao/ao.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include <FLAC/all.h>
 
+/* default depth of the decode-ahead PCM ring (in milliseconds) */
+#define RING_TIME_DEFAULT 500
+
+/* default read-ahead of stdin and pipes (in KiB) */
+#define READ_AHEAD_DEFAULT 1024
+
+/* longest remote command line: a filename plus command and a space */
+#define REMOTE_LINE_MAX (PATH_MAX + 5)
+
 /* string widths for printing ID3 (vorbis) data in remote mode */
 #define VORBIS_TAG_LEN 30
 #define VORBIS_YEAR_LEN 4
 
-/* the main data structure of the program */
+/* output gain is Q16.16 fixed point */
+#define GAIN_BITS  16
+#define GAIN_UNITY (1 << GAIN_BITS)
+#define GAIN_ROUND (1 << (GAIN_BITS - 1))
+
+/* --replaygain modes */
+#define REPLAYGAIN_OFF   0
+#define REPLAYGAIN_TRACK 1
+#define REPLAYGAIN_ALBUM 2
+
+/* interleave, apply the gain and pack one decoded frame into out.  noise
+ * is only read by CONVERT_DITHER kernels, one value per output sample.
+ * Kernels may write up to CONVERT_SLACK bytes past the end of the
+ * converted data. */
+typedef void (*convert_fn)(uint_8 *out, const FLAC__int32 * const buf[],
+			   unsigned channels, unsigned samples,
+			   FLAC__int32 gain, const FLAC__int32 *noise);
+#define CONVERT_SLACK 32
+#define CONVERT_GAIN   0
+#define CONVERT_UNITY  1
+#define CONVERT_DITHER 2
+
+/* --start and --end, see clip.c */
+typedef struct {
+    FLAC__bool set;
+    FLAC__bool is_sample;    /* sample, not seconds */
+    FLAC__uint64 sample;
+    double seconds;
+} clip_position;
+
+typedef struct {
+    char *driver;
+    char *buffer_time;
+    char *wavfile;
+    int remote;
+    int quiet;
+    int version;
+    int ring_time;
+    char *replaygain;
+    char *index_db;
+    char *outdir;            /* batch mode: decode every file into here */
+    int jobs;                /* decoder threads in batch mode, 0 = cpus */
+    int raw;                 /* --wav and --outdir write raw PCM, not wav */
+    char *progress_interval;
+    unsigned progress_ms;    /* parsed from progress_interval, 0 is */
+    unsigned progress_samples; /* every frame */
+    char *status_format;
+    int status_json;         /* remote status lines are JSON objects */
+    char *daemon;            /* serve remote sessions on this socket */
+    int bench;               /* time decoding instead of playing */
+    int stats;               /* print the player_stats when done */
+    int rf64;                /* --wav and --outdir write RF64, not wav */
+    char *output_format;
+    int scan;                /* print the metadata of FILES as JSON lines */
+    int analyze;             /* measure the loudness of FILES */
+    int write_replaygain;    /* and store it in their tags */
+    int test;                /* verify FILES instead of playing them */
+    char *start;
+    char *end;
+    clip_position start_pos; /* parsed from start and end */
+    clip_position end_pos;
+    char *shm;               /* write PCM to this shared memory ring */
+    char *pcm_cache;         /* keep this much decoded PCM, e.g. 256M */
+} cli_var_struct;
+
+/* how files are decoded and converted, see decode.c.  main() sets them
+ * from the command line; libflac123 keeps the defaults. */
+typedef struct {
+    int replaygain_mode;     /* REPLAYGAIN_xxx */
+    int dither;
+    int no_md5;              /* do not check the MD5 while playing */
+    int realtime;            /* lock memory, SCHED_FIFO output thread */
+    int read_ahead;          /* KiB buffered from stdin and pipes, 0 = default */
+    ao_sample_format output_fmt; /* --output-format, rate 0 if unset */
+    int wide_8bit;           /* 8 bit samples as 16, for the macOS devices */
+} decode_var_struct;
+
+extern decode_var_struct decode_args;
+
+extern cli_var_struct cli_args;
+
+/* memory mapped input file, or a pipe read ahead, see input.c */
+typedef struct input_source input_source;
+#define INPUT_SEQUENTIAL 0
+#define INPUT_RANDOM     1
+
+/* where every frame decoded so far starts, see index.c */
+typedef struct {
+    FLAC__uint64 *sample;    /* first sample of frame i */
+    FLAC__uint64 *offset;    /* byte offset of frame i */
+    unsigned count;          /* the last entry is where decoding stopped */
+    unsigned size;
+    FLAC__bool complete;     /* the last entry is the end of the stream */
+    FLAC__bool dirty;        /* not in the index db like this yet */
+} frame_table;
+
+/* what --test found, kept in the index db */
+#define VERIFY_NONE      0   /* not tested */
+#define VERIFY_OK        1
+#define VERIFY_ERRORS    2   /* frames failed their CRC or did not decode */
+#define VERIFY_MD5       3   /* the audio does not match STREAMINFO */
+#define VERIFY_TRUNCATED 4   /* fewer samples than STREAMINFO says */
+
+/* PCM ring buffer between the decoder and the output thread */
+typedef struct pcm_ring pcm_ring;
+
+/* --wav and --outdir output, see writer.c */
+typedef struct pcm_writer pcm_writer;
+#define WRITER_WAV  0        /* RIFF, turned into RF64 past 4 GB if it can be */
+#define WRITER_RF64 1
+#define WRITER_RAW  2        /* native endian, no header */
+
+/* --shm output, see shmring.c */
+typedef struct pcm_shmring pcm_shmring;
+
+/* the decoded samples of a file, kept by --pcm-cache, see pcmcache.c */
+typedef struct pcm_cached pcm_cached;
+
+/* --output-format conversion, see resample.c */
+typedef struct resampler resampler;
+
+/* --analyze loudness meter, see analyze.c */
+typedef struct loudness loudness;
+
+/* work-stealing thread pool, see pool.c */
+typedef struct thread_pool thread_pool;
+typedef void (*pool_fn)(void *arg);
+
+/* a remote control session, see remote.c */
+typedef struct remote_session remote_session;
+typedef struct remote_queue remote_queue;
+
+/* --bench: where flac_write_hdl spends its time, see bench.c */
+typedef struct {
+    FLAC__uint64 convert_ns;
+    FLAC__uint64 output_ns;
+    FLAC__uint64 write_ns;   /* all of flac_write_hdl, the above included */
+} bench_times;
+
+/* STATS and --stats: counters of the hot path, see stats.c */
+#define STATS_BUCKETS 24     /* under 1, 2, 4, ... 2^23 microseconds */
+#define STATS_ERRORS  5      /* FLAC__StreamDecoderErrorStatus values */
+
+typedef struct {
+    _Atomic FLAC__uint64 count;
+    _Atomic FLAC__uint64 total_ns;
+    _Atomic FLAC__uint64 max_ns;
+    _Atomic FLAC__uint64 bucket[STATS_BUCKETS];
+} stats_histogram;
+
 typedef struct {
+    _Atomic FLAC__uint64 frames;
+    _Atomic FLAC__uint64 samples;
+    _Atomic FLAC__uint64 errors[STATS_ERRORS]; /* flac_error_hdl() calls */
+    stats_histogram open;    /* decoder_open(): the file and its metadata */
+    stats_histogram decode;  /* FLAC__stream_decoder_process_single() */
+    stats_histogram convert; /* gain_convert() in flac_write_hdl */
+    stats_histogram output;  /* ao_play(), on the output thread with a ring */
+    stats_histogram seek;    /* decoder_seek() */
+    _Atomic FLAC__uint64 cache_hits; /* files --pcm-cache had */
+    _Atomic FLAC__uint64 cache_misses; /* and did not have */
+} player_stats;
+
+/* the main data structure of the program */
+typedef struct file_info_struct {
     FLAC__StreamDecoder *decoder;
+    input_source *input;     /* NULL when libFLAC reads the file itself */
 
     /* bits, rate, channels, byte_format */
     ao_sample_format sam_fmt; /* input sample's true format */
@@ -48,14 +224,275 @@ typedef struct {
     char genre[VORBIS_TAG_LEN+1];
     char comment[VORBIS_TAG_LEN+1];
     char year[VORBIS_YEAR_LEN+1];
+    pcm_ring *ring;          /* NULL plays synchronously on ao_dev */
+    remote_session *session; /* NULL unless remote commands drive it */
+    const char *wavfile;     /* output_open() writes this, NULL is live */
+    pcm_writer *writer;      /* wavfile, instead of ao_dev */
+    pcm_shmring *shm;        /* --shm, instead of ao_dev and ring */
+    ao_sample_format dev_fmt; /* what ao_dev or writer was opened for */
+    resampler *resampler;    /* to decode_args.output_fmt, NULL if not needed */
+    FLAC__bool dev_is_file;
+    FLAC__bool has_tags;     /* title etc. came from a VORBIS_COMMENT */
+    unsigned max_blocksize;
+
+    /* REPLAYGAIN_* tags, gains in dB, peaks linear (0 if not tagged) */
+    FLAC__bool has_track_gain;
+    FLAC__bool has_album_gain;
+    float track_gain, track_peak;
+    float album_gain, album_peak;
+
+    /* --index-db: the file as it was opened, and its frames */
+    FLAC__uint64 file_size;  /* 0 if it is not a regular file */
+    FLAC__int64 file_mtime;  /* nanoseconds */
+    frame_table frames;
+    int verified;            /* VERIFY_xxx, as --test found it */
+    FLAC__uint64 skip_samples; /* drop these after a seek, or up to --start of a pipe */
+    unsigned long start_sample; /* --start, where decoding began */
+    unsigned long end_sample; /* --end, 0 decodes to the end of the stream */
+    pcm_cached *cached;      /* --pcm-cache: played from memory, no decoder */
+    FLAC__uint64 cached_pos; /* the next sample of cached to play */
+    pcm_cached *caching;     /* flac_write_hdl() also copies the samples here */
+
+    /* what flac_write_hdl() does with every frame: sample_fn takes its
+     * samples instead of it being converted (--analyze, --test), pcm_fn
+     * its PCM.  Without either, flac123_read() takes it out of aobuf. */
+    FLAC__bool (*sample_fn)(struct file_info_struct *p, const FLAC__int32 * const buf[],
+			    unsigned samples);
+    void (*pcm_fn)(struct file_info_struct *p, uint_8 *pcm, size_t len);
+    float user_gain_db;      /* flac123_set_gain(), on top of the volume */
+
+    /* what flac_write_hdl applies, see gain_update() */
+    FLAC__int32 gain;        /* Q16.16, includes the shift to ao_fmt.bits */
+    float gain_db;           /* volume and ReplayGain, as applied */
+    FLAC__bool gain_limited; /* reduced to keep the peak, or any sample, below full scale */
+    FLAC__bool gain_may_clip; /* above unity and no peak known */
+
+    /* scratch space of flac_write_hdl, sized for max_blocksize by
+     * decoder_open() and grown on demand if a frame is larger */
+    uint_8 *aobuf;           /* converted PCM of one frame */
+    size_t aobuf_size;
+    const uint_8 *pending;   /* the part of aobuf a remote command cut off */
+    size_t pending_len;      /* before it was queued, see output_resume(),
+			      * or that flac123_read() has not taken yet */
+    FLAC__int32 *noise;      /* TPDF dither, see gain_convert() */
+    unsigned noise_size;
+    uint_32 noise_state[8];
+    unsigned frame_samples;  /* written by the last decoder_process() */
+
+    /* gapless playback: the next track is opened and its first frame
+     * decoded while this one is still playing */
+    struct file_info_struct *next;
+    FLAC__bool preloading;   /* decoder callbacks work on next, not us */
+    uint_8 *prefetch;        /* converted PCM waiting to be spliced in */
+    size_t prefetch_len;
+    size_t prefetch_size;
+
+    bench_times *bench;      /* NULL unless --bench times flac_write_hdl */
+    loudness *loudness;      /* --analyze measures instead of playing */
+    FLAC__bool testing;      /* --test checks the MD5 even with --no-md5 */
+    FLAC__bool md5_checked;  /* export_parallel() did, not the decoder */
+    unsigned errors;         /* flac_error_hdl() calls */
+    player_stats *stats;     /* NULL counts nothing, shared with next */
 } file_info_struct;
 
-extern file_info_struct file_info;
+/* stdin and stdout with -R, or one connection to the --daemon socket */
+struct remote_session {
+    file_info_struct *info;  /* what it plays, info->next is QUEUEd */
+    FILE *out;               /* status lines, see status.c */
+    FILE *err;               /* @I, @E and @L lines */
+    float volume;            /* VOLUME, applied by gain_update() */
+    char *output;            /* OUTPUT file, info->wavfile points here */
+    remote_queue *queue;     /* commands read but not run yet */
+};
+
+/* libao keeps global state while opening and closing devices */
+extern pthread_mutex_t ao_lock;
+extern int ao_output_id;
+extern ao_option **ao_options;
 
-extern FLAC__bool decoder_constructor(const char *filename);
-extern void decoder_destructor(void);
+extern FLAC__bool decoder_open(file_info_struct *p, const char *filename);
+extern void decoder_close(file_info_struct *t);
+extern size_t frame_bytes(const file_info_struct *t);
+extern FLAC__bool decoder_reserve(file_info_struct *t);
+extern FLAC__bool decoder_constructor(file_info_struct *p, const char *filename);
+extern void decoder_destructor(file_info_struct *p);
+extern FLAC__bool preload_open(file_info_struct *p, const char *filename);
+extern FLAC__bool preload_splice(file_info_struct *p);
+extern void preload_discard(file_info_struct *p);
+extern FLAC__bool decoder_process(file_info_struct *p);
+extern FLAC__StreamDecoderState decoder_state(const file_info_struct *p);
+extern FLAC__bool remote_decode(file_info_struct *p);
+extern FLAC__StreamDecoderWriteStatus flac_write_hdl(const FLAC__StreamDecoder *dec,
+						     const FLAC__Frame *frame,
+						     const FLAC__int32 * const buf[], void *data);
+extern void flac_metadata_hdl(const FLAC__StreamDecoder *dec,
+			      const FLAC__StreamMetadata *meta, void *data);
+extern void flac_error_hdl(const FLAC__StreamDecoder *dec,
+			   FLAC__StreamDecoderErrorStatus status, void *data);
 extern int remote_get_input_wait(void);
 extern int remote_get_input_nowait(void);
-extern FLAC__bool get_vorbis_comments(const char *filename);
+extern int remote_get_input_timeout(unsigned ms);
+extern FLAC__bool remote_start(file_info_struct *info);
+extern void remote_finish(void);
+extern FLAC__bool remote_open(remote_session *s, file_info_struct *info, FILE *out, FILE *err);
+extern void remote_close(remote_session *s);
+extern FLAC__bool remote_input(remote_session *s, char *buf, size_t *used,
+			       FLAC__bool eof, FLAC__bool wait);
+extern FLAC__bool remote_has_commands(remote_session *s);
+extern int remote_run(remote_session *s);
+extern int daemon_run(const char *path);
+extern FLAC__bool status_parse_interval(const char *arg);
+extern void status_ready(remote_session *s);
+extern void status_frame(const file_info_struct *p, unsigned samples);
+extern void status_state(remote_session *s, int state);
+extern void status_jump(remote_session *s, FLAC__uint64 sample, double ms);
+extern void status_volume(remote_session *s, float volume);
+extern void status_stats(remote_session *s);
+extern void status_flush(remote_session *s);
+extern FLAC__bool get_vorbis_comments(file_info_struct *p, const char *filename);
+extern FLAC__bool vorbis_comment_parse(file_info_struct *p,
+				       const FLAC__StreamMetadata_VorbisComment *vc);
+
+extern void convert_init(void);
+extern convert_fn convert_select(int out_bits, unsigned channels, int mode);
+extern void dither_fill(FLAC__int32 *noise, unsigned n, uint_32 state[8]);
+
+extern void gain_update(file_info_struct *p);
+extern FLAC__bool gain_reserve(file_info_struct *p, unsigned values);
+extern void gain_convert(file_info_struct *p, uint_8 *out, const FLAC__int32 * const buf[],
+			 unsigned channels, unsigned samples);
+
+extern FLAC__bool input_is_stream(const char *filename);
+extern input_source *input_open(const char *filename);
+extern void input_close(input_source *in);
+extern FLAC__bool input_seekable(input_source *in);
+extern FLAC__bool input_is_ogg(input_source *in);
+extern void input_advise(input_source *in, int pattern);
+extern FLAC__StreamDecoderReadStatus input_read_hdl(const FLAC__StreamDecoder *,
+	FLAC__byte buffer[], size_t *bytes, void *);
+extern FLAC__StreamDecoderSeekStatus input_seek_hdl(const FLAC__StreamDecoder *,
+	FLAC__uint64 offset, void *);
+extern FLAC__StreamDecoderTellStatus input_tell_hdl(const FLAC__StreamDecoder *,
+	FLAC__uint64 *offset, void *);
+extern FLAC__StreamDecoderLengthStatus input_length_hdl(const FLAC__StreamDecoder *,
+	FLAC__uint64 *length, void *);
+extern FLAC__bool input_eof_hdl(const FLAC__StreamDecoder *, void *);
+
+extern void input_skip_metadata(input_source *in, FLAC__uint64 first_frame);
+extern void input_set_position(input_source *in, FLAC__uint64 offset);
+extern input_source *input_slice(input_source *in, FLAC__uint64 start, FLAC__uint64 end);
+extern const FLAC__byte *input_map(input_source *in, size_t *size);
+
+extern FLAC__bool decoder_seek(file_info_struct *p, FLAC__uint64 sample);
+extern FLAC__bool clip_parse(const char *arg, clip_position *pos);
+extern FLAC__bool clip_apply(file_info_struct *p);
+extern FLAC__bool clip_done(const file_info_struct *p);
+extern void output_write(file_info_struct *p, uint_8 *buf, size_t len);
+extern void output_pcm(file_info_struct *p, uint_8 *pcm, size_t len);
+extern const ao_sample_format *output_format(const file_info_struct *p);
+extern FLAC__bool export_parallel(file_info_struct *p, volatile int *stop);
+
+extern void index_open(const char *path);
+extern void index_close(void);
+extern FLAC__bool index_lookup(file_info_struct *p, const char *filename);
+extern FLAC__bool index_verify(file_info_struct *p);
+extern void index_store(file_info_struct *p);
+extern FLAC__int64 stat_mtime(const struct stat *st);
+extern void frames_add(frame_table *f, FLAC__uint64 sample, FLAC__uint64 offset);
+extern void frames_reserve(frame_table *f, unsigned count);
+extern FLAC__bool frames_find(const frame_table *f, FLAC__uint64 sample, unsigned *frame);
+extern void frames_free(frame_table *f);
+extern FLAC__bool frame_header_at(const FLAC__byte *b, size_t avail,
+				  const file_info_struct *p, FLAC__bool variable,
+				  FLAC__uint64 *sample, unsigned *blocksize);
+extern FLAC__bool frames_scan(file_info_struct *p, FLAC__uint64 sample, size_t limit);
+extern FLAC__bool frames_locate(file_info_struct *p, FLAC__uint64 sample,
+				FLAC__uint64 *offset, FLAC__uint64 *frame_sample);
+
+extern pcm_ring *ring_new(unsigned ms, stats_histogram *play);
+extern FLAC__bool ring_set_device(pcm_ring *r, ao_device *dev, const ao_sample_format *fmt);
+extern void ring_write(pcm_ring *r, const uint_8 *data, size_t len);
+extern size_t ring_write_some(pcm_ring *r, const uint_8 *data, size_t len);
+/* the following accept a NULL ring and then do nothing */
+extern void ring_drain(pcm_ring *r);
+extern void ring_flush(pcm_ring *r);
+extern void ring_pause(pcm_ring *r, FLAC__bool paused);
+extern void ring_interrupt(pcm_ring *r);
+extern unsigned ring_pending_ms(pcm_ring *r);
+extern void ring_free(pcm_ring *r);
+
+extern thread_pool *pool_new(unsigned threads);
+extern void pool_submit(thread_pool *pool, pool_fn fn, void *arg);
+extern void pool_wait(thread_pool *pool);
+extern void pool_free(thread_pool *pool);
+extern unsigned pool_cpus(void);
+
+extern int batch_run(const char **files, unsigned count);
+
+extern pcm_writer *writer_open(const char *target, int type, const ao_sample_format *fmt);
+extern FLAC__bool writer_write(pcm_writer *w, const uint_8 *data, size_t len);
+extern FLAC__bool writer_close(pcm_writer *w);
+extern int writer_type(void);
+
+extern pcm_shmring *shmring_open(const char *name, const ao_sample_format *fmt);
+extern void shmring_start(pcm_shmring *r, const ao_sample_format *fmt);
+extern void shmring_write(pcm_shmring *r, const uint_8 *data, size_t len);
+extern void shmring_flush(pcm_shmring *r);
+extern void shmring_close(pcm_shmring *r);
+
+extern FLAC__bool pcmcache_init(const char *size);
+extern FLAC__bool pcmcache_enabled(void);
+extern FLAC__bool pcmcache_lookup(file_info_struct *t, const char *filename);
+extern void pcmcache_begin(file_info_struct *t);
+extern FLAC__bool pcmcache_decode(file_info_struct *p);
+extern FLAC__bool pcmcache_seek(file_info_struct *p, FLAC__uint64 sample);
+extern FLAC__bool pcmcache_ended(const file_info_struct *p);
+extern FLAC__bool pcmcache_store(pcm_cached *c, const FLAC__int32 * const buf[],
+				 FLAC__uint64 sample, unsigned samples);
+extern void pcmcache_end(file_info_struct *t, FLAC__bool md5_ok);
+extern void pcmcache_release(file_info_struct *t);
+
+extern int bench_run(const char **files, unsigned count);
+
+extern int scan_run(const char **paths, unsigned count);
+extern void json_string(FILE *out, const char *s);
+
+extern int verify_run(const char **files, unsigned count);
+
+extern int analyze_run(const char **files, unsigned count);
+
+extern FLAC__bool resample_parse_format(const char *arg);
+extern void resample_init(void);
+extern resampler *resample_new(unsigned in_rate, unsigned in_channels, int in_bits, unsigned max_in);
+extern void resample_free(resampler *r);
+extern void resample_reset(resampler *r);
+extern size_t resample_bytes(const resampler *r, unsigned samples);
+extern size_t resample_frame(resampler *r, uint_8 *out, const FLAC__int32 * const buf[],
+			     unsigned samples, FLAC__int32 gain, FLAC__bool last);
+
+extern void realtime_init(void);
+extern void realtime_thread(void);
+extern void realtime_prefault(void *buf, size_t len);
+
+extern FLAC__uint64 stats_clock(void);
+extern FLAC__uint64 stats_lap(FLAC__uint64 *since);
+extern void stats_record(stats_histogram *h, FLAC__uint64 ns);
+extern void stats_since(stats_histogram *h, FLAC__uint64 start);
+extern void stats_frame(player_stats *s, unsigned samples);
+extern void stats_error(player_stats *s, FLAC__StreamDecoderErrorStatus status);
+extern void stats_cache(player_stats *s, FLAC__bool hit);
+extern void stats_print(FILE *out, player_stats *s, FLAC__bool json);
+
+/* MD5 of the decoded audio, as in STREAMINFO, see md5.c */
+typedef struct {
+    uint_32 state[4];
+    FLAC__uint64 bytes;
+    uint_8 buffer[64];
+} md5_context;
+
+extern void md5_init(md5_context *ctx);
+extern void md5_update(md5_context *ctx, const void *data, size_t len);
+extern void md5_final(md5_context *ctx, uint_8 digest[16]);
+extern size_t md5_pack(uint_8 *out, const FLAC__int32 * const buf[], unsigned channels,
+		       unsigned samples, unsigned bytes);
 
-extern float scale;
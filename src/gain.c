@@ -0,0 +1,131 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This gain.c module combines the remote VOLUME setting and the
+ *  ReplayGain tags into the fixed point gain applied by the conversion
+ *  kernels, keeps tagged tracks from clipping and feeds the kernels
+ *  TPDF dither when the gain requantizes the samples.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+
+/* where every decoder's dither generators start */
+static const uint_32 noise_seed[8] = {
+    0x2545F491, 0x9E3779B9, 0x6A09E667, 0xBB67AE85,
+    0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C
+};
+
+/* set p->gain from the volume, the ReplayGain tags and the sample format */
+void gain_update(file_info_struct *p)
+{
+    double g = !p->session ? 1.0 : p->session->volume > 0 ? p->session->volume : 0;
+    double peak = 0, q, limit;
+    int mode = decode_args.replaygain_mode;
+
+    p->gain = GAIN_UNITY;
+    p->gain_db = 0;
+    p->gain_limited = false;
+    p->gain_may_clip = false;
+
+    if (p->sam_fmt.bits == 0)
+	return;
+    if (p->user_gain_db != 0)
+	g *= pow(10.0, p->user_gain_db / 20.0);
+
+    /* album mode falls back to the track gain and vice versa */
+    if (mode == REPLAYGAIN_ALBUM && p->has_album_gain) {
+	g *= pow(10.0, p->album_gain / 20.0);
+	peak = p->album_peak;
+    } else if (mode != REPLAYGAIN_OFF && p->has_track_gain) {
+	g *= pow(10.0, p->track_gain / 20.0);
+	peak = p->track_peak;
+    } else if (mode != REPLAYGAIN_OFF && p->has_album_gain) {
+	g *= pow(10.0, p->album_gain / 20.0);
+	peak = p->album_peak;
+    } else {
+	peak = p->track_peak > 0 ? p->track_peak : p->album_peak;
+    }
+
+    /* clip prevention */
+    if (peak > 0 && g * peak > 1.0) {
+	g = 1.0 / peak;
+	p->gain_limited = true;
+    } else if (peak <= 0 && g > 1.0) {
+	p->gain_may_clip = true;
+    }
+
+    p->gain_db = g > 0 ? 20.0 * log10(g) : -HUGE_VAL;
+
+    /* fold in the shift of narrow samples to the top of their container,
+     * and keep x * gain >> GAIN_BITS plus rounding within 32 bits */
+    q = g * ldexp(GAIN_UNITY, p->ao_fmt.bits - p->sam_fmt.bits);
+    limit = ldexp(2147483644.0, GAIN_BITS + 1 - p->sam_fmt.bits);
+    if (limit > 2147483647.0)
+	limit = 2147483647.0;
+
+    if (g != 1.0 && q > limit) {
+	/* wide samples have little headroom: report what is applied */
+	p->gain = (FLAC__int32) floor(limit);
+	p->gain_db = 20.0 * log10(p->gain / ldexp(GAIN_UNITY, p->ao_fmt.bits - p->sam_fmt.bits));
+	p->gain_limited = true;
+	p->gain_may_clip = false;
+    } else {
+	p->gain = (FLAC__int32) floor(q + 0.5);
+    }
+}
+
+/* make room for the dither of values output samples */
+FLAC__bool gain_reserve(file_info_struct *p, unsigned values)
+{
+    FLAC__int32 *grown;
+
+    if (values + 8 <= p->noise_size)
+	return true;
+    if (!(grown = realloc(p->noise, (values + 8) * sizeof(FLAC__int32))))
+	return false;
+
+    if (!p->noise)
+	memcpy(p->noise_state, noise_seed, sizeof(noise_seed));
+    p->noise = grown;
+    p->noise_size = values + 8;
+    realtime_prefault(p->noise, p->noise_size * sizeof(FLAC__int32));
+    return true;
+}
+
+/* convert one decoded frame into p->ao_fmt at p->gain */
+void gain_convert(file_info_struct *p, uint_8 *out, const FLAC__int32 * const buf[],
+		  unsigned channels, unsigned samples)
+{
+    unsigned n = channels * samples;
+    int mode = CONVERT_GAIN;
+
+    if (p->gain == GAIN_UNITY) {
+	mode = CONVERT_UNITY;
+    } else if (decode_args.dither && (p->gain & (GAIN_UNITY - 1))) {
+	/* a fractional gain requantizes every sample */
+	if (gain_reserve(p, n)) {
+	    dither_fill(p->noise, n, p->noise_state);
+	    mode = CONVERT_DITHER;
+	}
+    }
+
+    convert_select(p->ao_fmt.bits, channels, mode)(out, buf, channels, samples, p->gain, p->noise);
+}
@@ -0,0 +1,776 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This index.c module keeps the per file frame table and the optional
+ *  --index-db file.  The db remembers, for every file keyed by path, size
+ *  and mtime, its STREAMINFO, its tags and where each of its frames
+ *  starts, so loading it again needs no metadata walk and seeking it
+ *  needs no bisection.  Frames beyond the table are found by their
+ *  headers in the mapped file, without decoding.
+ *
+ *  The db is a magic string followed by records that are only ever
+ *  appended; the last record for a path wins.  It is in native byte
+ *  order and meant to stay on the machine that wrote it.  A db of an
+ *  older version is started anew, it only holds what can be read again.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "flac123.h"
+
+#define INDEX_MAGIC "flac123 index 2\n"
+#define INDEX_MAGIC_LEN 16
+
+/* no particular sample, for next_header() */
+#define NO_SAMPLE (~(FLAC__uint64) 0)
+
+/* rewrite the db on open once more than this much of it is stale */
+#define INDEX_COMPACT_BYTES (1 << 20)
+
+typedef struct {
+    uint_32 length;          /* of the whole record, a multiple of 8 */
+    uint_32 checksum;        /* FNV-1a of everything after this field */
+    FLAC__uint64 file_size;
+    FLAC__int64 file_mtime;
+    FLAC__uint64 total_samples;
+    uint_32 sample_rate;
+    uint_32 max_blocksize;
+    uint_32 frames;          /* entries in the frame table */
+    uint_16 path_len;
+    uint_8 channels;
+    uint_8 bits_per_sample;
+    uint_8 complete;
+    uint_8 has_tags;
+    uint_8 has_track_gain;
+    uint_8 has_album_gain;
+    uint_8 verified;         /* VERIFY_xxx */
+    uint_8 unused[3];
+    float track_gain, track_peak;
+    float album_gain, album_peak;
+    char title[VORBIS_TAG_LEN+1];
+    char artist[VORBIS_TAG_LEN+1];
+    char album[VORBIS_TAG_LEN+1];
+    char genre[VORBIS_TAG_LEN+1];
+    char comment[VORBIS_TAG_LEN+1];
+    char year[VORBIS_YEAR_LEN+1];
+    /* followed by the path, padding to 4 bytes, then per frame a
+     * uint_32 pair: samples and bytes since the previous frame (since
+     * sample 0 and byte 0 for the first one) */
+} index_record;
+
+typedef struct {
+    const index_record *rec;
+    index_record *owned;     /* rec when it was malloc()ed, not mapped */
+} index_slot;
+
+static int db_fd = -1;
+static const uint_8 *db_map;
+static size_t db_map_size;
+static index_slot *slots;
+static unsigned slot_count, slot_used;
+
+/* the slots are shared by the decoders of the --outdir jobs */
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint_32 fnv1a(const void *data, size_t len)
+{
+    const uint_8 *p = data;
+    uint_32 h = 2166136261u;
+
+    while (len--)
+	h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+static const char *record_path(const index_record *rec)
+{
+    return (const char *) (rec + 1);
+}
+
+static const uint_32 *record_frames(const index_record *rec)
+{
+    return (const uint_32 *) ((const uint_8 *) (rec + 1) + ((rec->path_len + 3) & ~3u));
+}
+
+static size_t record_length(unsigned path_len, unsigned frames)
+{
+    size_t len = sizeof(index_record) + ((path_len + 3) & ~3u) + frames * 2 * sizeof(uint_32);
+
+    return (len + 7) & ~(size_t) 7;
+}
+
+static FLAC__bool record_valid(const index_record *rec, size_t avail)
+{
+    return avail >= sizeof(index_record) && rec->length <= avail &&
+	rec->length % 8 == 0 &&
+	rec->length >= record_length(rec->path_len, rec->frames) &&
+	rec->checksum == fnv1a(&rec->file_size, rec->length - 2 * sizeof(uint_32));
+}
+
+static index_slot *slot_find(const char *path, size_t len)
+{
+    unsigned i = fnv1a(path, len) & (slot_count - 1);
+
+    while (slots[i].rec && !(slots[i].rec->path_len == len &&
+			     memcmp(record_path(slots[i].rec), path, len) == 0))
+	i = (i + 1) & (slot_count - 1);
+    return &slots[i];
+}
+
+/* make rec the entry for its path, returns the size of what it replaced */
+static size_t slot_insert(const index_record *rec, index_record *owned)
+{
+    index_slot *s, *old;
+    unsigned i, old_count = slot_count;
+    size_t replaced = 0;
+
+    if (2 * (slot_used + 1) > slot_count) {
+	slot_count = slot_count ? 2 * slot_count : 1024;
+	old = slots;
+	if (!(slots = calloc(slot_count, sizeof(index_slot)))) {
+	    slots = old;
+	    slot_count = old_count;
+	    free(owned);
+	    return 0;
+	}
+	for (i = 0; i < old_count; i++)
+	    if (old[i].rec)
+		*slot_find(record_path(old[i].rec), old[i].rec->path_len) = old[i];
+	free(old);
+    }
+
+    s = slot_find(record_path(rec), rec->path_len);
+    if (s->rec) {
+	replaced = s->rec->length;
+	free(s->owned);
+    } else {
+	slot_used++;
+    }
+    s->rec = rec;
+    s->owned = owned;
+
+    return replaced;
+}
+
+/* write out only the live records, db_fd is locked */
+static void index_compact(const char *path)
+{
+    char *tmp = malloc(strlen(path) + 5);
+    FILE *f;
+    unsigned i;
+    FLAC__bool ok;
+
+    if (!tmp)
+	return;
+    sprintf(tmp, "%s.new", path);
+
+    if (!(f = fopen(tmp, "wb"))) {
+	free(tmp);
+	return;
+    }
+    ok = fwrite(INDEX_MAGIC, INDEX_MAGIC_LEN, 1, f) == 1;
+    for (i = 0; ok && i < slot_count; i++)
+	if (slots[i].rec)
+	    ok = fwrite(slots[i].rec, slots[i].rec->length, 1, f) == 1;
+
+    if (fclose(f) == 0 && ok && rename(tmp, path) == 0) {
+	/* the records now live in the new file, keep reading them from
+	 * the old mapping and append to the new file */
+	close(db_fd);
+	db_fd = open(path, O_RDWR | O_APPEND);
+	if (db_fd >= 0)
+	    flock(db_fd, LOCK_EX);
+    } else {
+	unlink(tmp);
+    }
+    free(tmp);
+}
+
+void index_open(const char *path)
+{
+    struct stat st;
+    size_t off = INDEX_MAGIC_LEN, live = 0, stale = 0;
+    const index_record *rec;
+
+    if ((db_fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644)) < 0) {
+	fprintf(stderr, "Error opening index db %s: %s\n", path, strerror(errno));
+	return;
+    }
+
+    flock(db_fd, LOCK_EX);
+
+    if (fstat(db_fd, &st) != 0 || (uintmax_t) st.st_size > SIZE_MAX) {
+	fprintf(stderr, "Error reading index db %s\n", path);
+	goto fail;
+    }
+
+    if (st.st_size == 0) {
+	if (write(db_fd, INDEX_MAGIC, INDEX_MAGIC_LEN) != INDEX_MAGIC_LEN) {
+	    fprintf(stderr, "Error writing index db %s\n", path);
+	    goto fail;
+	}
+	flock(db_fd, LOCK_UN);
+	return;
+    }
+
+    db_map_size = st.st_size;
+    if ((db_map = mmap(NULL, db_map_size, PROT_READ, MAP_SHARED, db_fd, 0)) == MAP_FAILED) {
+	db_map = NULL;
+	fprintf(stderr, "Error reading index db %s\n", path);
+	goto fail;
+    }
+    if (db_map_size >= INDEX_MAGIC_LEN && memcmp(db_map, INDEX_MAGIC, INDEX_MAGIC_LEN - 2) == 0 &&
+	memcmp(db_map, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0)
+    {
+	munmap((void *) db_map, db_map_size);
+	db_map = NULL;
+	if (ftruncate(db_fd, 0) != 0 ||
+	    write(db_fd, INDEX_MAGIC, INDEX_MAGIC_LEN) != INDEX_MAGIC_LEN)
+	{
+	    fprintf(stderr, "Error writing index db %s\n", path);
+	    goto fail;
+	}
+	flock(db_fd, LOCK_UN);
+	return;
+    }
+    if (db_map_size < INDEX_MAGIC_LEN || memcmp(db_map, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0) {
+	fprintf(stderr, "%s is not a flac123 index db\n", path);
+	goto fail;
+    }
+
+    for (; off < db_map_size; off += rec->length) {
+	rec = (const index_record *) (db_map + off);
+	if (!record_valid(rec, db_map_size - off))
+	    break;
+	stale += slot_insert(rec, NULL);
+	live += rec->length;
+    }
+    live -= stale;
+
+    /* a torn write at the end would hide everything appended after it */
+    if (off < db_map_size && ftruncate(db_fd, off) != 0)
+	goto fail;
+
+    if (stale > live && stale > INDEX_COMPACT_BYTES)
+	index_compact(path);
+
+    flock(db_fd, LOCK_UN);
+    return;
+
+fail:
+    index_close();
+}
+
+void index_close(void)
+{
+    unsigned i;
+
+    for (i = 0; i < slot_count; i++)
+	free(slots[i].owned);
+    free(slots);
+    slots = NULL;
+    slot_count = slot_used = 0;
+
+    if (db_map)
+	munmap((void *) db_map, db_map_size);
+    db_map = NULL;
+    if (db_fd >= 0)
+	close(db_fd);
+    db_fd = -1;
+}
+
+/* st_mtime in nanoseconds, as the db keeps it */
+FLAC__int64 stat_mtime(const struct stat *st)
+{
+#ifdef __APPLE__
+    return (FLAC__int64) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (FLAC__int64) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+ * Remember what filename is now and fill in p from the db if it knows
+ * the file like that.  On a hit the tags and the frame table are set and
+ * true is returned; STREAMINFO is checked later by index_verify().
+ */
+FLAC__bool index_lookup(file_info_struct *p, const char *filename)
+{
+    const index_record *rec;
+    const uint_32 *delta;
+    FLAC__uint64 sample = 0, offset = 0;
+    struct stat st;
+    unsigned i;
+
+    frames_free(&p->frames);
+    p->file_size = 0;
+    p->verified = VERIFY_NONE;
+
+    if (db_fd < 0 || input_is_stream(filename) || stat(filename, &st) != 0 ||
+	!S_ISREG(st.st_mode))
+    {
+	return false;
+    }
+    p->file_size = st.st_size;
+    p->file_mtime = stat_mtime(&st);
+
+    pthread_mutex_lock(&db_lock);
+    rec = slot_count ? slot_find(filename, strlen(filename))->rec : NULL;
+    if (!rec || rec->file_size != p->file_size || rec->file_mtime != p->file_mtime) {
+	pthread_mutex_unlock(&db_lock);
+	p->frames.dirty = true;
+	return false;
+    }
+
+    memcpy(p->title, rec->title, sizeof(p->title));
+    memcpy(p->artist, rec->artist, sizeof(p->artist));
+    memcpy(p->album, rec->album, sizeof(p->album));
+    memcpy(p->genre, rec->genre, sizeof(p->genre));
+    memcpy(p->comment, rec->comment, sizeof(p->comment));
+    memcpy(p->year, rec->year, sizeof(p->year));
+    p->has_tags = rec->has_tags;
+    p->has_track_gain = rec->has_track_gain;
+    p->has_album_gain = rec->has_album_gain;
+    p->track_gain = rec->track_gain;
+    p->track_peak = rec->track_peak;
+    p->album_gain = rec->album_gain;
+    p->album_peak = rec->album_peak;
+    p->verified = rec->verified;
+
+    delta = record_frames(rec);
+    for (i = 0; i < rec->frames; i++) {
+	sample += delta[2 * i];
+	offset += delta[2 * i + 1];
+	frames_add(&p->frames, sample, offset);
+    }
+    p->frames.complete = rec->complete;
+    p->frames.dirty = false;
+    pthread_mutex_unlock(&db_lock);
+
+    return true;
+}
+
+/* drop what index_lookup() found if the STREAMINFO libFLAC read from the
+ * file does not match it after all */
+FLAC__bool index_verify(file_info_struct *p)
+{
+    const index_record *rec;
+    FLAC__bool match;
+
+    pthread_mutex_lock(&db_lock);
+    rec = slot_count ? slot_find(p->filename, strlen(p->filename))->rec : NULL;
+    match = rec && rec->total_samples == p->total_samples &&
+	rec->sample_rate == p->ao_fmt.rate && rec->channels == p->ao_fmt.channels &&
+	rec->bits_per_sample == p->sam_fmt.bits &&
+	rec->max_blocksize == p->max_blocksize;
+    pthread_mutex_unlock(&db_lock);
+
+    if (match)
+	return true;
+
+    frames_free(&p->frames);
+    p->frames.dirty = true;
+    return false;
+}
+
+/* append what is known about p to the db, if it is anything new */
+void index_store(file_info_struct *p)
+{
+    const frame_table *f = &p->frames;
+    size_t path_len = strlen(p->filename);
+    index_record *rec;
+    uint_32 *delta;
+    unsigned i;
+
+    if (db_fd < 0 || p->file_size == 0 || !f->dirty || f->count == 0 ||
+	path_len > 0xFFFF)
+    {
+	return;
+    }
+
+    /* frames larger than 4 GB, or a stream that is not FLAC after all */
+    for (i = 1; i < f->count; i++)
+	if (f->offset[i] - f->offset[i - 1] > 0xFFFFFFFFu)
+	    return;
+
+    if (!(rec = calloc(1, record_length(path_len, f->count))))
+	return;
+
+    rec->length = record_length(path_len, f->count);
+    rec->file_size = p->file_size;
+    rec->file_mtime = p->file_mtime;
+    rec->total_samples = p->total_samples;
+    rec->sample_rate = p->ao_fmt.rate;
+    rec->max_blocksize = p->max_blocksize;
+    rec->frames = f->count;
+    rec->path_len = path_len;
+    rec->channels = p->ao_fmt.channels;
+    rec->bits_per_sample = p->sam_fmt.bits;
+    rec->complete = f->complete;
+    rec->has_tags = p->has_tags;
+    rec->has_track_gain = p->has_track_gain;
+    rec->has_album_gain = p->has_album_gain;
+    rec->verified = p->verified;
+    rec->track_gain = p->track_gain;
+    rec->track_peak = p->track_peak;
+    rec->album_gain = p->album_gain;
+    rec->album_peak = p->album_peak;
+    memcpy(rec->title, p->title, sizeof(rec->title));
+    memcpy(rec->artist, p->artist, sizeof(rec->artist));
+    memcpy(rec->album, p->album, sizeof(rec->album));
+    memcpy(rec->genre, p->genre, sizeof(rec->genre));
+    memcpy(rec->comment, p->comment, sizeof(rec->comment));
+    memcpy(rec->year, p->year, sizeof(rec->year));
+    memcpy((char *) record_path(rec), p->filename, path_len);
+
+    delta = (uint_32 *) record_frames(rec);
+    for (i = 0; i < f->count; i++) {
+	delta[2 * i] = f->sample[i] - (i ? f->sample[i - 1] : 0);
+	delta[2 * i + 1] = f->offset[i] - (i ? f->offset[i - 1] : 0);
+    }
+    rec->checksum = fnv1a(&rec->file_size, rec->length - 2 * sizeof(uint_32));
+
+    /* one write() per record keeps concurrent writers from interleaving */
+    pthread_mutex_lock(&db_lock);
+    flock(db_fd, LOCK_EX);
+    if (write(db_fd, rec, rec->length) != (ssize_t) rec->length)
+	fprintf(stderr, "Error writing index db: %s\n", strerror(errno));
+    flock(db_fd, LOCK_UN);
+
+    slot_insert(rec, rec);
+    pthread_mutex_unlock(&db_lock);
+    p->frames.dirty = false;
+}
+
+static uint_8 crc8(const FLAC__byte *data, unsigned len)
+{
+    uint_8 crc = 0;
+    unsigned i;
+
+    while (len--) {
+	crc ^= *data++;
+	for (i = 0; i < 8; i++)
+	    crc = crc & 0x80 ? (uint_8) (crc << 1) ^ 0x07 : (uint_8) (crc << 1);
+    }
+    return crc;
+}
+
+/* whether a valid frame header of the stream of p starts at b, and if so
+ * the number of its first sample and its length in samples.  variable
+ * is the blocking strategy bit of the first frame. */
+FLAC__bool frame_header_at(const FLAC__byte *b, size_t avail,
+			   const file_info_struct *p, FLAC__bool variable,
+			   FLAC__uint64 *sample, unsigned *blocksize)
+{
+    static const unsigned sample_bits[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+    static const unsigned rates[12] = {
+	0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000
+    };
+    FLAC__uint64 number;
+    unsigned ones, len, i, channels, code;
+
+    if (avail < 16 || b[0] != 0xFF || (b[1] & 0xFE) != 0xF8 ||
+	(FLAC__bool) (b[1] & 1) != variable)
+    {
+	return false;
+    }
+    if ((b[2] >> 4) == 0 || (b[2] & 0x0F) == 0x0F || (b[3] >> 4) > 10 ||
+	((b[3] >> 1) & 7) == 3 || (b[3] & 1))
+    {
+	return false;
+    }
+    channels = (b[3] >> 4) < 8 ? (b[3] >> 4) + 1 : 2;
+    if (channels != p->ao_fmt.channels ||
+	(sample_bits[(b[3] >> 1) & 7] && sample_bits[(b[3] >> 1) & 7] != p->sam_fmt.bits))
+    {
+	return false;
+    }
+
+    /* the frame (fixed block size) or sample number, UTF-8 coded */
+    for (ones = 0; ones < 8 && (b[4] & (0x80 >> ones)); ones++)
+	;
+    if (ones == 1 || ones > (variable ? 7 : 6))
+	return false;
+    number = b[4] & (0x7F >> ones);
+    for (i = 1; i < ones; i++) {
+	if ((b[4 + i] & 0xC0) != 0x80)
+	    return false;
+	number = number << 6 | (b[4 + i] & 0x3F);
+    }
+
+    len = 5 + (ones ? ones - 1 : 0);
+    code = b[2] >> 4;
+    if (code == 1)
+	*blocksize = 192;
+    else if (code <= 5)
+	*blocksize = 576 << (code - 2);
+    else if (code == 6)
+	*blocksize = b[len] + 1;
+    else if (code == 7)
+	*blocksize = (b[len] << 8 | b[len + 1]) + 1;
+    else
+	*blocksize = 256 << (code - 8);
+    len += code == 6 ? 1 : code == 7 ? 2 : 0;
+
+    code = b[2] & 0x0F;
+    if (code >= 1 && code <= 11 && rates[code] != p->ao_fmt.rate)
+	return false;
+    len += code == 12 ? 1 : code >= 13 ? 2 : 0;
+
+    if (crc8(b, len) != b[len])
+	return false;
+
+    /* in a fixed block size stream only the last frame is shorter */
+    *sample = variable ? number : number * p->max_blocksize;
+    return *sample < p->total_samples && *blocksize <= p->max_blocksize &&
+	(variable || *blocksize == p->max_blocksize ||
+	 *sample + *blocksize == p->total_samples);
+}
+
+/* the first valid frame header in map[from, to), and when expect is
+ * not NO_SAMPLE only one that starts at sample expect */
+static FLAC__bool next_header(const FLAC__byte *map, size_t size, size_t from, size_t to,
+			      const file_info_struct *p, FLAC__bool variable,
+			      FLAC__uint64 expect, size_t *at, FLAC__uint64 *sample,
+			      unsigned *blocksize)
+{
+    const FLAC__byte *b;
+
+    if (to > size)
+	to = size;
+    while (from < to && (b = memchr(map + from, 0xFF, to - from))) {
+	from = b - map;
+	if (frame_header_at(b, size - from, p, variable, sample, blocksize) &&
+	    (expect == NO_SAMPLE || *sample == expect))
+	{
+	    *at = from;
+	    return true;
+	}
+	from++;
+    }
+    return false;
+}
+
+/* the longest a frame of p can possibly be: verbatim subframes, each
+ * sample one byte wider for side channels, plus headers */
+static size_t frame_max_bytes(const file_info_struct *p)
+{
+    return (size_t) p->max_blocksize * p->ao_fmt.channels * (p->sam_fmt.bits / 8 + 1) + 64;
+}
+
+/*
+ * Extend the frame table of p without decoding, by following the chain
+ * of frame headers in the mapped file: each one has to start where the
+ * previous one ends in samples.  Stops once sample is covered, at the end
+ * of the stream or after looking through limit bytes.  Returns whether
+ * sample is covered.
+ */
+FLAC__bool frames_scan(file_info_struct *p, FLAC__uint64 sample, size_t limit)
+{
+    frame_table *f = &p->frames;
+    const FLAC__byte *map;
+    size_t size, at, stop;
+    FLAC__uint64 s;
+    unsigned blocksize;
+    FLAC__bool variable;
+
+    if (!p->input || f->count == 0 || f->complete ||
+	!(map = input_map(p->input, &size)) || f->offset[0] + 2 > size)
+    {
+	return false;
+    }
+    variable = map[f->offset[0] + 1] & 1;
+
+    /* the last entry is the start of a frame not in the table yet */
+    at = f->offset[f->count - 1];
+    if (at >= size || !frame_header_at(map + at, size - at, p, variable, &s, &blocksize) ||
+	s != f->sample[f->count - 1])
+    {
+	return false;
+    }
+
+    stop = limit < size - at ? at + limit : size;
+    while (s <= sample) {
+	if (s + blocksize >= p->total_samples)
+	    return false; /* in the last frame, whose end is not known */
+	if (!next_header(map, size, at + 1, stop, p, variable, s + blocksize,
+			 &at, &s, &blocksize))
+	{
+	    return false;
+	}
+	frames_add(f, s, at);
+    }
+    return true;
+}
+
+/*
+ * Find the start of the frame holding sample in the mapped file, beyond
+ * the frame table of p, by interpolation and bisection over frame headers.
+ * Nothing is decoded, so this only touches a few pages of the file.
+ */
+FLAC__bool frames_locate(file_info_struct *p, FLAC__uint64 sample,
+			 FLAC__uint64 *offset, FLAC__uint64 *frame_sample)
+{
+    const frame_table *f = &p->frames;
+    const FLAC__byte *map;
+    size_t size, lo, hi, probe, from, at, next;
+    FLAC__uint64 lo_sample, hi_sample, s, s2;
+    unsigned blocksize, lo_blocksize, blocksize2, round;
+    FLAC__bool variable, found;
+
+    if (!p->input || f->count == 0 || sample >= p->total_samples ||
+	!(map = input_map(p->input, &size)) || f->offset[0] + 2 > size)
+    {
+	return false;
+    }
+    variable = map[f->offset[0] + 1] & 1;
+
+    /* lo is a known frame at or before sample, hi a bound after it */
+    lo = f->offset[f->count - 1];
+    lo_sample = f->sample[f->count - 1];
+    if (lo_sample > sample) {
+	lo = f->offset[0];
+	lo_sample = 0;
+    }
+    if (lo >= size || !frame_header_at(map + lo, size - lo, p, variable, &s, &lo_blocksize) ||
+	s != lo_sample)
+    {
+	return false;
+    }
+    hi = size;
+    hi_sample = p->total_samples;
+
+    for (round = 0; round < 64 && sample >= lo_sample + lo_blocksize &&
+	     hi - lo > 2 * frame_max_bytes(p); round++)
+    {
+	/* interpolate, but bisect every other time so bad guesses are cheap */
+	if (round & 1)
+	    probe = lo + (hi - lo) / 2;
+	else
+	    probe = lo + (size_t) ((double) (sample - lo_sample) / (hi_sample - lo_sample) * (hi - lo));
+	if (probe <= lo)
+	    probe = lo + 1;
+
+	/* a header only counts when the next frame follows it */
+	found = false;
+	for (from = probe; !found && next_header(map, size, from, hi, p, variable,
+						 NO_SAMPLE, &at, &s, &blocksize);
+	     from = at + 1)
+	{
+	    found = s > lo_sample && s < hi_sample &&
+		(s + blocksize >= p->total_samples ||
+		 next_header(map, size, at + 1, at + 1 + frame_max_bytes(p), p, variable,
+			     s + blocksize, &next, &s2, &blocksize2));
+	}
+	if (!found) {
+	    hi = probe; /* the frame we want starts before probe */
+	    continue;
+	}
+
+	if (s <= sample) {
+	    lo = at;
+	    lo_sample = s;
+	    lo_blocksize = blocksize;
+	} else {
+	    hi = at;
+	    hi_sample = s;
+	}
+    }
+
+    /* walk the chain the rest of the way */
+    while (sample >= lo_sample + lo_blocksize) {
+	if (!next_header(map, size, lo + 1, lo + 1 + frame_max_bytes(p), p, variable,
+			 lo_sample + lo_blocksize, &lo, &lo_sample, &lo_blocksize))
+	{
+	    return false;
+	}
+    }
+
+    *offset = lo;
+    *frame_sample = lo_sample;
+    return true;
+}
+
+/* make room for count entries in f */
+void frames_reserve(frame_table *f, unsigned count)
+{
+    FLAC__uint64 *s, *o;
+
+    if (count <= f->size)
+	return;
+
+    if (!(s = realloc(f->sample, count * sizeof(FLAC__uint64))))
+	return;
+    f->sample = s;
+    if (!(o = realloc(f->offset, count * sizeof(FLAC__uint64))))
+	return;
+    f->offset = o;
+    f->size = count;
+
+    realtime_prefault(f->sample, count * sizeof(FLAC__uint64));
+    realtime_prefault(f->offset, count * sizeof(FLAC__uint64));
+}
+
+void frames_add(frame_table *f, FLAC__uint64 sample, FLAC__uint64 offset)
+{
+    if (f->count == f->size) {
+	frames_reserve(f, f->size ? 2 * f->size : 1024);
+	if (f->count == f->size)
+	    return;
+    }
+
+    f->sample[f->count] = sample;
+    f->offset[f->count] = offset;
+    f->count++;
+    f->dirty = true;
+}
+
+/* the frame holding sample, if its start and end are both known */
+FLAC__bool frames_find(const frame_table *f, FLAC__uint64 sample, unsigned *frame)
+{
+    unsigned lo = 0, hi = f->count, mid;
+
+    if (f->count < 2 || sample >= f->sample[f->count - 1])
+	return false;
+
+    /* the last frame starting at or before sample */
+    while (hi - lo > 1) {
+	mid = lo + (hi - lo) / 2;
+	if (f->sample[mid] <= sample)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    *frame = lo;
+    return sample >= f->sample[lo];
+}
+
+void frames_free(frame_table *f)
+{
+    free(f->sample);
+    free(f->offset);
+    memset(f, 0, sizeof(frame_table));
+}
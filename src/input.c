@@ -0,0 +1,484 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This input.c module feeds the decoder from a memory mapped file.  The
+ *  stream callbacks below copy straight out of the mapping, so reading a
+ *  frame costs no system call and seeking is just moving an offset.
+ *  Standard input, inherited descriptors, FIFOs and devices cannot be
+ *  mapped; a thread reads them ahead of the decoder into a ring instead,
+ *  so that a slow or bursty source does not starve it.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "flac123.h"
+
+/* the largest single read() of the read-ahead thread */
+#define STREAM_READ_MAX (64 * 1024)
+
+/* a descriptor that cannot be mapped, read ahead by a thread */
+typedef struct {
+    char *name;
+    int fd;
+    FLAC__bool own_fd;       /* opened by us, not stdin or fd:N */
+    FLAC__byte *buf;
+    size_t size;
+    _Atomic uint64_t head;   /* bytes read from fd */
+    _Atomic uint64_t tail;   /* bytes handed to the decoder */
+    atomic_int eof;          /* nothing more will be read */
+    int error;               /* errno of the read that failed, if one did */
+    int stop;                /* input_close() wants the thread to end */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t data;     /* head moved or eof was set */
+    pthread_cond_t space;    /* tail moved or stop was set */
+} input_stream;
+
+struct input_source {
+    const FLAC__byte *map;
+    size_t size;
+    size_t pos;
+    size_t hole_start;       /* reading jumps from here to hole_end */
+    size_t hole_end;
+    FLAC__bool borrowed;     /* a slice of another input's mapping */
+    input_stream *stream;    /* not mapped but read ahead, map is NULL */
+};
+
+/* "fLaC", then STREAMINFO: a 4 byte block header and 34 bytes of data */
+#define STREAMINFO_END 42
+
+static void *stream_thread(void *arg)
+{
+    input_stream *s = (input_stream *) arg;
+    uint64_t head = 0;
+    size_t offset, n;
+    ssize_t got;
+    int stop;
+
+    /* only while it waits in read() can input_close() cancel it */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (;;) {
+	pthread_mutex_lock(&s->lock);
+	while (!s->stop && head - atomic_load(&s->tail) == s->size)
+	    pthread_cond_wait(&s->space, &s->lock);
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+	if (stop)
+	    break;
+
+	offset = (size_t) (head % s->size);
+	n = s->size - (size_t) (head - atomic_load(&s->tail));
+	if (n > s->size - offset)
+	    n = s->size - offset;
+	if (n > STREAM_READ_MAX)
+	    n = STREAM_READ_MAX;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	got = read(s->fd, s->buf + offset, n);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	if (got < 0 && errno == EINTR)
+	    continue;
+	if (got > 0)
+	    atomic_store(&s->head, head += (size_t) got);
+	else
+	    s->error = got < 0 ? errno : 0;
+
+	pthread_mutex_lock(&s->lock);
+	if (got <= 0)
+	    atomic_store(&s->eof, 1);
+	pthread_cond_signal(&s->data);
+	pthread_mutex_unlock(&s->lock);
+	if (got <= 0)
+	    break;
+    }
+    return NULL;
+}
+
+/* wait until at least want bytes are buffered or the end was reached,
+ * returns how many are */
+static size_t stream_wait(input_stream *s, size_t want)
+{
+    uint64_t tail = atomic_load(&s->tail);
+
+    pthread_mutex_lock(&s->lock);
+    while (atomic_load(&s->head) - tail < want && !atomic_load(&s->eof))
+	pthread_cond_wait(&s->data, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    /* eof is set after the last head */
+    return (size_t) (atomic_load(&s->head) - tail);
+}
+
+/* move up to len buffered bytes to buffer, 0 at the end */
+static size_t stream_read(input_stream *s, FLAC__byte *buffer, size_t len)
+{
+    uint64_t tail = atomic_load(&s->tail);
+    size_t n = stream_wait(s, 1), offset = (size_t) (tail % s->size), first;
+
+    if (n > len)
+	n = len;
+    first = s->size - offset < n ? s->size - offset : n;
+    memcpy(buffer, s->buf + offset, first);
+    memcpy(buffer + first, s->buf, n - first);
+
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->tail, tail + n);
+    pthread_cond_signal(&s->space);
+    pthread_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+static void stream_close(input_stream *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_signal(&s->space);
+    pthread_mutex_unlock(&s->lock);
+
+    /* a pipe may not deliver another byte for a long time */
+    pthread_cancel(s->thread);
+    pthread_join(s->thread, NULL);
+
+    if (s->own_fd)
+	close(s->fd);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->data);
+    pthread_cond_destroy(&s->space);
+    free(s->buf);
+    free(s->name);
+    free(s);
+}
+
+/* start reading fd ahead into --read-ahead KiB */
+static input_source *stream_open(const char *name, int fd, FLAC__bool own_fd)
+{
+    input_source *in = calloc(1, sizeof(input_source));
+    input_stream *s = calloc(1, sizeof(input_stream));
+    size_t size = (size_t) (decode_args.read_ahead > 0 ? decode_args.read_ahead :
+			    READ_AHEAD_DEFAULT) * 1024;
+
+    if (!in || !s || !(s->buf = malloc(size)) || !(s->name = strdup(name))) {
+	fprintf(stderr, "Out of memory\n");
+	goto fail;
+    }
+    realtime_prefault(s->buf, size);
+    s->size = size;
+    s->fd = fd;
+    s->own_fd = own_fd;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->data, NULL);
+    pthread_cond_init(&s->space, NULL);
+
+    if (pthread_create(&s->thread, NULL, stream_thread, s) != 0) {
+	fprintf(stderr, "Error starting input thread\n");
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->data);
+	pthread_cond_destroy(&s->space);
+	goto fail;
+    }
+    in->stream = s;
+    return in;
+
+fail:
+    if (s) {
+	free(s->buf);
+	free(s->name);
+    }
+    free(s);
+    free(in);
+    if (own_fd)
+	close(fd);
+    return NULL;
+}
+
+/* whether filename is - for stdin or fd:N for an inherited descriptor
+ * rather than the name of a file */
+FLAC__bool input_is_stream(const char *filename)
+{
+    return strcmp(filename, "-") == 0 || strncmp(filename, "fd:", 3) == 0;
+}
+
+/*
+ * Map filename, or read it ahead on a thread if it is stdin, an
+ * inherited descriptor, a FIFO or a device.  NULL if it cannot be opened
+ * or is a regular file that cannot be mapped.
+ */
+input_source *input_open(const char *filename)
+{
+    input_source *in;
+    struct stat st;
+    char *end;
+    void *map;
+    int fd;
+
+    if (strcmp(filename, "-") == 0)
+	return stream_open(filename, STDIN_FILENO, false);
+    if (strncmp(filename, "fd:", 3) == 0) {
+	fd = (int) strtol(filename + 3, &end, 10);
+	if (end == filename + 3 || *end != '\0' || fcntl(fd, F_GETFL) < 0) {
+	    fprintf(stderr, "%s is not an open file descriptor\n", filename);
+	    return NULL;
+	}
+	return stream_open(filename, fd, false);
+    }
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+	return NULL;
+
+    if (fstat(fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+	close(fd);
+	return NULL;
+    }
+    if (!S_ISREG(st.st_mode))
+	return stream_open(filename, fd, true);
+
+    if (st.st_size == 0 || (uintmax_t) st.st_size > SIZE_MAX) {
+	close(fd);
+	return NULL;
+    }
+
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* the mapping keeps the file open */
+    if (map == MAP_FAILED)
+	return NULL;
+
+    if (!(in = malloc(sizeof(input_source)))) {
+	munmap(map, (size_t) st.st_size);
+	return NULL;
+    }
+    in->map = map;
+    in->size = (size_t) st.st_size;
+    in->pos = 0;
+    in->hole_start = in->hole_end = 0;
+    in->borrowed = false;
+    in->stream = NULL;
+
+    input_advise(in, INPUT_SEQUENTIAL);
+
+    return in;
+}
+
+void input_close(input_source *in)
+{
+    if (!in)
+	return;
+
+    if (in->stream)
+	stream_close(in->stream);
+    else if (!in->borrowed)
+	munmap((void *) in->map, in->size);
+    free(in);
+}
+
+/* whether the decoder can seek in, false for pipes and the like */
+FLAC__bool input_seekable(input_source *in)
+{
+    return in && !in->stream;
+}
+
+/* whether in is an Ogg stream rather than native FLAC */
+FLAC__bool input_is_ogg(input_source *in)
+{
+    input_stream *s;
+    FLAC__byte magic[4];
+    unsigned i;
+
+    if (!in)
+	return false;
+    if (!(s = in->stream))
+	return in->size >= 4 && memcmp(in->map, "OggS", 4) == 0;
+
+    if (stream_wait(s, 4) < 4)
+	return false;
+    for (i = 0; i < 4; i++)
+	magic[i] = s->buf[(atomic_load(&s->tail) + i) % s->size];
+    return memcmp(magic, "OggS", 4) == 0;
+}
+
+/* tell the kernel whether to read ahead (playback) or not (seeking) */
+void input_advise(input_source *in, int pattern)
+{
+    if (!in || in->stream)
+	return;
+
+    madvise((void *) in->map, in->size,
+	    pattern == INPUT_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL);
+}
+
+/*
+ * Let the decoder see STREAMINFO only, flagged as the last metadata
+ * block, and continue right at the first frame.  The other blocks, which
+ * may hold megabytes of pictures, are never touched.  Offsets stay those
+ * of the real file.
+ */
+void input_skip_metadata(input_source *in, FLAC__uint64 first_frame)
+{
+    if (!in || first_frame <= STREAMINFO_END || first_frame > in->size ||
+	in->size < STREAMINFO_END || memcmp(in->map, "fLaC", 4) != 0 ||
+	(in->map[4] & 0x7F) != FLAC__METADATA_TYPE_STREAMINFO)
+    {
+	return; /* e.g. an ID3v2 tag in front of the stream */
+    }
+
+    in->hole_start = STREAMINFO_END;
+    in->hole_end = (size_t) first_frame;
+}
+
+/*
+ * A second reader of the mapping of in that sees the stream header and
+ * STREAMINFO, then the frames from start up to end, where it ends.  This
+ * lets an independent decoder work on one stretch of the file.  NULL if
+ * the file does not start with STREAMINFO.  Must be closed before in.
+ */
+input_source *input_slice(input_source *in, FLAC__uint64 start, FLAC__uint64 end)
+{
+    input_source *slice;
+
+    if (!in || start > end || end > in->size || start <= STREAMINFO_END)
+	return NULL;
+    if (!(slice = malloc(sizeof(input_source))))
+	return NULL;
+
+    *slice = *in;
+    slice->size = (size_t) end;
+    slice->pos = 0;
+    slice->hole_start = slice->hole_end = 0;
+    slice->borrowed = true;
+
+    input_skip_metadata(slice, start);
+    if (slice->hole_end != start) {
+	free(slice);
+	return NULL;
+    }
+    return slice;
+}
+
+/* the whole file, for parsing it without a decoder.  NULL and size 0
+ * if it is not mapped. */
+const FLAC__byte *input_map(input_source *in, size_t *size)
+{
+    *size = 0;
+    if (!in || in->stream)
+	return NULL;
+    *size = in->size;
+    return in->map;
+}
+
+void input_set_position(input_source *in, FLAC__uint64 offset)
+{
+    if (in && !in->stream && offset <= in->size)
+	in->pos = (size_t) offset;
+}
+
+/* the decoder callbacks get the same client data as flac_write_hdl() */
+static input_source *input_of(void *data)
+{
+    file_info_struct *p = (file_info_struct *) data;
+
+    if (p->preloading)
+	p = p->next;
+    return p->input;
+}
+
+FLAC__StreamDecoderReadStatus input_read_hdl(const FLAC__StreamDecoder *dec,
+					     FLAC__byte buffer[], size_t *bytes,
+					     void *data)
+{
+    input_source *in = input_of(data);
+    size_t n = in->size - in->pos;
+
+    if (in->stream) {
+	if ((n = stream_read(in->stream, buffer, *bytes)) == 0 && in->stream->error)
+	    fprintf(stderr, "Error reading %s: %s\n", in->stream->name,
+		    strerror(in->stream->error));
+	in->pos += n;
+	*bytes = n;
+	return n ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE :
+	    in->stream->error ? FLAC__STREAM_DECODER_READ_STATUS_ABORT :
+	    FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+
+    if (n == 0) {
+	*bytes = 0;
+	return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+    if (n > *bytes)
+	n = *bytes;
+    if (in->pos < in->hole_start && n > in->hole_start - in->pos)
+	n = in->hole_start - in->pos;
+
+    memcpy(buffer, in->map + in->pos, n);
+    if (in->pos <= 4 && in->pos + n > 4 && in->hole_start)
+	buffer[4 - in->pos] |= 0x80; /* last metadata block */
+    in->pos += n;
+    if (in->pos == in->hole_start)
+	in->pos = in->hole_end;
+    *bytes = n;
+
+    return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+FLAC__StreamDecoderSeekStatus input_seek_hdl(const FLAC__StreamDecoder *dec,
+					     FLAC__uint64 offset, void *data)
+{
+    input_source *in = input_of(data);
+
+    if (in->stream)
+	return FLAC__STREAM_DECODER_SEEK_STATUS_UNSUPPORTED;
+    if (offset > in->size)
+	return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+
+    in->pos = (size_t) offset;
+    return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+FLAC__StreamDecoderTellStatus input_tell_hdl(const FLAC__StreamDecoder *dec,
+					     FLAC__uint64 *offset, void *data)
+{
+    *offset = input_of(data)->pos;
+    return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+FLAC__StreamDecoderLengthStatus input_length_hdl(const FLAC__StreamDecoder *dec,
+						 FLAC__uint64 *length, void *data)
+{
+    input_source *in = input_of(data);
+
+    if (in->stream)
+	return FLAC__STREAM_DECODER_LENGTH_STATUS_UNSUPPORTED;
+    *length = in->size;
+    return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+FLAC__bool input_eof_hdl(const FLAC__StreamDecoder *dec, void *data)
+{
+    input_source *in = input_of(data);
+
+    if (in->stream)
+	return atomic_load(&in->stream->eof) &&
+	    atomic_load(&in->stream->head) == atomic_load(&in->stream->tail);
+    return in->pos >= in->size;
+}
@@ -0,0 +1,165 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This libflac123.c module is the API of libflac123, see libflac123.h.
+ *  A flac123_player is the file_info_struct decode.c works on, without a
+ *  pcm_fn: flac_write_hdl() leaves the converted PCM of every frame in
+ *  aobuf, and flac123_read() copies it out from there, decoding the next
+ *  frame whenever it runs out.  The settings are the defaults of
+ *  decode_args.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+#include "libflac123.h"
+
+struct flac123_player {
+    file_info_struct info;
+    file_info_struct next;   /* never preloaded, but the core expects it */
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/* what main() does before anything is decoded */
+static void library_init(void)
+{
+    convert_init();
+    resample_init();
+}
+
+flac123_player *flac123_new(void)
+{
+    flac123_player *pl;
+
+    pthread_once(&init_once, library_init);
+
+    if (!(pl = calloc(1, sizeof(flac123_player))))
+	return NULL;
+    pl->info.next = &pl->next;
+
+    return pl;
+}
+
+void flac123_delete(flac123_player *pl)
+{
+    if (!pl)
+	return;
+
+    flac123_close(pl);
+    free(pl->info.aobuf);
+    free(pl->info.noise);
+    free(pl);
+}
+
+int flac123_open(flac123_player *pl, const char *path)
+{
+    file_info_struct *p = &pl->info;
+
+    flac123_close(pl);
+    if (!decoder_open(p, path))
+	return -1;
+
+    p->is_loaded = true;
+    return 0;
+}
+
+void flac123_close(flac123_player *pl)
+{
+    if (pl->info.is_loaded)
+	decoder_destructor(&pl->info);
+}
+
+int flac123_get_format(const flac123_player *pl, flac123_format *fmt)
+{
+    const file_info_struct *p = &pl->info;
+
+    if (!p->is_loaded)
+	return -1;
+
+    fmt->rate = p->ao_fmt.rate;
+    fmt->bits = p->ao_fmt.bits;
+    fmt->channels = p->ao_fmt.channels;
+    return 0;
+}
+
+long flac123_read(flac123_player *pl, void *buf, size_t size)
+{
+    file_info_struct *p = &pl->info;
+    uint_8 *out = buf;
+    size_t done = 0, n;
+
+    if (!p->is_loaded)
+	return -1;
+
+    while (done < size) {
+	if (p->pending_len == 0) {
+	    if (decoder_state(p) == FLAC__STREAM_DECODER_END_OF_STREAM)
+		break;
+	    /* a failed seek leaves the decoder in an error state as well */
+	    if (decoder_state(p) > FLAC__STREAM_DECODER_END_OF_STREAM || !decoder_process(p))
+		return done > 0 ? (long) done : -1;
+	    continue;
+	}
+
+	n = p->pending_len < size - done ? p->pending_len : size - done;
+	memcpy(out + done, p->pending, n);
+	p->pending += n;
+	p->pending_len -= n;
+	done += n;
+    }
+
+    return (long) done;
+}
+
+int flac123_seek(flac123_player *pl, uint64_t sample)
+{
+    file_info_struct *p = &pl->info;
+
+    if (!p->is_loaded || (p->total_samples && sample > p->total_samples))
+	return -1;
+
+    /* libFLAC may write out the rest of the frame holding sample while
+     * it seeks, and that counts from sample on */
+    p->pending_len = 0;
+    p->current_sample = sample;
+    p->elapsed_time = (float) sample / p->ao_fmt.rate;
+    return decoder_seek(p, sample) ? 0 : -1;
+}
+
+void flac123_set_gain(flac123_player *pl, double db)
+{
+    pl->info.user_gain_db = db;
+    gain_update(&pl->info);
+}
+
+uint64_t flac123_tell(const flac123_player *pl)
+{
+    const file_info_struct *p = &pl->info;
+    unsigned bytes = p->ao_fmt.channels * (p->ao_fmt.bits / 8);
+
+    if (!p->is_loaded || bytes == 0)
+	return 0;
+    /* what is still in aobuf has been counted already */
+    return p->current_sample - p->pending_len / bytes;
+}
+
+uint64_t flac123_length(const flac123_player *pl)
+{
+    return pl->info.is_loaded ? pl->info.total_samples : 0;
+}
@@ -0,0 +1,96 @@
+/*
+ *  libflac123 - the decoder of flac123 as a library
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  A flac123_player opens a FLAC file (or Ogg FLAC, "-", fd:N or a
+ *  FIFO), and hands out its audio as PCM in whatever portions the caller
+ *  asks for, seeking to the exact sample.  Players are independent of
+ *  each other: any number of them can be used at the same time, each on
+ *  a thread of its own.  A single player must not be used by two threads
+ *  at once.
+ *
+ *  Messages about broken files are printed to stderr, as by flac123.
+ *  Link with -lflac123 -lFLAC -logg -lpthread -lm (or whatever
+ *  `pkg-config --libs --static flac` says libFLAC needs).  Only the
+ *  flac123_ functions below are exported; the rest of the decoder is
+ *  local to libflac123.a.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef LIBFLAC123_H
+#define LIBFLAC123_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define FLAC123_API __attribute__((visibility("default")))
+#else
+#define FLAC123_API
+#endif
+
+typedef struct flac123_player flac123_player;
+
+/* of the PCM flac123_read() returns: interleaved, native endian, signed,
+ * except that 8 bit samples are unsigned.  Files of 12 or 20 bit come
+ * as 16 or 24 bit. */
+typedef struct {
+    unsigned rate;
+    unsigned bits;
+    unsigned channels;
+} flac123_format;
+
+/* NULL if out of memory */
+FLAC123_API flac123_player *flac123_new(void);
+FLAC123_API void flac123_delete(flac123_player *pl);
+
+/* 0 once path is open and its metadata read, -1 if it cannot be opened
+ * or is not FLAC.  Whatever pl had open before is closed. */
+FLAC123_API int flac123_open(flac123_player *pl, const char *path);
+FLAC123_API void flac123_close(flac123_player *pl);
+
+/* the format of the open file; -1 if none is open */
+FLAC123_API int flac123_get_format(const flac123_player *pl,
+				   flac123_format *fmt);
+
+/* decode into buf up to size bytes of PCM, and return how many were
+ * stored: 0 at the end of the file, -1 if nothing could be decoded.  If
+ * size is not a multiple of channels * bits / 8, the next call continues
+ * where the last sample was cut. */
+FLAC123_API long flac123_read(flac123_player *pl, void *buf, size_t size);
+
+/* continue at sample, 0 being the first.  0, or -1 if it cannot be
+ * reached (a pipe, or past the end). */
+FLAC123_API int flac123_seek(flac123_player *pl, uint64_t sample);
+
+/* amplify the PCM by db decibels, negative to attenuate.  ReplayGain
+ * peak tags keep it from clipping. */
+FLAC123_API void flac123_set_gain(flac123_player *pl, double db);
+
+/* the sample the next flac123_read() starts at, and how many samples
+ * the file has (0 if unknown) */
+FLAC123_API uint64_t flac123_tell(const flac123_player *pl);
+FLAC123_API uint64_t flac123_length(const flac123_player *pl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
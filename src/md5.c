@@ -0,0 +1,150 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This md5.c module is an implementation of the MD5 message digest
+ *  (RFC 1321), for checking the signature in STREAMINFO when the audio
+ *  is not decoded by one libFLAC decoder from start to end.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include "flac123.h"
+
+/* per round: sines of 1..64 scaled to 32 bits, and rotations */
+static const uint_32 md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(uint_32 state[4], const uint_8 *block)
+{
+    uint_32 w[16], a = state[0], b = state[1], c = state[2], d = state[3], f, t;
+    unsigned i, g;
+
+    for (i = 0; i < 16; i++)
+	w[i] = (uint_32) block[4 * i] | (uint_32) block[4 * i + 1] << 8 |
+	    (uint_32) block[4 * i + 2] << 16 | (uint_32) block[4 * i + 3] << 24;
+
+    for (i = 0; i < 64; i++) {
+	if (i < 16) {
+	    f = (b & c) | (~b & d);
+	    g = i;
+	} else if (i < 32) {
+	    f = (d & b) | (~d & c);
+	    g = (5 * i + 1) & 15;
+	} else if (i < 48) {
+	    f = b ^ c ^ d;
+	    g = (3 * i + 5) & 15;
+	} else {
+	    f = c ^ (b | ~d);
+	    g = (7 * i) & 15;
+	}
+	t = d;
+	d = c;
+	c = b;
+	f += a + md5_k[i] + w[g];
+	b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+	a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void md5_init(md5_context *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->bytes = 0;
+}
+
+void md5_update(md5_context *ctx, const void *data, size_t len)
+{
+    const uint_8 *in = (const uint_8 *) data;
+    unsigned used = (unsigned) (ctx->bytes & 63), n;
+
+    ctx->bytes += len;
+
+    if (used) {
+	n = 64 - used < len ? 64 - used : (unsigned) len;
+	memcpy(ctx->buffer + used, in, n);
+	in += n;
+	len -= n;
+	if (used + n < 64)
+	    return;
+	md5_block(ctx->state, ctx->buffer);
+    }
+    for (; len >= 64; in += 64, len -= 64)
+	md5_block(ctx->state, in);
+    memcpy(ctx->buffer, in, len);
+}
+
+void md5_final(md5_context *ctx, uint_8 digest[16])
+{
+    static const uint_8 pad[64] = { 0x80 };
+    FLAC__uint64 bits = ctx->bytes * 8;
+    uint_8 length[8];
+    unsigned i, used = (unsigned) (ctx->bytes & 63);
+
+    for (i = 0; i < 8; i++)
+	length[i] = (uint_8) (bits >> (8 * i));
+    md5_update(ctx, pad, used < 56 ? 56 - used : 120 - used);
+    md5_update(ctx, length, 8);
+
+    for (i = 0; i < 16; i++)
+	digest[i] = (uint_8) (ctx->state[i / 4] >> (8 * (i % 4)));
+}
+
+/* lay out a decoded frame the way the STREAMINFO signature is computed:
+ * interleaved, bytes per sample little endian signed values.  Returns the
+ * number of bytes written to out. */
+size_t md5_pack(uint_8 *out, const FLAC__int32 * const buf[], unsigned channels,
+		unsigned samples, unsigned bytes)
+{
+    unsigned sample, channel, i;
+    uint_8 *o = out;
+    FLAC__int32 v;
+
+    for (sample = 0; sample < samples; sample++) {
+	for (channel = 0; channel < channels; channel++) {
+	    v = buf[channel][sample];
+	    for (i = 0; i < bytes; i++)
+		*o++ = (uint_8) (v >> (8 * i));
+	}
+    }
+    return o - out;
+}
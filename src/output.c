@@ -0,0 +1,337 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This output.c module decouples decoding from the audio device.  The
+ *  decoder is the single producer of a PCM ring buffer and a dedicated
+ *  output thread is its single consumer, draining it into ao_play().
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+
+/* never let the ring get smaller than this many sample frames */
+#define RING_MIN_FRAMES 4096
+
+/* the output thread hands at most 1/RING_CHUNKS of the ring to ao_play()
+ * at a time so that pause and flush requests are noticed promptly */
+#define RING_CHUNKS 8
+
+/*
+ * head and tail are running byte counts that never wrap in practice; the
+ * position inside buf is the count modulo size.  Only the decoder thread
+ * stores head and flush_to, only the output thread stores tail, so the
+ * data path needs no lock.  The mutex and condition variables are only
+ * touched when one side has to go to sleep.
+ */
+struct pcm_ring {
+    uint_8 *buf;
+    size_t size;             /* bytes, a multiple of frame_bytes */
+    size_t frame_bytes;      /* bytes per interleaved sample frame */
+    unsigned rate;
+    unsigned ms;             /* requested depth in milliseconds */
+    ao_device *dev;
+    stats_histogram *play;   /* times ao_play(), may be NULL */
+
+    _Atomic uint64_t head;     /* bytes written by the decoder */
+    _Atomic uint64_t tail;     /* bytes played by the output thread */
+    _Atomic uint64_t flush_to; /* discard everything before this byte */
+    atomic_int paused;
+    atomic_int quit;
+    atomic_int want_space;   /* decoder is sleeping on a full ring */
+    atomic_int want_data;    /* output thread is sleeping on an empty ring */
+    atomic_int interrupt;    /* ring_write_some() should stop waiting */
+
+    pthread_mutex_t lock;
+    pthread_cond_t space;
+    pthread_cond_t data;
+    pthread_t thread;
+};
+
+static void ring_wake_decoder(pcm_ring *r)
+{
+    if (atomic_load(&r->want_space)) {
+	pthread_mutex_lock(&r->lock);
+	pthread_cond_signal(&r->space);
+	pthread_mutex_unlock(&r->lock);
+    }
+}
+
+static void ring_wake_output(pcm_ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->data);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* output thread: honour flush requests, returns bytes ready to play */
+static uint64_t ring_ready(pcm_ring *r, uint64_t *tail)
+{
+    uint64_t flush_to = atomic_load(&r->flush_to);
+
+    *tail = atomic_load(&r->tail);
+    if (flush_to > *tail) {
+	*tail = flush_to;
+	atomic_store(&r->tail, flush_to);
+	ring_wake_decoder(r);
+    }
+    return atomic_load(&r->head) - *tail;
+}
+
+static void *ring_thread(void *arg)
+{
+    pcm_ring *r = (pcm_ring *) arg;
+    uint64_t tail, avail;
+    size_t offset, chunk, max_chunk;
+    FLAC__uint64 start = 0;
+    sigset_t all;
+
+    /* signals such as SIGINT are for the decoder thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    realtime_thread();
+
+    for (;;) {
+	avail = ring_ready(r, &tail);
+
+	if (avail == 0 || atomic_load(&r->paused)) {
+	    if (atomic_load(&r->quit))
+		break;
+
+	    pthread_mutex_lock(&r->lock);
+	    atomic_store(&r->want_data, 1);
+	    while (!atomic_load(&r->quit) &&
+		   atomic_load(&r->flush_to) <= atomic_load(&r->tail) &&
+		   (atomic_load(&r->head) == atomic_load(&r->tail) ||
+		    atomic_load(&r->paused)))
+		pthread_cond_wait(&r->data, &r->lock);
+	    atomic_store(&r->want_data, 0);
+	    pthread_mutex_unlock(&r->lock);
+	    continue;
+	}
+
+	offset = tail % r->size;
+	max_chunk = (r->size / RING_CHUNKS) / r->frame_bytes * r->frame_bytes;
+	chunk = r->size - offset;
+	if (chunk > avail)
+	    chunk = avail;
+	if (max_chunk && chunk > max_chunk)
+	    chunk = max_chunk;
+
+	if (r->play)
+	    start = stats_clock();
+	ao_play(r->dev, (char *)(r->buf + offset), chunk);
+	if (r->play)
+	    stats_since(r->play, start);
+
+	atomic_store(&r->tail, tail + chunk);
+	ring_wake_decoder(r);
+    }
+
+    return NULL;
+}
+
+/* a ring of ms milliseconds, its ao_play() calls are counted in play */
+pcm_ring *ring_new(unsigned ms, stats_histogram *play)
+{
+    pcm_ring *r = calloc(1, sizeof(pcm_ring));
+
+    if (!r)
+	return NULL;
+
+    r->ms = ms;
+    r->play = play;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->space, NULL);
+    pthread_cond_init(&r->data, NULL);
+
+    if (pthread_create(&r->thread, NULL, ring_thread, r) != 0) {
+	fprintf(stderr, "Error starting output thread\n");
+	free(r);
+	return NULL;
+    }
+
+    return r;
+}
+
+/* wait until the output thread has played everything queued so far */
+void ring_drain(pcm_ring *r)
+{
+    if (!r)
+	return;
+
+    if (atomic_load(&r->paused))
+	ring_flush(r); /* nobody is going to play it */
+
+    pthread_mutex_lock(&r->lock);
+    atomic_store(&r->want_space, 1);
+    while (atomic_load(&r->tail) != atomic_load(&r->head))
+	pthread_cond_wait(&r->space, &r->lock);
+    atomic_store(&r->want_space, 0);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* (re)bind the ring to an output device.  The ring is drained first, so
+ * the previous device may be closed by the caller once this returns. */
+FLAC__bool ring_set_device(pcm_ring *r, ao_device *dev, const ao_sample_format *fmt)
+{
+    size_t frame_bytes = fmt->channels * ((fmt->bits + 7) / 8);
+    size_t frames = (size_t) fmt->rate * r->ms / 1000;
+    uint_8 *buf;
+
+    ring_drain(r);
+
+    if (frames < RING_MIN_FRAMES)
+	frames = RING_MIN_FRAMES;
+
+    if (frame_bytes * frames != r->size) {
+	if (!(buf = realloc(r->buf, frame_bytes * frames))) {
+	    fprintf(stderr, "Error allocating %lu byte output ring\n",
+		    (unsigned long) (frame_bytes * frames));
+	    return false;
+	}
+	r->buf = buf;
+	r->size = frame_bytes * frames;
+	realtime_prefault(r->buf, r->size);
+    }
+    r->frame_bytes = frame_bytes;
+    r->rate = fmt->rate;
+    r->dev = dev;
+
+    return true;
+}
+
+/* decoder thread: queue up to len bytes, returns how many were queued */
+static size_t ring_put(pcm_ring *r, const uint_8 *data, size_t len, FLAC__bool interruptible)
+{
+    uint64_t head = atomic_load(&r->head);
+    size_t offset, space, n, written = 0;
+
+    while (len > 0) {
+	space = r->size - (size_t) (head - atomic_load(&r->tail));
+
+	if (space == 0) {
+	    pthread_mutex_lock(&r->lock);
+	    atomic_store(&r->want_space, 1);
+	    while (r->size == head - atomic_load(&r->tail) &&
+		   !(interruptible && atomic_load(&r->interrupt)))
+		pthread_cond_wait(&r->space, &r->lock);
+	    atomic_store(&r->want_space, 0);
+	    pthread_mutex_unlock(&r->lock);
+	    if (interruptible && atomic_exchange(&r->interrupt, 0))
+		break;
+	    continue;
+	}
+
+	offset = head % r->size;
+	n = r->size - offset;
+	if (n > space)
+	    n = space;
+	if (n > len)
+	    n = len;
+
+	memcpy(r->buf + offset, data, n);
+	head += n;
+	data += n;
+	len -= n;
+	written += n;
+	atomic_store(&r->head, head);
+
+	if (atomic_load(&r->want_data))
+	    ring_wake_output(r);
+    }
+
+    return written;
+}
+
+/* decoder thread: queue len bytes (whole sample frames) for playback */
+void ring_write(pcm_ring *r, const uint_8 *data, size_t len)
+{
+    ring_put(r, data, len, false);
+}
+
+/* like ring_write(), but a full ring is only waited on until somebody
+ * calls ring_interrupt().  Returns the number of bytes queued, always a
+ * whole number of sample frames. */
+size_t ring_write_some(pcm_ring *r, const uint_8 *data, size_t len)
+{
+    return ring_put(r, data, len, true);
+}
+
+/* any thread: make a waiting ring_write_some() return */
+void ring_interrupt(pcm_ring *r)
+{
+    if (!r)
+	return;
+
+    atomic_store(&r->interrupt, 1);
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->space);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* discard everything queued but not yet handed to ao_play() */
+void ring_flush(pcm_ring *r)
+{
+    if (!r)
+	return;
+
+    atomic_store(&r->flush_to, atomic_load(&r->head));
+    ring_wake_output(r);
+}
+
+void ring_pause(pcm_ring *r, FLAC__bool paused)
+{
+    if (!r)
+	return;
+
+    atomic_store(&r->paused, paused ? 1 : 0);
+    ring_wake_output(r);
+}
+
+/* milliseconds of audio queued but not yet played */
+unsigned ring_pending_ms(pcm_ring *r)
+{
+    uint64_t pending;
+
+    if (!r || r->frame_bytes == 0 || r->rate == 0)
+	return 0;
+
+    pending = atomic_load(&r->head) - atomic_load(&r->tail);
+    return (unsigned) (pending / r->frame_bytes * 1000 / r->rate);
+}
+
+/* play out what is queued, stop the output thread and free the ring */
+void ring_free(pcm_ring *r)
+{
+    if (atomic_load(&r->paused))
+	ring_flush(r);
+    atomic_store(&r->quit, 1);
+    ring_wake_output(r);
+    pthread_join(r->thread, NULL);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->space);
+    pthread_cond_destroy(&r->data);
+    free(r->buf);
+    free(r);
+}
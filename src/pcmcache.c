@@ -0,0 +1,372 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This pcmcache.c module implements --pcm-cache: the decoded samples of
+ *  files that fit are kept in memory, keyed by path, size and mtime, up
+ *  to a total size.  A file played again is then handed to
+ *  flac_write_hdl() frame by frame straight from memory without a
+ *  decoder, and a seek only moves the position.  Frontends that LOAD and
+ *  JUMP around in the same short files all day no longer decode them
+ *  again and again.  When the cache is full, the files played longest ago
+ *  make room first.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+
+/* samples per frame if STREAMINFO does not say */
+#define PCMCACHE_BLOCK 4096
+
+struct pcm_cached {
+    file_info_struct meta;   /* filename, file_size, file_mtime, format, tags */
+    FLAC__int32 *data;       /* meta.total_samples of every channel in turn */
+    size_t bytes;
+    FLAC__uint64 samples;    /* decoded, fewer than total_samples after errors */
+    unsigned refs;           /* tracks playing it */
+    FLAC__bool listed;       /* in the cache, not only played once */
+    struct pcm_cached *prev; /* the list runs from the most recently played */
+    struct pcm_cached *next;
+};
+
+/* the sessions of --daemon share the cache */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pcm_cached *head, *tail;
+static size_t used, limit;
+
+/* parse --pcm-cache: bytes, or K, M or G of them */
+FLAC__bool pcmcache_init(const char *size)
+{
+    static const char units[] = "KMG";
+    unsigned long long bytes;
+    const char *unit;
+    char *end;
+
+    if (!isdigit((unsigned char) *size))
+	return false;
+    bytes = strtoull(size, &end, 10);
+    if (*end != '\0') {
+	if (!(unit = strchr(units, toupper((unsigned char) *end))) || end[1] != '\0')
+	    return false;
+	bytes <<= 10 * (unit - units + 1);
+    }
+    if (bytes == 0 || bytes > SIZE_MAX)
+	return false;
+
+    limit = (size_t) bytes;
+    return true;
+}
+
+/* whether --pcm-cache is on */
+FLAC__bool pcmcache_enabled(void)
+{
+    return limit != 0;
+}
+
+/* what a track played from the cache has instead of its metadata */
+static void copy_metadata(file_info_struct *to, const file_info_struct *from)
+{
+    strcpy(to->filename, from->filename);
+    to->sam_fmt = from->sam_fmt;
+    to->ao_fmt = from->ao_fmt;
+    to->total_samples = from->total_samples;
+    to->total_time = from->total_time;
+    to->max_blocksize = from->max_blocksize;
+    strcpy(to->title, from->title);
+    strcpy(to->artist, from->artist);
+    strcpy(to->album, from->album);
+    strcpy(to->genre, from->genre);
+    strcpy(to->comment, from->comment);
+    strcpy(to->year, from->year);
+    to->has_tags = from->has_tags;
+    to->has_track_gain = from->has_track_gain;
+    to->has_album_gain = from->has_album_gain;
+    to->track_gain = from->track_gain;
+    to->track_peak = from->track_peak;
+    to->album_gain = from->album_gain;
+    to->album_peak = from->album_peak;
+}
+
+static void cached_free(pcm_cached *c)
+{
+    free(c->data);
+    free(c);
+}
+
+/* drop a reference to c, and c with it if the cache does not have it */
+static void cached_unref(pcm_cached *c)
+{
+    FLAC__bool unused;
+
+    pthread_mutex_lock(&cache_lock);
+    unused = --c->refs == 0 && !c->listed;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (unused)
+	cached_free(c);
+}
+
+static void list_remove(pcm_cached *c)
+{
+    if (c->prev)
+	c->prev->next = c->next;
+    else
+	head = c->next;
+    if (c->next)
+	c->next->prev = c->prev;
+    else
+	tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static void list_push(pcm_cached *c)
+{
+    c->prev = NULL;
+    c->next = head;
+    if (head)
+	head->prev = c;
+    else
+	tail = c;
+    head = c;
+}
+
+/* take c out of the cache; the tracks still playing it keep it until
+ * pcmcache_release().  Called with cache_lock held. */
+static void cache_drop(pcm_cached *c)
+{
+    list_remove(c);
+    used -= c->bytes;
+    c->listed = false;
+    if (c->refs == 0)
+	cached_free(c);
+}
+
+/* keep c, which has just been decoded, for the next time */
+static void cache_insert(pcm_cached *c)
+{
+    pcm_cached *old, *prev;
+
+    pthread_mutex_lock(&cache_lock);
+
+    /* an older version of the file, or one another session decoded
+     * at the same time */
+    for (old = head; old; old = old->next)
+	if (strcmp(old->meta.filename, c->meta.filename) == 0) {
+	    cache_drop(old);
+	    break;
+	}
+
+    /* files that are playing right now cannot go */
+    for (old = tail; old && used + c->bytes > limit; old = prev) {
+	prev = old->prev;
+	if (old->refs == 0)
+	    cache_drop(old);
+    }
+
+    if (used + c->bytes <= limit) {
+	list_push(c);
+	used += c->bytes;
+	c->listed = true;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Give the track t the samples of filename from the cache, if it has
+ * them and the file has not changed since.  Then t needs no decoder; it
+ * plays through pcmcache_decode() until decoder_close().
+ */
+FLAC__bool pcmcache_lookup(file_info_struct *t, const char *filename)
+{
+    struct stat st;
+    pcm_cached *c;
+
+    if (!limit || input_is_stream(filename) || strlen(filename) >= PATH_MAX ||
+	stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+	return false;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (c = head; c; c = c->next)
+	if (strcmp(c->meta.filename, filename) == 0)
+	    break;
+    /* a file changed since is decoded again, and replaces this one */
+    if (c && (c->meta.file_size != (FLAC__uint64) st.st_size ||
+	      c->meta.file_mtime != stat_mtime(&st)))
+    {
+	c = NULL;
+    }
+    if (c) {
+	list_remove(c);
+	list_push(c);
+	c->refs++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (t->stats)
+	stats_cache(t->stats, c != NULL);
+    if (!c)
+	return false;
+
+    copy_metadata(t, &c->meta);
+    frames_free(&t->frames);
+    t->file_size = 0; /* index_store() learns nothing new */
+    t->current_sample = 0;
+    t->elapsed_time = 0;
+    t->skip_samples = 0;
+    t->errors = 0;
+    t->cached = c;
+    t->cached_pos = 0;
+
+    return true;
+}
+
+/*
+ * Start keeping the samples of the track t, just opened by decoder_open()
+ * after pcmcache_lookup() did not have it, if they take no more than
+ * half of --pcm-cache.  t plays from its decoder as usual while
+ * flac_write_hdl() copies every frame here, and pcmcache_end() keeps
+ * them once the whole file has been decoded.
+ */
+void pcmcache_begin(file_info_struct *t)
+{
+    FLAC__uint64 total = t->total_samples;
+    unsigned channels = t->ao_fmt.channels;
+    struct stat st;
+    pcm_cached *c;
+
+    if (!limit || total == 0 || channels == 0 ||
+	total > limit / 2 / channels / sizeof(FLAC__int32) ||
+	input_is_stream(t->filename) || stat(t->filename, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+	return;
+    }
+
+    if (!(c = calloc(1, sizeof(pcm_cached))) ||
+	!(c->data = malloc(total * channels * sizeof(FLAC__int32))))
+    {
+	free(c);
+	return;
+    }
+    copy_metadata(&c->meta, t);
+    c->meta.file_size = st.st_size;
+    c->meta.file_mtime = stat_mtime(&st);
+    if (c->meta.max_blocksize == 0)
+	c->meta.max_blocksize = PCMCACHE_BLOCK;
+    c->bytes = total * channels * sizeof(FLAC__int32);
+    c->refs = 1;
+    t->caching = c;
+}
+
+/* called by flac_write_hdl() for every frame of a track pcmcache_begin()
+ * keeps.  False once they do not follow on from the last ones. */
+FLAC__bool pcmcache_store(pcm_cached *c, const FLAC__int32 * const buf[],
+			  FLAC__uint64 sample, unsigned samples)
+{
+    unsigned channel;
+
+    /* after a seek, or more samples than STREAMINFO said */
+    if (sample != c->samples || sample + samples > c->meta.total_samples)
+	return false;
+
+    for (channel = 0; channel < c->meta.ao_fmt.channels; channel++)
+	memcpy(c->data + channel * c->meta.total_samples + sample, buf[channel],
+	       samples * sizeof(FLAC__int32));
+    c->samples += samples;
+    return true;
+}
+
+/*
+ * Stop keeping the samples of t: its decoder has finished, with md5_ok
+ * if the MD5 signature matched, or it seeks, or ran into an error.  They
+ * go into the cache only if they are all of the file.
+ */
+void pcmcache_end(file_info_struct *t, FLAC__bool md5_ok)
+{
+    pcm_cached *c = t->caching;
+
+    if (!c)
+	return;
+    t->caching = NULL;
+
+    if (md5_ok && c->samples == c->meta.total_samples)
+	cache_insert(c);
+    cached_unref(c);
+}
+
+/* decoder_process() of a track played from the cache: the next
+ * max_blocksize samples go to flac_write_hdl() as if decoded */
+FLAC__bool pcmcache_decode(file_info_struct *p)
+{
+    file_info_struct *t = p->preloading ? p->next : p;
+    const pcm_cached *c = t->cached;
+    const FLAC__int32 *buf[FLAC__MAX_CHANNELS];
+    FLAC__Frame frame;
+    unsigned channel, samples;
+
+    if (t->cached_pos >= c->samples)
+	return true;
+
+    samples = c->meta.max_blocksize;
+    if (samples > c->samples - t->cached_pos)
+	samples = (unsigned) (c->samples - t->cached_pos);
+
+    memset(&frame.header, 0, sizeof(frame.header));
+    frame.header.blocksize = samples;
+    frame.header.sample_rate = c->meta.ao_fmt.rate;
+    frame.header.channels = c->meta.ao_fmt.channels;
+    frame.header.bits_per_sample = c->meta.sam_fmt.bits;
+    frame.header.number_type = FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER;
+    frame.header.number.sample_number = t->cached_pos;
+    for (channel = 0; channel < frame.header.channels; channel++)
+	buf[channel] = c->data + channel * c->meta.total_samples + t->cached_pos;
+
+    t->cached_pos += samples;
+    return flac_write_hdl(NULL, &frame, buf, p) == FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+/* decoder_seek() of a track played from the cache, to the sample */
+FLAC__bool pcmcache_seek(file_info_struct *p, FLAC__uint64 sample)
+{
+    if (sample > p->cached->samples)
+	return false;
+
+    p->cached_pos = sample;
+    p->skip_samples = 0;
+    return true;
+}
+
+FLAC__bool pcmcache_ended(const file_info_struct *p)
+{
+    return p->cached_pos >= p->cached->samples;
+}
+
+/* the track t is done with its samples.  Accepts a track without. */
+void pcmcache_release(file_info_struct *t)
+{
+    pcm_cached *c = t->cached;
+
+    if (!c)
+	return;
+    t->cached = NULL;
+    cached_unref(c);
+}
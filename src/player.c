@@ -0,0 +1,412 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This player.c module plays what decode.c decodes: the output device,
+ *  wav file or --shm ring of a track, the file info printed when it
+ *  starts, gapless preloading of the next track and one step of remote
+ *  playback.  It is part of the program only; libflac123 has no output.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "flac123.h"
+
+/* the libao driver and its options, picked by main() */
+int ao_output_id;
+ao_option **ao_options = NULL;
+pthread_mutex_t ao_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void print_file_info(file_info_struct *p, const char *filename)
+{
+    if (p->session)
+    {
+	if (p->has_tags)
+	{
+	  fprintf(p->session->err, "@I ID3:%s%s%s%s%s%s\n",
+		   p->title,
+		   p->artist,
+		   p->album,
+		   p->year,
+		   p->comment,
+		   p->genre
+		);
+	}
+	else
+	{
+	    /* print filename without suffix */
+	    const char *dot = strrchr(filename, '.');
+	    int len = dot && dot == strstr(filename, ".flac") ?
+		(int) (dot - filename) : (int) strlen(filename);
+
+	    fprintf(p->session->err, "@I %.*s\n", len, filename);
+	}
+    }
+    else if (!cli_args.quiet)
+    {
+        printf("\n"
+	       "Title  : %s Artist: %s\n"
+	       "Album  : %s Year  : %s\n"
+	       "Comment: %s Genre : %s\n",
+	       p->title, p->artist,
+	       p->album, p->year,
+	       p->comment, p->genre);
+	printf("\nPlaying FLAC stream from %s\n", 
+	       strncasecmp(filename, "http://", 7) != 0 && 
+	       strchr(filename, '/') ? strrchr(filename, '/')+1 : filename);
+	printf("%d bit, %d Hz, %d channels, %lu total samples, "
+	       "%.2f total seconds\n", 
+	       p->sam_fmt.bits, p->ao_fmt.rate, 
+	       p->ao_fmt.channels, p->total_samples, 
+	       p->total_time);
+	if (p->resampler)
+	    printf("Converted to %d bit, %d Hz, %d channels\n", decode_args.output_fmt.bits,
+		   decode_args.output_fmt.rate, decode_args.output_fmt.channels);
+	if (p->start_sample || p->end_sample)
+	    printf("From sample %lu to %lu\n", p->start_sample,
+		   p->end_sample ? p->end_sample : p->total_samples);
+	if (p->gain_db != 0)
+	    printf("Gain %+.2f dB%s\n", p->gain_db,
+		   p->gain_limited ? ", limited to prevent clipping" :
+		   p->gain_may_clip ? ", may clip" : "");
+    }
+}
+
+/* open the libao output device, or the writer of p->wavfile, for
+ * output_format(p).  A live device is only reopened when the format
+ * changes, which with --output-format it never does; the wav file is
+ * rewritten for every new file unless a track is being spliced onto the
+ * previous one. */
+static FLAC__bool output_open(file_info_struct *p, FLAC__bool splice)
+{
+    const ao_sample_format *fmt = output_format(p);
+    FLAC__bool reopened = false;
+    FLAC__bool same_format = (p->ao_dev || p->writer) &&
+	p->dev_fmt.bits == fmt->bits &&
+	p->dev_fmt.rate == fmt->rate &&
+	p->dev_fmt.channels == fmt->channels;
+
+    /* the --shm ring stays, every track starts a new epoch of it */
+    if (cli_args.shm && !p->wavfile)
+    {
+	if (p->writer)
+	    writer_close(p->writer);
+	p->writer = NULL;
+	p->dev_is_file = false;
+	if (!p->shm && !(p->shm = shmring_open(cli_args.shm, fmt)))
+	    return false;
+	shmring_start(p->shm, fmt);
+	p->dev_fmt = *fmt;
+	return true;
+    }
+
+    if (p->wavfile ? !(splice && same_format && p->dev_is_file) :
+	!same_format || p->dev_is_file)
+    {
+	ring_drain(p->ring);
+
+	if (p->writer)
+	    writer_close(p->writer);
+	p->writer = NULL;
+
+	pthread_mutex_lock(&ao_lock);
+	if (p->ao_dev)
+	    ao_close(p->ao_dev);
+	p->ao_dev = NULL;
+	if (!p->wavfile)
+	    p->ao_dev = ao_open_live(ao_output_id, (ao_sample_format *) fmt, *ao_options);
+	pthread_mutex_unlock(&ao_lock);
+	reopened = true;
+
+	/* writer_open() says what went wrong itself */
+	p->dev_is_file = p->wavfile != NULL;
+	if (p->wavfile && !(p->writer = writer_open(p->wavfile, writer_type(), fmt)))
+	    return false;
+	if (!p->wavfile && !p->ao_dev)
+	{
+	    fprintf(stderr, "Error opening ao device %d\n", ao_output_id);
+	    return false;
+	}
+    }
+
+    /* the writer is written to directly, not through the ring.  A new
+     * device may well be at the address of the one just closed. */
+    if (p->ring && p->ao_dev && reopened &&
+	!ring_set_device(p->ring, p->ao_dev, fmt))
+    {
+	return false;
+    }
+
+    p->dev_fmt = *fmt;
+
+    return true;
+}
+
+void output_write(file_info_struct *p, uint_8 *buf, size_t len)
+{
+    FLAC__uint64 start;
+
+    /* the output thread counts the ao_play() calls of the ring */
+    if (p->ring && !p->writer) {
+	ring_write(p->ring, buf, len);
+	return;
+    }
+
+    start = p->stats ? stats_clock() : 0;
+    if (p->writer)
+	writer_write(p->writer, buf, len);
+    else if (p->shm)
+	shmring_write(p->shm, buf, len);
+    else
+	ao_play(p->ao_dev, (char *)buf, len);
+    if (p->stats)
+	stats_since(&p->stats->output, start);
+}
+
+/* the pcm_fn of the tracks played: the PCM of a frame, converted by
+ * flac_write_hdl() */
+void output_pcm(file_info_struct *p, uint_8 *pcm, size_t len)
+{
+    size_t written;
+
+    if (p->session && p->ring && !p->writer) {
+	/* a remote command may cut this short, see output_resume() */
+	written = ring_write_some(p->ring, pcm, len);
+	p->pending = pcm + written;
+	p->pending_len = len - written;
+    } else {
+	output_write(p, pcm, len);
+    }
+}
+
+/* queue the rest of a frame whose ring_write_some() a remote command
+ * interrupted.  Returns early again if another command comes in. */
+static void output_resume(file_info_struct *p)
+{
+    size_t written = ring_write_some(p->ring, p->pending, p->pending_len);
+
+    p->pending += written;
+    p->pending_len -= written;
+}
+
+/* decoder_open() for playing.  With --pcm-cache a file played before
+ * comes from memory, the others are kept there while they play. */
+static FLAC__bool track_open(file_info_struct *p, const char *filename)
+{
+    file_info_struct *t = p->preloading ? p->next : p;
+    FLAC__uint64 start = stats_clock();
+
+    /* remote commands come in on stdin */
+    if (cli_args.remote && strcmp(filename, "-") == 0)
+	return false;
+
+    /* --bench measures the decoder */
+    if (!p->bench && pcmcache_lookup(t, filename)) {
+	if (p->stats)
+	    stats_since(&p->stats->open, start);
+    } else if (!decoder_open(p, filename)) {
+	return false;
+    } else if (!p->bench) {
+	pcmcache_begin(t);
+    }
+
+    /* decoder_open() did the rest, for frames that may have been smaller */
+    if (!t->cached)
+	return true;
+    gain_update(t);
+    if (!decoder_reserve(t))
+    {
+	decoder_close(t);
+	return false;
+    }
+
+    return true;
+}
+
+FLAC__bool decoder_constructor(file_info_struct *p, const char *filename)
+{
+    p->pcm_fn = output_pcm;
+    if (!track_open(p, filename))
+	return false;
+
+    /* remote sessions have JUMP instead of --start and --end */
+    if (!output_open(p, false) || (!p->session && !clip_apply(p)))
+    {
+	decoder_close(p);
+	return false;
+    }
+
+    print_file_info(p, filename);
+
+    p->is_loaded  = true;
+    p->is_playing = true;
+
+    return true;
+}
+
+/* open the next track and decode its first frame ahead of time */
+FLAC__bool preload_open(file_info_struct *p, const char *filename)
+{
+    file_info_struct *n = p->next;
+    FLAC__bool ok;
+
+    preload_discard(p);
+
+    p->preloading = true;
+    if ((ok = track_open(p, filename)))
+    {
+	n->prefetch = malloc(frame_bytes(n));
+	n->prefetch_len = 0;
+	n->prefetch_size = frame_bytes(n);
+	/* seeking to --start may already have decoded the first frame */
+	ok = n->prefetch && (p->session || clip_apply(n)) &&
+	    (n->prefetch_len > 0 || decoder_process(p));
+	if (!ok)
+	{
+	    decoder_close(n);
+	    free(n->prefetch);
+	    n->prefetch = NULL;
+	}
+    }
+    p->preloading = false;
+
+    n->is_loaded = ok;
+    return ok;
+}
+
+/* replace the current track by the preloaded one.  Its prefetched PCM
+ * follows the last frame of the current track directly in the output, so
+ * there is no gap when the device does not have to be reopened. */
+FLAC__bool preload_splice(file_info_struct *p)
+{
+    file_info_struct *n = p->next;
+
+    if (!n->is_loaded)
+	return false;
+
+    if (p->is_loaded)
+	decoder_destructor(p);
+
+    p->decoder = n->decoder;
+    p->input = n->input;
+    p->cached = n->cached;
+    p->cached_pos = n->cached_pos;
+    p->caching = n->caching;
+    p->file_size = n->file_size;
+    p->file_mtime = n->file_mtime;
+    p->frames = n->frames;
+    p->skip_samples = n->skip_samples;
+    p->start_sample = n->start_sample;
+    p->end_sample = n->end_sample;
+    memset(&n->frames, 0, sizeof(frame_table));
+    p->sam_fmt = n->sam_fmt;
+    p->ao_fmt = n->ao_fmt;
+    strcpy(p->filename, n->filename);
+    p->total_samples = n->total_samples;
+    p->current_sample = n->current_sample;
+    p->total_time = n->total_time;
+    p->elapsed_time = n->elapsed_time;
+    strcpy(p->title, n->title);
+    strcpy(p->artist, n->artist);
+    strcpy(p->album, n->album);
+    strcpy(p->genre, n->genre);
+    strcpy(p->comment, n->comment);
+    strcpy(p->year, n->year);
+    p->has_tags = n->has_tags;
+    p->max_blocksize = n->max_blocksize;
+    p->has_track_gain = n->has_track_gain;
+    p->has_album_gain = n->has_album_gain;
+    p->track_gain = n->track_gain;
+    p->track_peak = n->track_peak;
+    p->album_gain = n->album_gain;
+    p->album_peak = n->album_peak;
+    p->resampler = n->resampler;
+    gain_update(p);
+    n->decoder = NULL;
+    n->input = NULL;
+    n->cached = NULL;
+    n->caching = NULL;
+    n->resampler = NULL;
+    n->is_loaded = false;
+
+    if (!decoder_reserve(p) || !output_open(p, true))
+    {
+	free(n->prefetch);
+	n->prefetch = NULL;
+	decoder_close(p);
+	return false;
+    }
+
+    print_file_info(p, p->filename);
+
+    output_write(p, n->prefetch, n->prefetch_len);
+    free(n->prefetch);
+    n->prefetch = NULL;
+
+    p->is_loaded  = true;
+    p->is_playing = true;
+
+    return true;
+}
+
+void preload_discard(file_info_struct *p)
+{
+    file_info_struct *n = p->next;
+
+    if (n->is_loaded)
+    {
+	decoder_close(n);
+	free(n->prefetch);
+	n->prefetch = NULL;
+	n->is_loaded = false;
+    }
+}
+
+/* one step of remote playback: queue the rest of a frame a command came
+ * in the middle of, decode the next frame, or at the end of the file
+ * move on to the QUEUEd one.  Returns true when the track has ended and
+ * nothing follows it. */
+FLAC__bool remote_decode(file_info_struct *p)
+{
+    if (p->pending_len > 0)
+    {
+	output_resume(p);
+    }
+    else if (decoder_state(p) == FLAC__STREAM_DECODER_END_OF_STREAM)
+    {
+	/* continue gaplessly with a QUEUEd track if there is one */
+	if (p->next->is_loaded)
+	    preload_splice(p);
+	else
+	    decoder_destructor(p);
+
+	return !p->is_loaded;
+    }
+    else
+    {
+	/* printed here rather than in flac_write_hdl(), which stays clear
+	 * of stdio */
+	p->frame_samples = 0;
+	if (!decoder_process(p))
+	    fprintf(p->session->err, "error decoding single frame!\n");
+	else if (p->frame_samples > 0)
+	    status_frame(p, p->frame_samples);
+    }
+
+    return false;
+}
@@ -0,0 +1,277 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This pool.c module is a small work-stealing thread pool.  Every worker
+ *  has its own deque: it takes the newest task of its own, and when that
+ *  runs dry it steals the oldest task of another worker.  Tasks submitted
+ *  by a worker go onto its own deque, the others are dealt out in turn.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "flac123.h"
+
+typedef struct {
+    pool_fn fn;
+    void *arg;
+} pool_task;
+
+/* a growable circular deque, guarded by its own lock */
+typedef struct {
+    pthread_mutex_t lock;
+    pool_task *tasks;
+    unsigned head;           /* oldest task, stolen from here */
+    unsigned count;
+    unsigned size;           /* a power of 2 */
+} pool_deque;
+
+typedef struct {
+    thread_pool *pool;
+    unsigned id;
+    pthread_t thread;
+} pool_worker;
+
+struct thread_pool {
+    unsigned threads;
+    pool_deque *deques;
+    pool_worker *workers;
+    pthread_mutex_t lock;    /* guards the fields below */
+    pthread_cond_t work;     /* queued went up, or quit was set */
+    pthread_cond_t idle;     /* pending went down to 0 */
+    unsigned queued;         /* tasks in the deques */
+    unsigned pending;        /* tasks submitted and not finished */
+    unsigned next;           /* deque for the next outside submission */
+    int quit;
+};
+
+/* the worker running on this thread, if any */
+static __thread pool_worker *self;
+
+static int deque_push(pool_deque *d, pool_fn fn, void *arg)
+{
+    pool_task *grown;
+    unsigned i;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->size) {
+	if (!(grown = malloc(2 * d->size * sizeof(pool_task)))) {
+	    pthread_mutex_unlock(&d->lock);
+	    return 0;
+	}
+	for (i = 0; i < d->count; i++)
+	    grown[i] = d->tasks[(d->head + i) & (d->size - 1)];
+	free(d->tasks);
+	d->tasks = grown;
+	d->head = 0;
+	d->size *= 2;
+    }
+    d->tasks[(d->head + d->count) & (d->size - 1)].fn = fn;
+    d->tasks[(d->head + d->count) & (d->size - 1)].arg = arg;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+
+    return 1;
+}
+
+/* take the newest task (own deque) or the oldest (stealing) */
+static int deque_pop(pool_deque *d, int steal, pool_task *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count) {
+	if (steal) {
+	    *task = d->tasks[d->head];
+	    d->head = (d->head + 1) & (d->size - 1);
+	} else {
+	    *task = d->tasks[(d->head + d->count - 1) & (d->size - 1)];
+	}
+	d->count--;
+	found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+static int pool_take(thread_pool *pool, unsigned id, pool_task *task)
+{
+    unsigned i;
+
+    if (deque_pop(&pool->deques[id], 0, task))
+	return 1;
+    for (i = 1; i < pool->threads; i++)
+	if (deque_pop(&pool->deques[(id + i) % pool->threads], 1, task))
+	    return 1;
+    return 0;
+}
+
+static void *pool_thread(void *arg)
+{
+    pool_worker *w = (pool_worker *) arg;
+    thread_pool *pool = w->pool;
+    pool_task task;
+
+    self = w;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->queued == 0 && !pool->quit)
+	    pthread_cond_wait(&pool->work, &pool->lock);
+	if (pool->queued == 0) {
+	    pthread_mutex_unlock(&pool->lock);
+	    break;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	/* queued may be stale by now, another worker can win the race */
+	if (!pool_take(pool, w->id, &task))
+	    continue;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued--;
+	pthread_mutex_unlock(&pool->lock);
+
+	task.fn(task.arg);
+
+	pthread_mutex_lock(&pool->lock);
+	if (--pool->pending == 0)
+	    pthread_cond_broadcast(&pool->idle);
+	pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* start threads workers, NULL if not even one could be started */
+thread_pool *pool_new(unsigned threads)
+{
+    thread_pool *pool;
+    unsigned i;
+
+    if (threads == 0)
+	threads = 1;
+    if (!(pool = calloc(1, sizeof(thread_pool))))
+	return NULL;
+    pool->deques = calloc(threads, sizeof(pool_deque));
+    pool->workers = calloc(threads, sizeof(pool_worker));
+    if (!pool->deques || !pool->workers) {
+	free(pool->deques);
+	free(pool->workers);
+	free(pool);
+	return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (i = 0; i < threads; i++) {
+	pthread_mutex_init(&pool->deques[i].lock, NULL);
+	pool->deques[i].size = 16;
+	pool->deques[i].tasks = malloc(16 * sizeof(pool_task));
+	if (!pool->deques[i].tasks)
+	    break;
+	pool->workers[i].pool = pool;
+	pool->workers[i].id = i;
+	if (pthread_create(&pool->workers[i].thread, NULL, pool_thread, &pool->workers[i]) != 0) {
+	    free(pool->deques[i].tasks);
+	    break;
+	}
+    }
+    pool->threads = i;
+
+    if (pool->threads == 0) {
+	pool_free(pool);
+	return NULL;
+    }
+    return pool;
+}
+
+/* run fn(arg) on one of the workers.  If it cannot be queued it runs
+ * right here. */
+void pool_submit(thread_pool *pool, pool_fn fn, void *arg)
+{
+    unsigned id;
+    int queued;
+
+    /* pushed under the pool lock, so queued never runs behind the deques */
+    pthread_mutex_lock(&pool->lock);
+    if (self && self->pool == pool) {
+	id = self->id;
+    } else {
+	id = pool->next;
+	pool->next = (pool->next + 1) % pool->threads;
+    }
+    if ((queued = deque_push(&pool->deques[id], fn, arg))) {
+	pool->pending++;
+	pool->queued++;
+	pthread_cond_signal(&pool->work);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!queued)
+	fn(arg);
+}
+
+/* wait until every task submitted so far has finished.  Not to be called
+ * from a task. */
+void pool_wait(thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+	pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* finish the queued tasks and stop the workers */
+void pool_free(thread_pool *pool)
+{
+    unsigned i;
+
+    if (!pool)
+	return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* the others may still be stealing from any deque */
+    for (i = 0; i < pool->threads; i++)
+	pthread_join(pool->workers[i].thread, NULL);
+    for (i = 0; i < pool->threads; i++) {
+	free(pool->deques[i].tasks);
+	pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+unsigned pool_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (unsigned) n : 1;
+}
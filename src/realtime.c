@@ -0,0 +1,127 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This realtime.c module implements --realtime: memory is locked so the
+ *  hot path never waits for a page to be read back in, the buffers it
+ *  uses are touched when they are allocated, and the thread that writes
+ *  to the device runs at SCHED_FIFO priority.  Whatever the system does
+ *  not permit is reported once and playback goes on without it.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "flac123.h"
+
+/* SCHED_FIFO priority of the output thread, below what audio servers
+ * such as JACK and PipeWire give their own threads */
+#define REALTIME_PRIORITY 60
+
+/* stack touched on every thread of the hot path */
+#define REALTIME_STACK (256 << 10)
+
+#define REALTIME_PAGE 4096
+
+static atomic_int warned_priority;
+
+/* touch the stack the calling thread will grow into */
+static void prefault_stack(void)
+{
+    volatile unsigned char stack[REALTIME_STACK];
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += REALTIME_PAGE)
+	stack[i] = 0;
+}
+
+/*
+ * Lock the memory of flac123, now and, where the limit of locked memory
+ * allows it, as it is allocated.  With a finite limit MCL_FUTURE would
+ * make large allocations such as the mapping of an input file fail, so
+ * then only what is mapped now is locked and later buffers are merely
+ * prefaulted.
+ */
+void realtime_init(void)
+{
+    struct rlimit limit;
+    int flags = MCL_CURRENT | MCL_FUTURE;
+
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_MEMLOCK, &limit);
+	if (limit.rlim_cur != RLIM_INFINITY && geteuid() != 0)
+	    flags = MCL_CURRENT;
+    }
+
+#ifdef __GLIBC__
+    /* freed memory stays locked in the heap for the next malloc() */
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+
+    if (mlockall(flags) != 0)
+	fprintf(stderr, "Could not lock memory (see ulimit -l): %s\n", strerror(errno));
+    else if (!(flags & MCL_FUTURE))
+	fprintf(stderr, "Memory allocated later is not locked (ulimit -l is limited)\n");
+
+    prefault_stack();
+}
+
+/* run the calling thread, which writes to the output device, at
+ * SCHED_FIFO priority */
+void realtime_thread(void)
+{
+    struct sched_param param;
+    int max = sched_get_priority_max(SCHED_FIFO);
+    int err;
+
+    if (!decode_args.realtime)
+	return;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = REALTIME_PRIORITY < max ? REALTIME_PRIORITY : max;
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0 &&
+	!atomic_exchange(&warned_priority, 1))
+    {
+	fprintf(stderr, "Could not run the output at real-time priority: %s\n", strerror(err));
+    }
+
+    prefault_stack();
+}
+
+/* with --realtime, make every page of a buffer the hot path is going to
+ * use resident now rather than when it is first written */
+void realtime_prefault(void *buf, size_t len)
+{
+    volatile unsigned char *b = buf;
+    size_t i;
+
+    if (!decode_args.realtime || !buf || len == 0)
+	return;
+
+    for (i = 0; i < len; i += REALTIME_PAGE)
+	b[i] = b[i];
+    b[len - 1] = b[len - 1];
+}
@@ -20,17 +20,68 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include "flac123.h"
 
-/* for filename plus command and a space */
-#define BUF_SIZE (PATH_MAX + 5)
+/* commands a session may get ahead of its decoder, a power of 2 */
+#define QUEUE_SIZE 16
+
+enum {
+    CMD_LOAD, CMD_QUEUE, CMD_JUMP, CMD_STOP, CMD_VOLUME, CMD_PAUSE, CMD_QUIT,
+    CMD_OUTPUT, CMD_STATS, CMD_UNKNOWN, CMD_EOF, CMD_COUNT
+};
+
+static const struct {
+    const char *name;
+    const char *abbrev;
+} command_names[CMD_UNKNOWN] = {
+    { "LOAD", "L" }, { "QUEUE", NULL }, { "JUMP", "J" }, { "STOP", "S" },
+    { "VOLUME", "V" }, { "PAUSE", "P" }, { "QUIT", "Q" }, { "OUTPUT", NULL },
+    { "STATS", NULL }
+};
+
+typedef struct {
+    int command;             /* CMD_xxx */
+    char input[REMOTE_LINE_MAX]; /* the command as typed, then its argument */
+    char *arg;               /* into input, NULL if there is none */
+    struct timespec received; /* when its line was read */
+} remote_command;
 
-static char remote_input_buf[BUF_SIZE];
+/*
+ * Whoever reads the commands of a session (the control thread for stdin,
+ * the --daemon thread for a connection) is the single producer of its
+ * queue, and whoever plays it the single consumer.  Only the producer
+ * stores tail and only the consumer stores head, so checking for a
+ * command between two frames is one atomic load and no system call.  The
+ * wake pipe of stdin is only written to while the decoder sleeps in poll().
+ */
+struct remote_queue {
+    remote_command slots[QUEUE_SIZE];
+    _Atomic unsigned head;
+    _Atomic unsigned tail;
+    atomic_int sleeping;
+    int wake_pipe[2];
+
+    /* command-to-effect latency: from reading the line to having acted on it */
+    struct {
+	unsigned count;
+	double total;        /* milliseconds */
+	double max;
+    } latency[CMD_COUNT];
+};
+
+/* -R: stdin, stdout and the player of main() */
+static remote_session stdin_session;
 
 static void trim_whitespace(char *str)
 /* logic from stackoverflow 122616 */
@@ -83,222 +134,528 @@ static void trim_whitespace(char *str)
     }
 }
 
-/* returns 0 on success (keep decoding), or -1 on QUIT or EOF (stop decoding) */
-static int remote_parse_input(void)
+/*
+ * The position a JUMP argument asks for: [s:][+|-]<number>[%].  The
+ * number is in seconds, fractions allowed, or a sample number after s:,
+ * or a percentage of the track when followed by %.  With a sign it is
+ * relative to the current position of p.  Returns false if arg is malformed
+ * or beyond the end of the track.
+ */
+static FLAC__bool jump_target(const file_info_struct *p, const char *arg,
+			      FLAC__uint64 *sample)
+{
+    FLAC__bool samples = false, percent = false;
+    double value, target;
+    int sign = 0;
+    char *end;
+
+    if (strncasecmp(arg, "s:", 2) == 0) {
+	samples = true;
+	arg += 2;
+    }
+    if (*arg == '+' || *arg == '-')
+	sign = *arg++ == '+' ? 1 : -1;
+    if (!isdigit((unsigned char) *arg) && *arg != '.')
+	return false;
+
+    value = strtod(arg, &end);
+    if (*end == '%' && !samples) {
+	percent = true;
+	end++;
+    }
+    if (*end != '\0')
+	return false;
+
+    if (percent)
+	value = value / 100.0 * p->total_samples;
+    else if (!samples)
+	value *= p->ao_fmt.rate;
+
+    target = sign ? p->current_sample + sign * value : value;
+    if (target < 0)
+	target = 0;
+    if (p->total_samples > 0 && target >= p->total_samples)
+	return false;
+
+    *sample = (FLAC__uint64) (target + 0.5);
+    return true;
+}
+
+/* queue line, or the end of input, as a command for s.  Returns false if
+ * the queue is full and wait is not set. */
+static FLAC__bool remote_push(remote_session *s, char *line, const struct timespec *received,
+			      FLAC__bool eof, FLAC__bool wait)
 {
-    char input[BUF_SIZE]; /* full line of a command plus argument */
-    char tmp_remote_input_buf[BUF_SIZE];
-    char *arg, *newline;
-    int num_read = 0;
-    int already_read;
-    int linelen;
+    remote_queue *q = s->queue;
+    unsigned tail = atomic_load(&q->tail);
+    remote_command *cmd;
+    struct timespec nap = { 0, 1000000 };
+    char *arg;
+    int i;
+
+    if (!eof)
+    {
+	trim_whitespace(line);
+	if (strlen(line) == 0)
+	    return true;
+    }
 
-    fd_set fd;
-    struct timeval tv = { 0, 0 };
-    FD_ZERO(&fd);
-    FD_SET(0,&fd); /* stdin */
+    /* the decoder is a whole queue behind, give it time to catch up */
+    while (tail - atomic_load(&q->head) == QUEUE_SIZE)
+    {
+	if (!wait)
+	    return false;
+	nanosleep(&nap, NULL);
+    }
 
-    already_read = strlen(remote_input_buf);
+    cmd = &q->slots[tail & (QUEUE_SIZE - 1)];
+    cmd->received = *received;
+    cmd->arg = NULL;
+    cmd->input[0] = '\0';
+    cmd->command = CMD_EOF;
 
-    if (select (1, &fd, NULL, NULL, &tv))  /* returns immediately */
+    if (!eof)
     {
-	if ((num_read = read(0, remote_input_buf + already_read, (sizeof(input)-1)-already_read)) < 0)
+	strcpy(cmd->input, line);
+
+	if ((arg = strchr(cmd->input, ' ')))
 	{
-            num_read = 0; /* should never happen.  read() blocks */
-	} else if (0 == num_read && 0 == already_read) {
-            return -1; /* EOF */
+	    *(arg++) = '\0';  /* separate command from argument */
+	    trim_whitespace(arg);
+	    cmd->arg = arg;
+	}
+
+	cmd->command = CMD_UNKNOWN;
+	for (i = 0; i < CMD_UNKNOWN; i++)
+	{
+	    if (strcasecmp(cmd->input, command_names[i].name) == 0 ||
+		(command_names[i].abbrev &&
+		 strcasecmp(cmd->input, command_names[i].abbrev) == 0))
+	    {
+		cmd->command = i;
+		break;
+	    }
 	}
-    } else {
-	num_read = 0;
     }
 
-    remote_input_buf[already_read + num_read] = '\0';
+    atomic_store(&q->tail, tail + 1);
 
-    if ((newline = strchr(remote_input_buf, '\n')))
+    /* a decoder waiting for a command or for room in a full ring */
+    if (atomic_load(&q->sleeping) && write(q->wake_pipe[1], "", 1) < 0)
     {
-        *(newline) = '\0';
+	/* the pipe is full, so it is awake already */
     }
+    ring_interrupt(s->info->ring);
 
+    return true;
+}
 
-    linelen = strlen(remote_input_buf);
+/*
+ * Queue the complete lines among the first *used bytes of buf as commands
+ * for s, at eof the unterminated last line and the end of input as well.
+ * What is left is moved to the front of buf, which holds REMOTE_LINE_MAX
+ * bytes.  Unless wait is set a full queue stops it early; returns true if
+ * everything that could be queued was.
+ */
+FLAC__bool remote_input(remote_session *s, char *buf, size_t *used,
+			FLAC__bool eof, FLAC__bool wait)
+{
+    struct timespec received;
+    char *line = buf, *newline;
+    FLAC__bool ok = true;
 
-    strcpy(input, remote_input_buf);
-    strcpy(tmp_remote_input_buf, remote_input_buf + linelen + 1); /* +1 skips \0 */
-    strcpy(remote_input_buf, tmp_remote_input_buf);
+    clock_gettime(CLOCK_MONOTONIC, &received);
 
-    trim_whitespace(input);
+    /* every complete line is a command */
+    while ((newline = memchr(line, '\n', *used - (line - buf))))
+    {
+	*newline = '\0';
+	if (!(ok = remote_push(s, line, &received, false, wait)))
+	{
+	    *newline = '\n';
+	    break;
+	}
+	line = newline + 1;
+    }
+    *used -= line - buf;
+    memmove(buf, line, *used);
 
-    if (strlen(input) == 0)
-        return 0;
+    if (ok && (*used == REMOTE_LINE_MAX - 1 || (eof && *used > 0)))
+    {
+	/* longer than any command can be, or the last one */
+	buf[*used] = '\0';
+	if ((ok = remote_push(s, buf, &received, false, wait)))
+	    *used = 0;
+    }
 
-    arg = strchr(input, ' ');
+    if (ok && eof)
+	ok = remote_push(s, NULL, &received, true, wait);
 
-    if (arg)
+    return ok;
+}
+
+static void *remote_thread(void *unused)
+{
+    char buf[REMOTE_LINE_MAX];
+    size_t used = 0;
+    ssize_t num_read;
+    sigset_t all;
+
+    /* signals are for the decoder thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;)
     {
-        *(arg++) = '\0';  /* separate command from argument */
-        arg = strdup(arg);
-        trim_whitespace(arg);
+	if ((num_read = read(0, buf + used, (sizeof(buf) - 1) - used)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    num_read = 0;
+	}
+	if (num_read == 0)
+	    break;
+
+	used += num_read;
+	remote_input(&stdin_session, buf, &used, false, true);
     }
 
-    if (strcasecmp(input, "L") == 0 || strcasecmp(input, "LOAD") == 0)
+    remote_input(&stdin_session, buf, &used, true, true);
+
+    return NULL;
+}
+
+/* returns 0 on success (keep decoding), or -1 on QUIT or EOF (stop decoding) */
+static int remote_execute(remote_session *s, remote_command *cmd)
+{
+    file_info_struct *p = s->info;
+    char *input = cmd->input;
+    char *arg = cmd->arg;
+
+    switch (cmd->command)
     {
+    case CMD_LOAD:
         if (arg)
         {
-	    if (file_info.is_loaded == true)
-		decoder_destructor();
+	    if (p->is_loaded == true)
+		decoder_destructor(p);
+
+	    /* the new file replaces whatever is still queued for output */
+	    ring_flush(p->ring);
+	    shmring_flush(p->shm);
+	    ring_pause(p->ring, false);
+
+	    if (!decoder_constructor(p, arg))
+		fprintf(s->err, "@E Error opening %s\n", arg);
+        }
+        else
+        {
+            fprintf(s->err, "@E Missing argument to '%s'\n", input);
+        }
+	break;
 
-	    if (!decoder_constructor(arg))
+    case CMD_QUEUE:
+        if (arg)
+        {
+	    if (p->is_loaded == true)
 	    {
-		fprintf(stderr, "@E Error opening %s\n", arg);
-		free(arg);
-		return 0; 
+		/* opened and primed now, spliced in when the current file ends */
+		if (!preload_open(p, arg))
+		    fprintf(s->err, "@E Error opening %s\n", arg);
+	    }
+	    else
+	    {
+		/* nothing to follow, so play it right away like LOAD */
+		ring_flush(p->ring);
+		shmring_flush(p->shm);
+		ring_pause(p->ring, false);
+
+		if (!decoder_constructor(p, arg))
+		    fprintf(s->err, "@E Error opening %s\n", arg);
 	    }
         }
         else
         {
-            fprintf(stderr, "@E Missing argument to '%s'\n", input);
-            return 0;
+            fprintf(s->err, "@E Missing argument to '%s'\n", input);
         }
-    }
+	break;
 
-    else if (strcasecmp(input, "J") == 0 || strcasecmp(input, "JUMP") == 0)
+    case CMD_JUMP:
     {
-        if (file_info.is_playing && arg)
+        FLAC__uint64 target;
+        struct timespec start, end;
+        size_t pending_len;
+
+        if (p->is_playing && arg && jump_target(p, arg, &target))
         {
-            /* relative seek */
-            if (arg[0] == '-' || arg[0] == '+')
-            {
-		/* assumption: fixed bit-rate encoding */
-		signed long delta_time = atol(arg);
-		signed long delta_frames = delta_time * file_info.ao_fmt.rate;
-		    
-		if ((delta_time < 0) && (labs(delta_time) > file_info.elapsed_time))
-		{
-		    file_info.elapsed_time = 0;
-		    file_info.current_sample = 0;
-		}
-		else if ((delta_time > 0) && (delta_time > file_info.total_time - file_info.elapsed_time))
-		{
-		    /* don't do anything */
-		    if (arg)
-			free (arg);
-		    return 0;
-		}
-		else
-		{
-		    file_info.elapsed_time += delta_time;
-		    file_info.current_sample += delta_frames;
-		}
-
-		FLAC__stream_decoder_seek_absolute(file_info.decoder,
-						 file_info.current_sample);
-            }
-	    /* absolute seek */
-            else
-            {
-		long absolute_time = atol(arg);
-		long absolute_frame = absolute_time * file_info.ao_fmt.rate;
-		file_info.elapsed_time = absolute_time;
-		file_info.current_sample = absolute_frame;
-
-		FLAC__stream_decoder_seek_absolute(file_info.decoder, absolute_frame);
-            }
+	    /* the rest of the interrupted frame is not wanted any more */
+	    pending_len = p->pending_len;
+	    p->pending_len = 0;
+
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    if (!decoder_seek(p, target))
+	    {
+		/* a pipe cannot go back: play on where it was */
+		p->pending_len = pending_len;
+		fprintf(s->err, "@E Error seeking to sample %llu of %s\n",
+			(unsigned long long) target, p->filename);
+		break;
+	    }
+	    clock_gettime(CLOCK_MONOTONIC, &end);
 
+	    p->current_sample = target;
+	    p->elapsed_time = (float) target / p->ao_fmt.rate;
+	    ring_flush(p->ring);
+	    shmring_flush(p->shm);
+
+	    /* where playback continues, and how long finding it took */
+	    status_jump(s, p->current_sample,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
         }
         else
         {
             /* mpg123 does no error checking, so we should emulate that */
-        }                        
+        }
+	break;
     }
 
-    else if (strcasecmp(input, "S") == 0 || strcasecmp(input, "STOP") == 0)
-    {
-	if (file_info.is_loaded == true)
+    case CMD_STOP:
+	ring_flush(p->ring);
+	shmring_flush(p->shm);
+	ring_pause(p->ring, false);
+	preload_discard(p);
+
+	if (p->is_loaded == true)
 	{
-	    printf("@P 0\n");
-	    decoder_destructor();
+	    status_state(s, 0);
+	    decoder_destructor(p);
 	}
-    }
+	break;
 
-    else if (strcasecmp(input, "V") == 0 || strcasecmp(input, "VOLUME") == 0)
-    {
+    case CMD_VOLUME:
         if (arg)
 	{
-	    scale = atof(arg);
-	    printf("@V %f\n", scale);
+	    s->volume = atof(arg);
+	    gain_update(p);
+	    if (p->next->is_loaded)
+		gain_update(p->next);
+	    status_volume(s, s->volume);
 	}
-    }
+	break;
 
-    else if (strcasecmp(input, "P") == 0 || strcasecmp(input, "PAUSE") == 0)
-    {
-	if (file_info.is_loaded == true)
+    case CMD_PAUSE:
+	if (p->is_loaded == true)
 	{
-	    if (file_info.is_playing == true)
+	    if (p->is_playing == true)
 	    {
-		file_info.is_playing = false;
-		printf("@P 1\n");
+		p->is_playing = false;
+		ring_pause(p->ring, true);
+		status_state(s, 1);
 	    }
 	    else
 	    {
-		file_info.is_playing = true;
-		printf("@P 2\n");
+		p->is_playing = true;
+		ring_pause(p->ring, false);
+		status_state(s, 2);
 	    }
 	}
-    }
+	break;
 
-    else if (strcasecmp(input, "Q") == 0 || strcasecmp(input, "QUIT") == 0)
-    {
-	if (arg)
-	    free(arg);
+    case CMD_QUIT:
+	if (p->is_loaded)
+	    decoder_destructor(p);
 
-	if (file_info.is_loaded)
-	    decoder_destructor();
-      
+	preload_discard(p);
+	ring_flush(p->ring);
+	shmring_flush(p->shm);
 	return -1;
+
+    case CMD_OUTPUT:
+	/* a wav file, or the audio device without an argument, from the
+	 * next LOAD on */
+	free(s->output);
+	s->output = arg ? strdup(arg) : NULL;
+	p->wavfile = s->output;
+	break;
+
+    case CMD_STATS:
+	status_stats(s);
+	break;
+
+    case CMD_EOF:
+	return -1;
+
+    default:
+        fprintf(s->err, "@E Unknown command '%s'\n", input);
+	break;
     }
 
-    else 
+    return 0;
+}
+
+FLAC__bool remote_has_commands(remote_session *s)
+{
+    return atomic_load(&s->queue->tail) != atomic_load(&s->queue->head);
+}
+
+/* run the commands queued for s, returns -1 if one of them was QUIT or
+ * the end of input, 0 otherwise */
+int remote_run(remote_session *s)
+{
+    remote_queue *q = s->queue;
+    remote_command *cmd;
+    struct timespec done;
+    unsigned head;
+    double ms;
+    int status = 0;
+
+    while (status == 0 && remote_has_commands(s))
     {
-        fprintf(stderr, "@E Unknown command '%s'\n", input);
+	head = atomic_load(&q->head);
+	cmd = &q->slots[head & (QUEUE_SIZE - 1)];
+
+	status = remote_execute(s, cmd);
+
+	clock_gettime(CLOCK_MONOTONIC, &done);
+	ms = (done.tv_sec - cmd->received.tv_sec) * 1e3 +
+	    (done.tv_nsec - cmd->received.tv_nsec) / 1e6;
+	q->latency[cmd->command].count++;
+	q->latency[cmd->command].total += ms;
+	if (ms > q->latency[cmd->command].max)
+	    q->latency[cmd->command].max = ms;
+
+	/* only now may the producer reuse the slot */
+	atomic_store(&q->head, head + 1);
     }
 
-    if (arg) 
-        free(arg);
+    return status;
+}
 
-    return 0;
+/* make s the remote control of info (and info->next) */
+FLAC__bool remote_open(remote_session *s, file_info_struct *info, FILE *out, FILE *err)
+{
+    if (!(s->queue = calloc(1, sizeof(remote_queue))))
+	return false;
+
+    s->queue->wake_pipe[0] = s->queue->wake_pipe[1] = -1;
+    s->info = info;
+    s->out = out;
+    s->err = err;
+    s->volume = 1;
+    s->output = NULL;
+    info->session = s;
+    info->next->session = s;
+
+    return true;
 }
 
-int remote_get_input_wait(void)
+/* report the command-to-effect latencies of s, and with --stats the
+ * counters of its player */
+static void remote_report(remote_session *s)
 {
-    fd_set fd;
-    FD_ZERO(&fd);
-    FD_SET(0,&fd);
-    
-    if (strlen(remote_input_buf) == 0)
+    int i;
+
+    for (i = 0; i < CMD_UNKNOWN; i++)
     {
-	select(1, &fd, NULL, NULL, NULL); /* block indefinitely */
+	if (s->queue->latency[i].count)
+	    fprintf(s->err, "@L %s %u %.3f %.3f\n", command_names[i].name,
+		    s->queue->latency[i].count,
+		    s->queue->latency[i].total / s->queue->latency[i].count,
+		    s->queue->latency[i].max);
     }
 
-    return remote_parse_input();
+    if (cli_args.stats)
+	stats_print(s->err, s->info->stats, cli_args.status_json);
 }
 
-int remote_get_input_nowait(void)
+/* end a session that nothing is queued for any more */
+void remote_close(remote_session *s)
+{
+    remote_report(s);
+    fflush(s->err);
+
+    if (s->info->wavfile == s->output)
+	s->info->wavfile = NULL;
+    s->info->session = NULL;
+    s->info->next->session = NULL;
+    free(s->output);
+    free(s->queue);
+}
+
+/* sleep until a command is queued, or for at most ms (-1 is forever) */
+static void remote_sleep(int ms)
 {
-    fd_set fd;
-    struct timeval tv = { 0, 0 };
-    FD_ZERO(&fd);
-    FD_SET(0,&fd);
+    remote_queue *q = stdin_session.queue;
+    struct pollfd fd = { 0, POLLIN, 0 };
+    char drain[64];
 
-    if (strlen(remote_input_buf) == 0)
+    fd.fd = q->wake_pipe[0];
+
+    atomic_store(&q->sleeping, 1);
+    if (!remote_has_commands(&stdin_session))
+	poll(&fd, 1, ms);
+    atomic_store(&q->sleeping, 0);
+
+    while (read(q->wake_pipe[0], drain, sizeof(drain)) > 0)
     {
-	if (select(1, &fd, NULL, NULL, &tv)) /* return immediately */
-	    return remote_parse_input();
-	else
-	    return 0;
-    } 
-    else 
+    }
+}
+
+/* -R: start the control thread for playing info, before any of the
+ * following is called */
+FLAC__bool remote_start(file_info_struct *info)
+{
+    pthread_t thread;
+    remote_queue *q;
+
+    if (!remote_open(&stdin_session, info, stdout, stderr))
     {
-	return remote_parse_input();
+	fprintf(stderr, "Out of memory\n");
+	return false;
     }
+    q = stdin_session.queue;
+    stdin_session.info->wavfile = cli_args.wavfile;
+
+    if (pipe(q->wake_pipe) != 0 ||
+	fcntl(q->wake_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+	fcntl(q->wake_pipe[1], F_SETFL, O_NONBLOCK) != 0 ||
+	pthread_create(&thread, NULL, remote_thread, NULL) != 0)
+    {
+	fprintf(stderr, "Error starting remote control thread\n");
+	return false;
+    }
+
+    /* it may be blocked on stdin for good, nobody waits for it */
+    pthread_detach(thread);
+    return true;
 }
 
+/* -R: report the latencies.  The control thread may still be reading
+ * stdin, so the queue stays. */
+void remote_finish(void)
+{
+    remote_report(&stdin_session);
+}
+
+/* the remote_get_input_xxx() functions run every command queued on stdin
+ * and return -1 if one of them was QUIT or stdin is closed, 0 otherwise */
+int remote_get_input_wait(void)
+{
+    while (!remote_has_commands(&stdin_session))
+	remote_sleep(-1);
+
+    return remote_run(&stdin_session);
+}
+
+int remote_get_input_nowait(void)
+{
+    return remote_run(&stdin_session);
+}
+
+int remote_get_input_timeout(unsigned ms)
+{
+    if (!remote_has_commands(&stdin_session))
+	remote_sleep((int) ms);
+
+    return remote_run(&stdin_session);
+}
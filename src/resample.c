@@ -0,0 +1,598 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This resample.c module implements --output-format: every file is
+ *  converted to one fixed sample rate, channel count and bit depth, so
+ *  the output device is opened once and never has to be reopened between
+ *  tracks.  Channels are mixed by their FLAC positions, the rate is
+ *  changed by a polyphase windowed sinc filter whose inner product is
+ *  vectorized, and the result is rounded, or dithered with --dither,
+ *  into the output bit depth.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESAMPLE_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define RESAMPLE_NEON
+#include <arm_neon.h>
+#endif
+
+/* half the filter length, in input samples, when the rate goes up.  It
+ * grows with the ratio when the rate goes down, so the transition band
+ * stays as narrow at the output rate. */
+#define RESAMPLE_HALF 64
+
+/* fractions of an input sample the filter is tabulated for; in between,
+ * the coefficients of the two nearest are interpolated */
+#define RESAMPLE_PHASES 256
+
+/* Kaiser window parameter, about 90 dB of stopband attenuation */
+#define RESAMPLE_BETA 9.0
+#define RESAMPLE_ATTENUATION 90.4
+
+/* FLAC channel positions */
+enum { FL, FR, FC, LFE, BL, BR, BC, SL, SR, POSITIONS };
+
+/* the positions of every FLAC channel count, as in the format spec */
+static const unsigned char layouts[FLAC__MAX_CHANNELS][FLAC__MAX_CHANNELS] = {
+    { FC },
+    { FL, FR },
+    { FL, FR, FC },
+    { FL, FR, BL, BR },
+    { FL, FR, FC, BL, BR },
+    { FL, FR, FC, LFE, BL, BR },
+    { FL, FR, FC, LFE, BC, SL, SR },
+    { FL, FR, FC, LFE, BL, BR, SL, SR },
+};
+
+/*
+ * The filter is run over hist, which holds the input from half - 1
+ * samples before the next output on.  pos is where the taps of the next
+ * output start in hist, and num / out_rate how far the output lies
+ * behind the input sample its centre tap falls on.  Stepping num by
+ * in_rate keeps the output times exact however long the file.
+ */
+struct resampler {
+    unsigned in_rate, out_rate;
+    unsigned in_channels, out_channels;
+    int out_bits;
+    int shift;               /* out_bits - the bits the gain is made for */
+    unsigned max_in;         /* input samples converted at a time */
+    unsigned max_out;        /* output samples of max_in input samples */
+    float mix[FLAC__MAX_CHANNELS][FLAC__MAX_CHANNELS];
+    FLAC__bool remix;        /* mix does more than copy channels */
+
+    unsigned half, taps;     /* 0 when the rate stays the same */
+    float *coef;             /* taps for RESAMPLE_PHASES + 1 fractions */
+    float *delta;            /* to the coefficients of the next fraction */
+    unsigned fill, pos, num;
+
+    float *hist[FLAC__MAX_CHANNELS];
+    float *work[FLAC__MAX_CHANNELS];      /* filtered, not rounded yet */
+    FLAC__int32 *out[FLAC__MAX_CHANNELS]; /* rounded, for the convert kernels */
+    FLAC__int32 *noise;
+    uint_32 noise_state[8];
+};
+
+static const uint_32 noise_seed[8] = {
+    0x9E3779B9, 0x7F4A7C15, 0xF39CC060, 0x5CEDC834,
+    0x1B873593, 0xCC9E2D51, 0x85EBCA6B, 0xC2B2AE35
+};
+
+/* parse --output-format: rate:bits:channels */
+FLAC__bool resample_parse_format(const char *arg)
+{
+    unsigned long rate, bits, channels;
+    char *end;
+
+    if (!isdigit((unsigned char) *arg))
+	return false;
+    rate = strtoul(arg, &end, 10);
+    if (*end != ':' || !isdigit((unsigned char) end[1]))
+	return false;
+    bits = strtoul(end + 1, &end, 10);
+    if (*end != ':' || !isdigit((unsigned char) end[1]))
+	return false;
+    channels = strtoul(end + 1, &end, 10);
+
+    if (*end != '\0' || rate == 0 || rate > 1000000 ||
+	(bits != 8 && bits != 16 && bits != 24 && bits != 32) ||
+	channels == 0 || channels > FLAC__MAX_CHANNELS)
+	return false;
+
+    decode_args.output_fmt.rate = rate;
+    decode_args.output_fmt.bits = bits;
+    decode_args.output_fmt.channels = channels;
+    decode_args.output_fmt.byte_format = AO_FMT_NATIVE;
+    return true;
+}
+
+/*
+ * The inner product of the filter: x times the coefficients of a fraction
+ * w of the way from c to c + d.  taps is a multiple of 8, summed in 8
+ * lanes that are added up in the same order by every version.
+ */
+typedef float (*dot_fn)(const float *x, const float *c, const float *d, float w, unsigned taps);
+
+static float dot_scalar(const float *x, const float *c, const float *d, float w, unsigned taps)
+{
+    float acc[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    unsigned k, lane;
+
+    for (k = 0; k < taps; k += 8)
+	for (lane = 0; lane < 8; lane++)
+	    acc[lane] += x[k + lane] * (c[k + lane] + w * d[k + lane]);
+
+    return ((acc[0] + acc[4]) + (acc[2] + acc[6])) + ((acc[1] + acc[5]) + (acc[3] + acc[7]));
+}
+
+static dot_fn dot_kernel = dot_scalar;
+
+#ifdef RESAMPLE_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX  __attribute__((target("avx")))
+
+SSE2 static float dot_sse2(const float *x, const float *c, const float *d, float w, unsigned taps)
+{
+    __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps(), wv = _mm_set1_ps(w);
+    unsigned k;
+
+    for (k = 0; k < taps; k += 8) {
+	lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(x + k),
+				       _mm_add_ps(_mm_loadu_ps(c + k),
+						  _mm_mul_ps(wv, _mm_loadu_ps(d + k)))));
+	hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(x + k + 4),
+				       _mm_add_ps(_mm_loadu_ps(c + k + 4),
+						  _mm_mul_ps(wv, _mm_loadu_ps(d + k + 4)))));
+    }
+
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return _mm_cvtss_f32(lo);
+}
+
+AVX static float dot_avx(const float *x, const float *c, const float *d, float w, unsigned taps)
+{
+    __m256 acc = _mm256_setzero_ps(), wv = _mm256_set1_ps(w);
+    __m128 lo;
+    unsigned k;
+
+    for (k = 0; k < taps; k += 8)
+	acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + k),
+					       _mm256_add_ps(_mm256_loadu_ps(c + k),
+							     _mm256_mul_ps(wv, _mm256_loadu_ps(d + k)))));
+
+    lo = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return _mm_cvtss_f32(lo);
+}
+
+#endif /* RESAMPLE_X86 */
+
+#ifdef RESAMPLE_NEON
+
+static float dot_neon(const float *x, const float *c, const float *d, float w, unsigned taps)
+{
+    float32x4_t lo = vdupq_n_f32(0), hi = vdupq_n_f32(0), wv = vdupq_n_f32(w);
+    float32x2_t s;
+    unsigned k;
+
+    for (k = 0; k < taps; k += 8) {
+	lo = vaddq_f32(lo, vmulq_f32(vld1q_f32(x + k),
+				     vaddq_f32(vld1q_f32(c + k), vmulq_f32(wv, vld1q_f32(d + k)))));
+	hi = vaddq_f32(hi, vmulq_f32(vld1q_f32(x + k + 4),
+				     vaddq_f32(vld1q_f32(c + k + 4),
+					       vmulq_f32(wv, vld1q_f32(d + k + 4)))));
+    }
+
+    lo = vaddq_f32(lo, hi);
+    s = vadd_f32(vget_low_f32(lo), vget_high_f32(lo));
+    return vget_lane_f32(s, 0) + vget_lane_f32(s, 1);
+}
+
+#endif /* RESAMPLE_NEON */
+
+/* pick the fastest inner product this cpu can run */
+void resample_init(void)
+{
+#ifdef RESAMPLE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+	dot_kernel = dot_sse2;
+    if (__builtin_cpu_supports("avx"))
+	dot_kernel = dot_avx;
+#endif
+#ifdef RESAMPLE_NEON
+    dot_kernel = dot_neon;
+#endif
+}
+
+/* where the channels of in go in out: by position, and what out does not
+ * have folded into its neighbours, the front pair last of all */
+static void mix_matrix(float mix[][FLAC__MAX_CHANNELS], unsigned in, unsigned out)
+{
+    float stereo[FLAC__MAX_CHANNELS][FLAC__MAX_CHANNELS], sum, most = 0;
+    int at[POSITIONS];
+    unsigned i, j;
+
+    memset(mix, 0, FLAC__MAX_CHANNELS * sizeof(mix[0]));
+
+    if (in == out) {
+	for (i = 0; i < in; i++)
+	    mix[i][i] = 1;
+	return;
+    }
+
+    if (out == 1) {
+	mix_matrix(stereo, in, 2);
+	for (j = 0; j < in; j++)
+	    mix[0][j] = (stereo[0][j] + stereo[1][j]) / 2;
+	return;
+    }
+
+    for (i = 0; i < POSITIONS; i++)
+	at[i] = -1;
+    for (i = 0; i < out; i++)
+	at[layouts[out - 1][i]] = i;
+
+    for (j = 0; j < in; j++) {
+	int position = layouts[in - 1][j];
+
+	if (in == 1 && at[FC] < 0) {
+	    /* mono goes to both front speakers as it is */
+	    mix[at[FL]][j] = mix[at[FR]][j] = 1;
+	} else if (at[position] >= 0) {
+	    mix[at[position]][j] = 1;
+	} else if (position == FC) {
+	    mix[at[FL]][j] = mix[at[FR]][j] = M_SQRT1_2;
+	} else if (position == BL || position == SL) {
+	    i = position == BL ? SL : BL;
+	    if (at[i] >= 0)
+		mix[at[i]][j] = 1;
+	    else
+		mix[at[FL]][j] = M_SQRT1_2;
+	} else if (position == BR || position == SR) {
+	    i = position == BR ? SR : BR;
+	    if (at[i] >= 0)
+		mix[at[i]][j] = 1;
+	    else
+		mix[at[FR]][j] = M_SQRT1_2;
+	} else if (position == BC) {
+	    if (at[BL] >= 0)
+		mix[at[BL]][j] = mix[at[BR]][j] = M_SQRT1_2;
+	    else if (at[SL] >= 0)
+		mix[at[SL]][j] = mix[at[SR]][j] = M_SQRT1_2;
+	    else
+		mix[at[FL]][j] = mix[at[FR]][j] = M_SQRT1_2;
+	}
+	/* the LFE channel is dropped if out has none */
+    }
+
+    /* no output channel may add up to more than full scale */
+    for (i = 0; i < out; i++) {
+	for (sum = 0, j = 0; j < in; j++)
+	    sum += mix[i][j];
+	if (sum > most)
+	    most = sum;
+    }
+    if (most > 1)
+	for (i = 0; i < out; i++)
+	    for (j = 0; j < in; j++)
+		mix[i][j] /= most;
+}
+
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    unsigned k;
+
+    for (k = 1; term > sum * 1e-12; k++) {
+	term *= (x / (2 * k)) * (x / (2 * k));
+	sum += term;
+    }
+    return sum;
+}
+
+/* tabulate the lowpass of r for every RESAMPLE_PHASES-th fraction of an
+ * input sample, each row scaled to unity gain at DC */
+static void filter_design(resampler *r)
+{
+    double ratio = (double) r->out_rate / r->in_rate;
+    double width = (RESAMPLE_ATTENUATION - 7.95) / (14.36 * r->taps);
+    double cutoff = (ratio < 1 ? ratio : 1) / 2 - width / 2;
+    double i0_beta = bessel_i0(RESAMPLE_BETA);
+    unsigned p, k;
+
+    for (p = 0; p <= RESAMPLE_PHASES; p++) {
+	float *row = r->coef + (size_t) p * r->taps;
+	double f = (double) p / RESAMPLE_PHASES, sum = 0;
+
+	for (k = 0; k < r->taps; k++) {
+	    double x = f + r->half - 1 - k, t = x / r->half, v = 2 * cutoff;
+
+	    if (x != 0)
+		v = sin(2 * M_PI * cutoff * x) / (M_PI * x);
+	    v *= t * t < 1 ? bessel_i0(RESAMPLE_BETA * sqrt(1 - t * t)) / i0_beta : 0;
+	    row[k] = v;
+	    sum += v;
+	}
+	for (k = 0; k < r->taps; k++)
+	    row[k] /= sum;
+    }
+
+    for (p = 0; p < RESAMPLE_PHASES; p++)
+	for (k = 0; k < r->taps; k++)
+	    r->delta[(size_t) p * r->taps + k] = r->coef[(size_t) (p + 1) * r->taps + k] -
+		r->coef[(size_t) p * r->taps + k];
+}
+
+void resample_free(resampler *r)
+{
+    unsigned i;
+
+    if (!r)
+	return;
+
+    for (i = 0; i < FLAC__MAX_CHANNELS; i++) {
+	free(r->hist[i]);
+	free(r->work[i]);
+	free(r->out[i]);
+    }
+    free(r->coef);
+    free(r->delta);
+    free(r->noise);
+    free(r);
+}
+
+/*
+ * A converter from in_rate and in_channels, with a gain made for
+ * in_bits, to decode_args.output_fmt, taking up to max_in samples at a
+ * time.  Everything it needs is allocated here.
+ */
+resampler *resample_new(unsigned in_rate, unsigned in_channels, int in_bits, unsigned max_in)
+{
+    const ao_sample_format *fmt = &decode_args.output_fmt;
+    resampler *r = calloc(1, sizeof(resampler));
+    unsigned i, size;
+    FLAC__bool ok;
+
+    if (!r)
+	return NULL;
+
+    r->in_rate = in_rate;
+    r->out_rate = fmt->rate;
+    r->in_channels = in_channels;
+    r->out_channels = fmt->channels;
+    r->out_bits = fmt->bits;
+    r->shift = fmt->bits - in_bits;
+    r->max_in = max_in;
+    mix_matrix(r->mix, in_channels, fmt->channels);
+    r->remix = in_channels != (unsigned) fmt->channels;
+
+    if (in_rate != (unsigned) fmt->rate) {
+	/* a whole number of 8 lane passes */
+	r->half = RESAMPLE_HALF;
+	if (in_rate > (unsigned) fmt->rate)
+	    r->half = (unsigned) ceil((double) RESAMPLE_HALF * in_rate / fmt->rate);
+	r->half = (r->half + 3) & ~3U;
+	r->taps = 2 * r->half;
+	r->max_out = (unsigned) ((FLAC__uint64) (max_in + r->taps) * fmt->rate / in_rate + 2);
+    } else {
+	r->max_out = max_in;
+    }
+
+    size = max_in + r->taps + r->half;
+    ok = (r->noise = malloc((r->max_out * r->out_channels + 8) * sizeof(FLAC__int32))) != NULL;
+    for (i = 0; ok && i < r->out_channels; i++)
+	ok = (r->hist[i] = calloc(size, sizeof(float))) &&
+	    (r->work[i] = malloc(r->max_out * sizeof(float))) &&
+	    (r->out[i] = malloc(r->max_out * sizeof(FLAC__int32)));
+    if (ok && r->taps)
+	ok = (r->coef = malloc((size_t) (RESAMPLE_PHASES + 1) * r->taps * sizeof(float))) &&
+	    (r->delta = malloc((size_t) RESAMPLE_PHASES * r->taps * sizeof(float)));
+    if (!ok) {
+	resample_free(r);
+	return NULL;
+    }
+
+    if (r->taps)
+	filter_design(r);
+    memcpy(r->noise_state, noise_seed, sizeof(noise_seed));
+    resample_reset(r);
+
+    for (i = 0; i < r->out_channels; i++) {
+	realtime_prefault(r->hist[i], size * sizeof(float));
+	realtime_prefault(r->work[i], r->max_out * sizeof(float));
+	realtime_prefault(r->out[i], r->max_out * sizeof(FLAC__int32));
+    }
+    realtime_prefault(r->noise, (r->max_out * r->out_channels + 8) * sizeof(FLAC__int32));
+
+    return r;
+}
+
+/* forget the input so far, after a seek */
+void resample_reset(resampler *r)
+{
+    unsigned i;
+
+    if (!r)
+	return;
+
+    /* the first output lies on the first input sample */
+    for (i = 0; i < r->out_channels && r->half; i++)
+	memset(r->hist[i], 0, (r->half - 1) * sizeof(float));
+    r->fill = r->half ? r->half - 1 : 0;
+    r->pos = r->num = 0;
+}
+
+/* the most bytes resample_frame() produces from samples input samples */
+size_t resample_bytes(const resampler *r, unsigned samples)
+{
+    FLAC__uint64 out = samples;
+
+    if (r->taps)
+	out = (FLAC__uint64) (samples + r->taps) * r->out_rate / r->in_rate + 2 +
+	    samples / r->max_in * 2;
+    return (size_t) out * r->out_channels * (r->out_bits / 8);
+}
+
+/* mix samples input samples, multiplied by scale, onto the end of hist */
+static void mix_in(resampler *r, const FLAC__int32 * const buf[], unsigned samples, float scale)
+{
+    unsigned i, j, k;
+
+    for (i = 0; i < r->out_channels; i++) {
+	float *h = r->hist[i] + r->fill;
+
+	memset(h, 0, samples * sizeof(float));
+	for (j = 0; j < r->in_channels; j++) {
+	    float m = r->mix[i][j] * scale;
+
+	    if (m != 0)
+		for (k = 0; k < samples; k++)
+		    h[k] += m * (float) buf[j][k];
+	}
+    }
+    r->fill += samples;
+}
+
+/* run the filter as far as hist allows, returns the outputs made */
+static unsigned filter(resampler *r)
+{
+    unsigned n = 0, i, phase;
+    FLAC__uint64 at;
+    const float *c, *d;
+    float w;
+
+    while (r->pos + r->taps <= r->fill) {
+	at = (FLAC__uint64) r->num * RESAMPLE_PHASES;
+	phase = (unsigned) (at / r->out_rate);
+	w = (float) (at % r->out_rate) / r->out_rate;
+	c = r->coef + (size_t) phase * r->taps;
+	d = r->delta + (size_t) phase * r->taps;
+
+	for (i = 0; i < r->out_channels; i++)
+	    r->work[i][n] = dot_kernel(r->hist[i] + r->pos, c, d, w, r->taps);
+	n++;
+
+	r->num += r->in_rate;
+	r->pos += r->num / r->out_rate;
+	r->num %= r->out_rate;
+    }
+
+    /* keep what the next outputs still need */
+    for (i = 0; i < r->out_channels; i++)
+	memmove(r->hist[i], r->hist[i] + r->pos, (r->fill - r->pos) * sizeof(float));
+    r->fill -= r->pos;
+    r->pos = 0;
+
+    return n;
+}
+
+/* round n outputs of every channel of from into r->out */
+static void quantize(resampler *r, float *const from[], unsigned n, FLAC__bool dither)
+{
+    const FLAC__int32 max = (FLAC__int32) ((1U << (r->out_bits - 1)) - 1), min = -max - 1;
+    const float top = ldexpf(1, r->out_bits - 1);
+    unsigned i, k, channels = r->out_channels;
+    long v;
+
+    if (dither)
+	dither_fill(r->noise, n * channels, r->noise_state);
+
+    for (i = 0; i < channels; i++) {
+	for (k = 0; k < n; k++) {
+	    float x = from[i][k];
+
+	    if (dither)
+		x += r->noise[k * channels + i] * (1.0f / GAIN_UNITY);
+	    v = x >= top ? max : x < -top ? min : lrintf(x);
+	    r->out[i][k] = (FLAC__int32) (v > max ? max : v < min ? min : v);
+	}
+    }
+}
+
+/*
+ * Convert samples input samples of buf at gain (the Q16.16 gain of
+ * gain_update()) into interleaved output at out.  The last frame of a
+ * file also plays out what is left in the filter.  Returns the number of
+ * bytes written, at most resample_bytes(samples), plus CONVERT_SLACK.
+ */
+size_t resample_frame(resampler *r, uint_8 *out, const FLAC__int32 * const buf[],
+		      unsigned samples, FLAC__int32 gain, FLAC__bool last)
+{
+    const FLAC__int32 *part[FLAC__MAX_CHANNELS];
+    unsigned bytes = r->out_channels * (r->out_bits / 8);
+    unsigned i, chunk, n, done = 0;
+    float scale = ldexpf((float) gain / GAIN_UNITY, r->shift);
+    int exponent;
+    size_t written = 0;
+    FLAC__bool dither;
+
+    /* copying and shifting by whole bits alone is exact */
+    dither = decode_args.dither && (r->taps || r->remix || scale < 1 ||
+				 frexpf(scale, &exponent) != 0.5f);
+
+    while (done < samples || (last && r->taps)) {
+	chunk = samples - done < r->max_in ? samples - done : r->max_in;
+	for (i = 0; i < r->in_channels; i++)
+	    part[i] = buf[i] + done;
+	mix_in(r, part, chunk, scale);
+	done += chunk;
+
+	if (!r->taps) {
+	    /* the same rate: hist is the output */
+	    n = r->fill;
+	    quantize(r, r->hist, n, dither);
+	    r->fill = 0;
+	} else {
+	    /* the end of the file: the filter runs into silence */
+	    if (last && done == samples) {
+		for (i = 0; i < r->out_channels; i++)
+		    memset(r->hist[i] + r->fill, 0, r->half * sizeof(float));
+		r->fill += r->half;
+	    }
+	    n = filter(r);
+	    quantize(r, r->work, n, dither);
+	}
+
+	convert_select(r->out_bits, r->out_channels, CONVERT_UNITY)
+	    (out + written, (const FLAC__int32 * const *) r->out, r->out_channels, n,
+	     GAIN_UNITY, NULL);
+	written += (size_t) n * bytes;
+
+	if (last && done == samples) {
+	    if (r->taps)
+		resample_reset(r);
+	    break;
+	}
+    }
+
+    return written;
+}
@@ -0,0 +1,696 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This scan.c module implements --scan: directories are walked on the
+ *  --jobs thread pool, and of every FLAC file only the metadata blocks
+ *  are read, with a single pread() for most files, and parsed here
+ *  rather than by libFLAC.  One JSON object per file is printed with
+ *  STREAMINFO, all Vorbis comments at full length, and what the
+ *  SEEKTABLE and CUESHEET hold.  Audio is never decoded.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "flac123.h"
+
+/* bytes read from the start of every file, enough for the metadata of
+ * most of them; blocks beyond are read on their own if they are wanted */
+#define SCAN_READ (64 << 10)
+
+/* files of a directory handed to the pool as one task */
+#define SCAN_BATCH 64
+
+/* records collected before they are written out */
+#define SCAN_FLUSH (64 << 10)
+
+/* JSON being put together, see out_printf() and out_string() */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+    FLAC__bool failed;       /* out of memory, the record is dropped */
+} scan_out;
+
+typedef struct {
+    char *dir;               /* NULL for files named on the command line */
+    char *names[SCAN_BATCH];
+    unsigned count;
+} scan_batch;
+
+/* a Vorbis comment, pointing into the block it came from */
+typedef struct {
+    const uint_8 *name, *value;
+    unsigned name_len, value_len;
+} scan_tag;
+
+static thread_pool *pool;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint scanned, failed;
+
+static uint_32 be16(const uint_8 *b) { return (uint_32) b[0] << 8 | b[1]; }
+static uint_32 be24(const uint_8 *b) { return (uint_32) b[0] << 16 | b[1] << 8 | b[2]; }
+static uint_32 be32(const uint_8 *b) { return (uint_32) b[0] << 24 | be24(b + 1); }
+static FLAC__uint64 be64(const uint_8 *b) { return (FLAC__uint64) be32(b) << 32 | be32(b + 4); }
+static uint_32 le32(const uint_8 *b) { return b[0] | b[1] << 8 | b[2] << 16 | (uint_32) b[3] << 24; }
+
+static void out_grow(scan_out *o, size_t more)
+{
+    size_t size = o->size ? o->size : 4096;
+    char *grown;
+
+    if (o->failed || o->len + more < o->size)
+	return;
+    while (size <= o->len + more)
+	size *= 2;
+    if (!(grown = realloc(o->data, size))) {
+	o->failed = true;
+	return;
+    }
+    o->data = grown;
+    o->size = size;
+}
+
+static void out_printf(scan_out *o, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    out_grow(o, n + 1);
+    if (o->failed)
+	return;
+    va_start(args, format);
+    vsnprintf(o->data + o->len, n + 1, format, args);
+    va_end(args);
+    o->len += n;
+}
+
+/* the length of the UTF-8 sequence at s, 0 if it is not valid */
+static unsigned utf8_length(const uint_8 *s, size_t avail)
+{
+    unsigned n, i;
+    uint_32 c;
+
+    if (s[0] < 0x80)
+	return 1;
+    if (s[0] >= 0xC2 && s[0] < 0xE0)
+	n = 2, c = s[0] & 0x1F;
+    else if (s[0] >= 0xE0 && s[0] < 0xF0)
+	n = 3, c = s[0] & 0x0F;
+    else if (s[0] >= 0xF0 && s[0] < 0xF5)
+	n = 4, c = s[0] & 0x07;
+    else
+	return 0;
+
+    if (n > avail)
+	return 0;
+    for (i = 1; i < n; i++) {
+	if ((s[i] & 0xC0) != 0x80)
+	    return 0;
+	c = c << 6 | (s[i] & 0x3F);
+    }
+    /* overlong, surrogates, beyond U+10FFFF */
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+	(c >= 0xD800 && c <= 0xDFFF))
+	return 0;
+    return n;
+}
+
+/* s as a JSON string; invalid UTF-8 becomes U+FFFD.  Vorbis comment
+ * field names are case insensitive and are printed in upper case. */
+static void out_string(scan_out *o, const void *str, size_t len, FLAC__bool upper)
+{
+    const uint_8 *s = str;
+    size_t i;
+    unsigned n;
+
+    out_grow(o, 6 * len + 2);
+    if (o->failed)
+	return;
+
+    o->data[o->len++] = '"';
+    for (i = 0; i < len; i += n) {
+	n = 1;
+	if (s[i] == '"' || s[i] == '\\') {
+	    o->data[o->len++] = '\\';
+	    o->data[o->len++] = s[i];
+	} else if (s[i] < 0x20) {
+	    o->len += sprintf(o->data + o->len, "\\u%04x", s[i]);
+	} else if (s[i] < 0x80) {
+	    o->data[o->len++] = upper ? toupper(s[i]) : s[i];
+	} else if ((n = utf8_length(s + i, len - i))) {
+	    memcpy(o->data + o->len, s + i, n);
+	    o->len += n;
+	} else {
+	    memcpy(o->data + o->len, "\xEF\xBF\xBD", 3);
+	    o->len += 3;
+	    n = 1;
+	}
+    }
+    o->data[o->len++] = '"';
+}
+
+/* s as a JSON string on out, for the other modes that print JSON */
+void json_string(FILE *out, const char *s)
+{
+    scan_out o = { NULL, 0, 0, false };
+
+    out_string(&o, s, strlen(s), false);
+    if (!o.failed)
+	fwrite(o.data, 1, o.len, out);
+    free(o.data);
+}
+
+/* len bytes at offset of the file: from the start that has been read if
+ * they are in it, otherwise read into *scratch */
+static const uint_8 *scan_block(int fd, const uint_8 *head, size_t got, FLAC__uint64 offset,
+				size_t len, uint_8 **scratch, size_t *scratch_size)
+{
+    uint_8 *grown;
+    ssize_t n;
+    size_t done = 0;
+
+    if (offset + len <= got)
+	return head + offset;
+
+    if (len > *scratch_size) {
+	if (!(grown = realloc(*scratch, len)))
+	    return NULL;
+	*scratch = grown;
+	*scratch_size = len;
+    }
+    while (done < len) {
+	if ((n = pread(fd, *scratch + done, len - done, offset + done)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    return NULL;
+	}
+	done += n;
+    }
+    return *scratch;
+}
+
+static void scan_streaminfo(scan_out *o, const uint_8 *b)
+{
+    unsigned rate = b[10] << 12 | b[11] << 4 | b[12] >> 4;
+    FLAC__uint64 total = (FLAC__uint64) (b[13] & 0x0F) << 32 | be32(b + 14);
+    unsigned i;
+
+    out_printf(o, ",\"sample_rate\":%u,\"channels\":%u,\"bits_per_sample\":%u,"
+	       "\"total_samples\":%llu,\"duration\":%.3f,\"min_blocksize\":%u,"
+	       "\"max_blocksize\":%u,\"min_framesize\":%u,\"max_framesize\":%u,\"md5\":\"",
+	       rate, ((b[12] >> 1) & 7) + 1, ((b[12] & 1) << 4 | b[13] >> 4) + 1,
+	       (unsigned long long) total, rate ? (double) total / rate : 0.0,
+	       be16(b), be16(b + 2), be24(b + 4), be24(b + 7));
+    for (i = 0; i < 16; i++)
+	out_printf(o, "%02x", b[18 + i]);
+    out_printf(o, "\"");
+}
+
+/* collect the comments of a VORBIS_COMMENT block into *tags */
+static FLAC__bool scan_comments(const uint_8 *b, size_t len, scan_tag **tags, unsigned *count,
+				unsigned *size, const uint_8 **vendor, unsigned *vendor_len)
+{
+    size_t at = 4;
+    uint_32 n, i, entry;
+    const uint_8 *eq;
+    scan_tag *grown;
+
+    if (len < 8 || (entry = le32(b)) > len - 8)
+	return false;
+    if (!*vendor) {
+	*vendor = b + 4;
+	*vendor_len = entry;
+    }
+    at += entry;
+    n = le32(b + at);
+    at += 4;
+
+    for (i = 0; i < n; i++) {
+	if (len - at < 4 || (entry = le32(b + at)) > len - at - 4)
+	    return false;
+	at += 4;
+	if (*count == *size) {
+	    if (!(grown = realloc(*tags, (*size ? 2 * *size : 32) * sizeof(scan_tag))))
+		return false;
+	    *tags = grown;
+	    *size = *size ? 2 * *size : 32;
+	}
+	/* a comment without = is not a field */
+	if ((eq = memchr(b + at, '=', entry))) {
+	    (*tags)[*count].name = b + at;
+	    (*tags)[*count].name_len = eq - (b + at);
+	    (*tags)[*count].value = eq + 1;
+	    (*tags)[*count].value_len = entry - (eq + 1 - (b + at));
+	    (*count)++;
+	}
+	at += entry;
+    }
+    return true;
+}
+
+/* the tags as an object of arrays, one per field name */
+static void scan_print_tags(scan_out *o, const scan_tag *tags, unsigned count)
+{
+    char *done = calloc(count ? count : 1, 1);
+    unsigned i, j;
+    FLAC__bool first = true;
+
+    if (!done) {
+	o->failed = true;
+	return;
+    }
+
+    out_printf(o, ",\"tags\":{");
+    for (i = 0; i < count; i++) {
+	if (done[i])
+	    continue;
+	out_printf(o, "%s", first ? "" : ",");
+	out_string(o, tags[i].name, tags[i].name_len, true);
+	out_printf(o, ":[");
+	for (j = i; j < count; j++) {
+	    if (done[j] || tags[j].name_len != tags[i].name_len ||
+		strncasecmp((const char *) tags[j].name, (const char *) tags[i].name,
+			    tags[i].name_len) != 0)
+		continue;
+	    if (j != i)
+		out_printf(o, ",");
+	    out_string(o, tags[j].value, tags[j].value_len, false);
+	    done[j] = 1;
+	}
+	out_printf(o, "]");
+	first = false;
+    }
+    out_printf(o, "}");
+    free(done);
+}
+
+static void scan_seektable(scan_out *o, const uint_8 *b, size_t len)
+{
+    unsigned points = len / 18, placeholders = 0, i;
+    FLAC__uint64 sample, first = 0, last = 0, spacing = 0;
+    FLAC__bool any = false;
+
+    for (i = 0; i < points; i++) {
+	if ((sample = be64(b + 18 * i)) == 0xFFFFFFFFFFFFFFFFULL) {
+	    placeholders++;
+	    continue;
+	}
+	if (any && sample - last > spacing)
+	    spacing = sample - last;
+	if (!any)
+	    first = sample;
+	last = sample;
+	any = true;
+    }
+
+    out_printf(o, ",\"seektable\":{\"points\":%u,\"placeholders\":%u", points, placeholders);
+    if (any)
+	out_printf(o, ",\"first_sample\":%llu,\"last_sample\":%llu,\"max_spacing\":%llu",
+		   (unsigned long long) first, (unsigned long long) last,
+		   (unsigned long long) spacing);
+    out_printf(o, "}");
+}
+
+static FLAC__bool scan_cuesheet(scan_out *o, const uint_8 *b, size_t len)
+{
+    size_t at = 396;
+    unsigned tracks, i;
+
+    if (len < at)
+	return false;
+    tracks = b[395];
+
+    out_printf(o, ",\"cuesheet\":{\"catalog\":");
+    out_string(o, b, strnlen((const char *) b, 128), false);
+    out_printf(o, ",\"lead_in\":%llu,\"cd\":%s,\"tracks\":[",
+	       (unsigned long long) be64(b + 128), b[136] & 0x80 ? "true" : "false");
+
+    for (i = 0; i < tracks; i++) {
+	if (len - at < 36 || len - at - 36 < 12 * b[at + 35])
+	    return false;
+	out_printf(o, "%s{\"number\":%u,\"offset\":%llu,\"isrc\":", i ? "," : "",
+		   b[at + 8], (unsigned long long) be64(b + at));
+	out_string(o, b + at + 9, strnlen((const char *) b + at + 9, 12), false);
+	out_printf(o, ",\"audio\":%s,\"pre_emphasis\":%s,\"indices\":%u}",
+		   b[at + 21] & 0x80 ? "false" : "true", b[at + 21] & 0x40 ? "true" : "false",
+		   b[at + 35]);
+	at += 36 + 12 * b[at + 35];
+    }
+    out_printf(o, "]}");
+    return true;
+}
+
+/* append the fields of path to o; false and *error if it cannot be
+ * scanned */
+static FLAC__bool scan_file(scan_out *o, const char *path, uint_8 *head, const char **error)
+{
+    uint_8 *scratch = NULL, **kept = NULL, **grown;
+    size_t scratch_size = 0, got = 0, len;
+    scan_tag *tags = NULL;
+    unsigned count = 0, size = 0, vendor_len = 0, pictures = 0, nkept = 0, i;
+    const uint_8 *vendor = NULL, *b;
+    FLAC__uint64 at = 0, padding = 0;
+    FLAC__bool last = false, streaminfo = false, ok = true;
+    struct stat st;
+    ssize_t n;
+    int fd, type;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+	*error = strerror(errno);
+	if (fd >= 0)
+	    close(fd);
+	return false;
+    }
+
+    while (got < SCAN_READ && (n = pread(fd, head + got, SCAN_READ - got, got)) != 0) {
+	if (n < 0 && errno != EINTR) {
+	    *error = strerror(errno);
+	    close(fd);
+	    return false;
+	}
+	if (n > 0)
+	    got += n;
+    }
+
+    /* an ID3v2 tag some programs put in front */
+    if (got >= 10 && memcmp(head, "ID3", 3) == 0)
+	at = 10 + ((head[6] & 0x7F) << 21 | (head[7] & 0x7F) << 14 |
+		   (head[8] & 0x7F) << 7 | (head[9] & 0x7F)) + (head[5] & 0x10 ? 10 : 0);
+
+    if (!(b = scan_block(fd, head, got, at, 4, &scratch, &scratch_size)) ||
+	memcmp(b, "fLaC", 4) != 0)
+    {
+	*error = "not a FLAC file";
+	close(fd);
+	free(scratch);
+	return false;
+    }
+    at += 4;
+
+    out_printf(o, ",\"size\":%llu,\"mtime\":%lld", (unsigned long long) st.st_size,
+	       (long long) st.st_mtime);
+
+    while (ok && !last) {
+	if (!(b = scan_block(fd, head, got, at, 4, &scratch, &scratch_size))) {
+	    ok = false;
+	    break;
+	}
+	last = b[0] >> 7;
+	type = b[0] & 0x7F;
+	len = be24(b + 1);
+	at += 4;
+
+	if (at + len > (FLAC__uint64) st.st_size) {
+	    ok = false;
+	} else if (type == FLAC__METADATA_TYPE_PICTURE) {
+	    pictures++;
+	} else if (type == FLAC__METADATA_TYPE_PADDING) {
+	    padding += len;
+	} else if (type == FLAC__METADATA_TYPE_STREAMINFO ||
+		   type == FLAC__METADATA_TYPE_VORBIS_COMMENT ||
+		   type == FLAC__METADATA_TYPE_SEEKTABLE ||
+		   type == FLAC__METADATA_TYPE_CUESHEET)
+	{
+	    if (!(b = scan_block(fd, head, got, at, len, &scratch, &scratch_size))) {
+		ok = false;
+	    } else if (type == FLAC__METADATA_TYPE_STREAMINFO) {
+		if ((ok = len >= 34 && !streaminfo))
+		    scan_streaminfo(o, b);
+		streaminfo = true;
+	    } else if (type == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
+		ok = scan_comments(b, len, &tags, &count, &size, &vendor, &vendor_len);
+		/* the tags point into the block, which is kept if it was
+		 * read on its own */
+		if (ok && b == scratch) {
+		    if ((grown = realloc(kept, (nkept + 1) * sizeof(*kept)))) {
+			kept = grown;
+			kept[nkept++] = scratch;
+			scratch = NULL;
+			scratch_size = 0;
+		    } else {
+			ok = false;
+		    }
+		}
+	    } else if (type == FLAC__METADATA_TYPE_SEEKTABLE) {
+		scan_seektable(o, b, len);
+	    } else {
+		ok = scan_cuesheet(o, b, len);
+	    }
+	}
+	at += len;
+    }
+
+    if (ok && streaminfo) {
+	out_printf(o, ",\"audio_offset\":%llu,\"pictures\":%u,\"padding\":%llu",
+		   (unsigned long long) at, pictures, (unsigned long long) padding);
+	if (vendor) {
+	    out_printf(o, ",\"vendor\":");
+	    out_string(o, vendor, vendor_len, false);
+	}
+	scan_print_tags(o, tags, count);
+    }
+
+    for (i = 0; i < nkept; i++)
+	free(kept[i]);
+    free(kept);
+    free(tags);
+    free(scratch);
+    close(fd);
+
+    if (!streaminfo || !ok) {
+	*error = streaminfo ? "damaged metadata" : "no STREAMINFO";
+	return false;
+    }
+    return true;
+}
+
+/* hand what has been collected to stdout, one whole record at a time */
+static void scan_write(scan_out *o)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    pthread_mutex_lock(&out_lock);
+    while (done < o->len) {
+	if ((n = write(STDOUT_FILENO, o->data + done, o->len - done)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	done += n;
+    }
+    pthread_mutex_unlock(&out_lock);
+    o->len = 0;
+}
+
+static void scan_batch_run(void *arg)
+{
+    scan_batch *batch = (scan_batch *) arg;
+    scan_out o = { NULL, 0, 0, false };
+    uint_8 *head = malloc(SCAN_READ);
+    const char *error;
+    char *path;
+    size_t start, fields;
+    unsigned i;
+
+    for (i = 0; i < batch->count; i++) {
+	path = batch->names[i];
+	if (batch->dir && (path = malloc(strlen(batch->dir) + strlen(batch->names[i]) + 2)))
+	    sprintf(path, "%s/%s", batch->dir, batch->names[i]);
+
+	start = o.len;
+	o.failed = false;
+	out_printf(&o, "{\"path\":");
+	out_string(&o, path ? path : batch->names[i], strlen(path ? path : batch->names[i]), false);
+	fields = o.len;
+
+	error = "out of memory";
+	if (!head || !path || !scan_file(&o, path, head, &error)) {
+	    /* only the path goes with the error */
+	    if (!o.failed)
+		o.len = fields;
+	    out_printf(&o, ",\"error\":");
+	    out_string(&o, error, strlen(error), false);
+	    atomic_fetch_add(&failed, 1);
+	}
+	out_printf(&o, "}\n");
+	atomic_fetch_add(&scanned, 1);
+
+	/* a record that could not be put together is left out */
+	if (o.failed) {
+	    o.len = start;
+	    o.failed = false;
+	}
+	if (o.len >= SCAN_FLUSH)
+	    scan_write(&o);
+
+	if (path != batch->names[i])
+	    free(path);
+	free(batch->names[i]);
+    }
+
+    scan_write(&o);
+    free(o.data);
+    free(head);
+    free(batch->dir);
+    free(batch);
+}
+
+static void scan_submit(scan_batch *batch)
+{
+    if (pool)
+	pool_submit(pool, scan_batch_run, batch);
+    else
+	scan_batch_run(batch);
+}
+
+static FLAC__bool is_flac_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 5 && strcasecmp(name + len - 5, ".flac") == 0;
+}
+
+/* the FLAC files of dir go to the pool in batches, its directories as
+ * tasks of their own.  Symbolic links to directories are not followed. */
+static void scan_dir_run(void *arg)
+{
+    char *dir = (char *) arg, *sub;
+    scan_batch *batch = NULL;
+    struct dirent *e;
+    struct stat st;
+    DIR *d;
+    int type;
+
+    if (!(d = opendir(dir))) {
+	fprintf(stderr, "Error reading %s: %s\n", dir, strerror(errno));
+	atomic_fetch_add(&failed, 1);
+	free(dir);
+	return;
+    }
+
+    while ((e = readdir(d))) {
+	if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+	    continue;
+
+	type = e->d_type;
+	if (type == DT_UNKNOWN) {
+	    if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		continue;
+	    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+	}
+
+	if (type == DT_DIR) {
+	    if ((sub = malloc(strlen(dir) + strlen(e->d_name) + 2))) {
+		sprintf(sub, "%s/%s", dir, e->d_name);
+		if (pool)
+		    pool_submit(pool, scan_dir_run, sub);
+		else
+		    scan_dir_run(sub);
+	    }
+	} else if ((type == DT_REG || type == DT_LNK) && is_flac_name(e->d_name)) {
+	    if (!batch && (batch = calloc(1, sizeof(scan_batch))) && !(batch->dir = strdup(dir))) {
+		free(batch);
+		batch = NULL;
+	    }
+	    if (batch && (batch->names[batch->count] = strdup(e->d_name)))
+		batch->count++;
+	    if (batch && batch->count == SCAN_BATCH) {
+		scan_submit(batch);
+		batch = NULL;
+	    }
+	}
+    }
+    closedir(d);
+
+    if (batch)
+	scan_submit(batch);
+    free(dir);
+}
+
+/* print the metadata of every FLAC file in or under paths[], returns the
+ * number of failures */
+int scan_run(const char **paths, unsigned count)
+{
+    unsigned threads = cli_args.jobs > 0 ? (unsigned) cli_args.jobs : pool_cpus();
+    scan_batch *files = NULL;
+    struct timespec start, end;
+    struct stat st;
+    unsigned i;
+    char *dir;
+    size_t len;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (threads > 1 && !(pool = pool_new(threads)))
+	fprintf(stderr, "Error starting scanner threads\n");
+
+    for (i = 0; i < count; i++) {
+	if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+	    /* no double slash in the paths printed */
+	    len = strlen(paths[i]);
+	    while (len > 1 && paths[i][len - 1] == '/')
+		len--;
+	    if ((dir = strndup(paths[i], len))) {
+		if (pool)
+		    pool_submit(pool, scan_dir_run, dir);
+		else
+		    scan_dir_run(dir);
+	    }
+	    continue;
+	}
+
+	/* anything else is scanned as a file, and fails if it is not one */
+	if (!files)
+	    files = calloc(1, sizeof(scan_batch));
+	if (files && (files->names[files->count] = strdup(paths[i])))
+	    files->count++;
+	if (files && files->count == SCAN_BATCH) {
+	    scan_submit(files);
+	    files = NULL;
+	}
+    }
+    if (files)
+	scan_submit(files);
+
+    if (pool) {
+	pool_wait(pool);
+	pool_free(pool);
+	pool = NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!cli_args.quiet)
+	fprintf(stderr, "Scanned %u files in %.2f seconds, %u failed\n",
+		atomic_load(&scanned), (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9, atomic_load(&failed));
+
+    return atomic_load(&failed);
+}
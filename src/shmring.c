@@ -0,0 +1,311 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This shmring.c module implements --shm: instead of a libao device the
+ *  converted PCM goes into a ring in POSIX shared memory, which another
+ *  process reads without a system call or a copy through the kernel.  A
+ *  header in front of the ring carries the format, the write and read
+ *  positions and an epoch that changes with every track and seek; both
+ *  sides sleep on futexes in it when the ring is empty or full.  The
+ *  layout and how to read it are described in README.shm.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "flac123.h"
+
+#define SHM_MAGIC   "flac123\0"
+#define SHM_VERSION 1
+
+/* the ring starts this far into the segment */
+#define SHM_HEADER_SIZE 4096
+
+/* the smallest ring, whatever --ring-time says */
+#define SHM_MIN_RING (64 * 1024)
+
+/* how long a side sleeps before it looks again on its own */
+#define SHM_WAIT_NS 100000000
+
+#define SHM_STREAMING 1
+#define SHM_ENDED     2
+
+/* the first SHM_HEADER_SIZE bytes of the segment, see README.shm */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;    /* where the ring starts */
+    uint64_t size;           /* of the ring in bytes */
+    _Atomic uint32_t epoch;  /* +1 at every track, format change and seek */
+    _Atomic uint32_t state;  /* SHM_xxx */
+    uint32_t rate;           /* format of the PCM from epoch_start on, */
+    uint32_t bits;           /* native endian, interleaved */
+    uint32_t channels;
+    uint32_t limit;          /* at most this many bytes are unread */
+    _Atomic uint64_t epoch_start; /* write position where epoch began */
+    _Atomic uint64_t flush_pos; /* what comes before is stale after a seek */
+    _Atomic uint64_t write_pos; /* bytes ever written, the ring holds */
+    _Atomic uint64_t read_pos;  /* those from read_pos on, mod size */
+    _Atomic uint32_t data_seq;  /* futex: +1 when write_pos or state change */
+    _Atomic uint32_t space_seq; /* futex: +1 when the reader moves read_pos */
+    _Atomic uint32_t reader_waiting; /* set around waits on data_seq */
+    _Atomic uint32_t writer_waiting; /* set around waits on space_seq */
+} shm_header;
+
+struct pcm_shmring {
+    char *name;
+    shm_header *h;
+    uint_8 *ring;
+    size_t map_size;
+};
+
+#ifdef __linux__
+/* the futexes are shared with another process, so not FUTEX_PRIVATE */
+static void futex_wait(_Atomic uint32_t *word, uint32_t seen)
+{
+    struct timespec timeout = { 0, SHM_WAIT_NS };
+
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+static void futex_wait(_Atomic uint32_t *word, uint32_t seen)
+{
+    struct timespec pause = { 0, 1000000 };
+
+    if (atomic_load(word) == seen)
+	nanosleep(&pause, NULL);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+}
+#endif
+
+static void shm_wake_reader(shm_header *h)
+{
+    atomic_fetch_add(&h->data_seq, 1);
+    if (atomic_load(&h->reader_waiting))
+	futex_wake(&h->data_seq);
+}
+
+/* wait for the reader to leave at most unread bytes in the ring */
+static void shm_wait_read(shm_header *h, uint64_t unread)
+{
+    uint32_t seen;
+
+    while (atomic_load(&h->write_pos) - atomic_load(&h->read_pos) > unread) {
+	seen = atomic_load(&h->space_seq);
+	atomic_store(&h->writer_waiting, 1);
+	if (atomic_load(&h->write_pos) - atomic_load(&h->read_pos) > unread)
+	    futex_wait(&h->space_seq, seen);
+	atomic_store(&h->writer_waiting, 0);
+    }
+}
+
+static size_t ring_bytes(const ao_sample_format *fmt)
+{
+    unsigned ms = cli_args.ring_time > 0 ? (unsigned) cli_args.ring_time : RING_TIME_DEFAULT;
+
+    return (size_t) fmt->rate * fmt->channels * ((fmt->bits + 7) / 8) * ms / 1000;
+}
+
+/*
+ * Create the segment name, or take over the one a previous run left, for
+ * a ring of --ring-time of fmt.  A reader that is still attached to it
+ * sees the epoch change.  NULL after an error has been printed.
+ */
+pcm_shmring *shmring_open(const char *name, const ao_sample_format *fmt)
+{
+    pcm_shmring *r = calloc(1, sizeof(pcm_shmring));
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = ring_bytes(fmt);
+    struct stat st;
+    shm_header *h;
+    void *map;
+    int fd;
+
+    if (!r || !(r->name = malloc(strlen(name) + 2))) {
+	fprintf(stderr, "Out of memory\n");
+	free(r);
+	return NULL;
+    }
+    /* portable names have a single leading slash */
+    sprintf(r->name, "%s%s", name[0] == '/' ? "" : "/", name);
+
+    if (size < SHM_MIN_RING)
+	size = SHM_MIN_RING;
+    if (page > 0)
+	size = (size + page - 1) / page * page;
+
+    if ((fd = shm_open(r->name, O_RDWR | O_CREAT, 0666)) < 0) {
+	fprintf(stderr, "Error opening shared memory %s: %s\n", r->name, strerror(errno));
+	goto fail;
+    }
+
+    /* keep the size of a segment of ours, a reader may have it mapped */
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size > SHM_HEADER_SIZE) {
+	map = mmap(NULL, SHM_HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED) {
+	    h = (shm_header *) map;
+	    if (memcmp(h->magic, SHM_MAGIC, 8) == 0 && h->version == SHM_VERSION &&
+		h->header_size == SHM_HEADER_SIZE &&
+		h->size + SHM_HEADER_SIZE == (uint64_t) st.st_size)
+	    {
+		size = (size_t) h->size;
+	    }
+	    munmap(map, SHM_HEADER_SIZE);
+	}
+    }
+
+    r->map_size = SHM_HEADER_SIZE + size;
+    if (ftruncate(fd, (off_t) r->map_size) != 0 ||
+	(map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+	fprintf(stderr, "Error mapping shared memory %s: %s\n", r->name, strerror(errno));
+	close(fd);
+	goto fail;
+    }
+    close(fd); /* the mapping keeps it */
+
+    r->h = h = (shm_header *) map;
+    r->ring = (uint_8 *) map + SHM_HEADER_SIZE;
+    realtime_prefault(r->ring, size);
+
+    if (memcmp(h->magic, SHM_MAGIC, 8) != 0 || h->version != SHM_VERSION ||
+	h->size != size)
+    {
+	memset(h, 0, sizeof(shm_header));
+	h->version = SHM_VERSION;
+	h->header_size = SHM_HEADER_SIZE;
+	h->size = size;
+	memcpy(h->magic, SHM_MAGIC, 8);
+    }
+    /* what a previous run left unread is dropped */
+    atomic_store(&h->read_pos, atomic_load(&h->write_pos));
+    h->rate = h->bits = h->channels = 0;
+
+    return r;
+
+fail:
+    free(r->name);
+    free(r);
+    return NULL;
+}
+
+/* start a new epoch at the current write position */
+static void shm_epoch(shm_header *h, FLAC__bool flush)
+{
+    uint64_t pos = atomic_load(&h->write_pos);
+
+    atomic_store(&h->epoch_start, pos);
+    if (flush)
+	atomic_store(&h->flush_pos, pos);
+    atomic_fetch_add(&h->epoch, 1);
+    atomic_store(&h->state, SHM_STREAMING);
+    shm_wake_reader(h);
+}
+
+/* what is in the ring is not to be played any more: a seek, STOP or a
+ * track cut short.  Accepts NULL. */
+void shmring_flush(pcm_shmring *r)
+{
+    if (r)
+	shm_epoch(r->h, true);
+}
+
+/*
+ * A new track of fmt begins.  When the format changes, the reader gets
+ * to read everything of the old one first.  Then a new epoch begins,
+ * with the format set before the epoch moves.
+ */
+void shmring_start(pcm_shmring *r, const ao_sample_format *fmt)
+{
+    shm_header *h = r->h;
+    size_t limit = ring_bytes(fmt);
+
+    if (h->rate != (uint32_t) fmt->rate || h->bits != (uint32_t) fmt->bits ||
+	h->channels != (uint32_t) fmt->channels)
+    {
+	shm_wait_read(h, 0);
+	h->rate = fmt->rate;
+	h->bits = fmt->bits;
+	h->channels = fmt->channels;
+    }
+
+    /* --ring-time bounds the latency, whatever the ring could hold */
+    if (limit < SHM_MIN_RING / 4)
+	limit = SHM_MIN_RING / 4;
+    h->limit = (uint32_t) (limit < h->size ? limit : h->size);
+
+    shm_epoch(h, false);
+}
+
+/* copy len bytes into the ring, waiting for the reader while it is full */
+void shmring_write(pcm_shmring *r, const uint_8 *data, size_t len)
+{
+    shm_header *h = r->h;
+    uint64_t pos = atomic_load(&h->write_pos);
+    size_t offset, n;
+
+    while (len > 0) {
+	shm_wait_read(h, h->limit - 1);
+
+	n = h->limit - (size_t) (pos - atomic_load(&h->read_pos));
+	offset = (size_t) (pos % h->size);
+	if (n > h->size - offset)
+	    n = h->size - offset;
+	if (n > len)
+	    n = len;
+
+	memcpy(r->ring + offset, data, n);
+	data += n;
+	len -= n;
+	atomic_store(&h->write_pos, pos += n);
+	shm_wake_reader(h);
+    }
+}
+
+/* tell the reader that nothing follows what is in the ring.  The segment
+ * stays, for the reader to finish and for the next run to take over. */
+void shmring_close(pcm_shmring *r)
+{
+    if (!r)
+	return;
+
+    atomic_store(&r->h->state, SHM_ENDED);
+    shm_wake_reader(r->h);
+    munmap(r->h, r->map_size);
+    free(r->name);
+    free(r);
+}
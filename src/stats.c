@@ -0,0 +1,159 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This stats.c module keeps the performance counters of the player and
+ *  of every --daemon session: frames decoded, decoder errors by kind,
+ *  --pcm-cache hits and misses, and how long opening files, decoding,
+ *  converting, writing to the device and seeking took, as log2
+ *  histograms.  They are printed by the STATS remote command and, with
+ *  --stats, when flac123 quits.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <time.h>
+#include "flac123.h"
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_relaxed)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+static const char *stage_names[] = { "open", "decode", "convert", "output", "seek" };
+
+/* by FLAC__StreamDecoderErrorStatus */
+static const char *error_names[STATS_ERRORS] = {
+    "lost_sync", "bad_header", "frame_crc_mismatch", "unparseable_stream", "bad_metadata"
+};
+
+FLAC__uint64 stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (FLAC__uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* nanoseconds since *since, which moves on to now */
+FLAC__uint64 stats_lap(FLAC__uint64 *since)
+{
+    FLAC__uint64 t = stats_clock(), lap = t - *since;
+
+    *since = t;
+    return lap;
+}
+
+/* every counter has one writer at a time, so plain loads and stores do,
+ * and readers on other threads see each counter whole */
+static void stats_add(_Atomic FLAC__uint64 *counter, FLAC__uint64 n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+			  memory_order_relaxed);
+}
+
+/* count something that took ns nanoseconds.  Bucket i counts what took
+ * less than 2^i microseconds and at least half that. */
+void stats_record(stats_histogram *h, FLAC__uint64 ns)
+{
+    FLAC__uint64 us = ns / 1000;
+    unsigned i = 0;
+
+    while (i < STATS_BUCKETS - 1 && us >> i)
+	i++;
+
+    stats_add(&h->count, 1);
+    stats_add(&h->total_ns, ns);
+    stats_add(&h->bucket[i], 1);
+    if (ns > LOAD(h->max_ns))
+	STORE(h->max_ns, ns);
+}
+
+/* count something that started at stats_clock() start */
+void stats_since(stats_histogram *h, FLAC__uint64 start)
+{
+    stats_record(h, stats_clock() - start);
+}
+
+void stats_frame(player_stats *s, unsigned samples)
+{
+    stats_add(&s->frames, 1);
+    stats_add(&s->samples, samples);
+}
+
+void stats_error(player_stats *s, FLAC__StreamDecoderErrorStatus status)
+{
+    if ((unsigned) status < STATS_ERRORS)
+	stats_add(&s->errors[status], 1);
+}
+
+void stats_cache(player_stats *s, FLAC__bool hit)
+{
+    stats_add(hit ? &s->cache_hits : &s->cache_misses, 1);
+}
+
+static void print_stage(FILE *out, const char *name, const stats_histogram *h, FLAC__bool json)
+{
+    FLAC__uint64 count = LOAD(h->count);
+    double avg = count ? LOAD(h->total_ns) / 1e6 / count : 0;
+    double max = LOAD(h->max_ns) / 1e6;
+    unsigned i;
+
+    if (json)
+	fprintf(out, ",\"%s\":{\"count\":%llu,\"avg_ms\":%.3f,\"max_ms\":%.3f,\"histogram\":[",
+		name, (unsigned long long) count, avg, max);
+    else
+	fprintf(out, "@T %s %llu %.3f %.3f", name, (unsigned long long) count, avg, max);
+
+    for (i = 0; i < STATS_BUCKETS; i++)
+	fprintf(out, "%s%llu", !json ? " " : i ? "," : "",
+		(unsigned long long) LOAD(h->bucket[i]));
+
+    fprintf(out, json ? "]}" : "\n");
+}
+
+/* the counters of s, as @T lines or one JSON object */
+void stats_print(FILE *out, player_stats *s, FLAC__bool json)
+{
+    const stats_histogram *stages[] = { &s->open, &s->decode, &s->convert, &s->output, &s->seek };
+    unsigned i;
+
+    if (json) {
+	fprintf(out, "{\"event\":\"stats\",\"frames\":%llu,\"samples\":%llu,\"errors\":{",
+		(unsigned long long) LOAD(s->frames), (unsigned long long) LOAD(s->samples));
+	for (i = 0; i < STATS_ERRORS; i++)
+	    fprintf(out, "%s\"%s\":%llu", i ? "," : "", error_names[i],
+		    (unsigned long long) LOAD(s->errors[i]));
+	fprintf(out, "}");
+	if (pcmcache_enabled())
+	    fprintf(out, ",\"cache\":{\"hits\":%llu,\"misses\":%llu}",
+		    (unsigned long long) LOAD(s->cache_hits),
+		    (unsigned long long) LOAD(s->cache_misses));
+    } else {
+	fprintf(out, "@T frames %llu %llu\n", (unsigned long long) LOAD(s->frames),
+		(unsigned long long) LOAD(s->samples));
+	fprintf(out, "@T errors");
+	for (i = 0; i < STATS_ERRORS; i++)
+	    fprintf(out, " %llu", (unsigned long long) LOAD(s->errors[i]));
+	fprintf(out, "\n");
+	if (pcmcache_enabled())
+	    fprintf(out, "@T cache %llu %llu\n", (unsigned long long) LOAD(s->cache_hits),
+		    (unsigned long long) LOAD(s->cache_misses));
+    }
+
+    for (i = 0; i < sizeof(stages) / sizeof(stages[0]); i++)
+	print_stage(out, stage_names[i], stages[i], json);
+
+    if (json)
+	fprintf(out, "}\n");
+}
@@ -0,0 +1,132 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This status.c module prints the status lines of remote mode, either
+ *  in mpg123's text format or as one JSON object per line, and keeps the
+ *  @F progress lines to --progress-interval.  Every session has an output
+ *  stream of its own, stdout with -R, which is fully buffered and flushed
+ *  once per turn of the session.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac123.h"
+#include "version.h"
+
+/* parse --progress-interval: milliseconds, or samples after s: */
+FLAC__bool status_parse_interval(const char *arg)
+{
+    FLAC__bool samples = false;
+    unsigned long value;
+    char *end;
+
+    if (strncasecmp(arg, "s:", 2) == 0) {
+	samples = true;
+	arg += 2;
+    }
+    if (!isdigit((unsigned char) *arg))
+	return false;
+
+    value = strtoul(arg, &end, 10);
+    if (*end != '\0')
+	return false;
+
+    cli_args.progress_ms = samples ? 0 : value;
+    cli_args.progress_samples = samples ? value : 0;
+    return true;
+}
+
+void status_ready(remote_session *s)
+{
+    if (cli_args.status_json)
+	fprintf(s->out, "{\"event\":\"ready\",\"player\":\"flac123\",\"version\":\"%s\"}\n",
+		FLAC123_VERSION);
+    else
+	fprintf(s->out, "@R FLAC123\n");
+}
+
+/* a frame of samples sample frames was decoded, and p->current_sample and
+ * p->elapsed_time already count it */
+void status_frame(const file_info_struct *p, unsigned samples)
+{
+    unsigned long remaining_samples, interval = cli_args.progress_samples;
+    float remaining_time;
+    FILE *out = p->session->out;
+
+    if (cli_args.progress_ms)
+	interval = (unsigned long) ((FLAC__uint64) cli_args.progress_ms * p->ao_fmt.rate / 1000);
+
+    /* report when a multiple of the interval is crossed, and at the end */
+    if (interval > 1 && samples < p->current_sample &&
+	(p->current_sample - samples) / interval == p->current_sample / interval &&
+	(p->total_samples == 0 || p->current_sample < p->total_samples))
+	return;
+
+    remaining_samples = p->total_samples > 0 ? p->total_samples - p->current_sample : p->current_sample;
+    if ((remaining_time = p->total_time - p->elapsed_time) < 0)
+	remaining_time = 0;
+
+    if (cli_args.status_json)
+	fprintf(out, "{\"event\":\"frame\",\"sample\":%lu,\"remaining\":%lu,"
+		"\"time\":%.2f,\"time_remaining\":%.2f}\n",
+		p->current_sample, remaining_samples, p->elapsed_time, remaining_time);
+    else
+	fprintf(out, "@F %lu %lu %.2f %.2f\n", p->current_sample, remaining_samples,
+		p->elapsed_time, remaining_time);
+}
+
+/* 0 stopped, 1 paused, 2 playing again */
+void status_state(remote_session *s, int state)
+{
+    static const char *names[] = { "stopped", "paused", "playing" };
+
+    if (cli_args.status_json)
+	fprintf(s->out, "{\"event\":\"state\",\"state\":\"%s\"}\n", names[state]);
+    else
+	fprintf(s->out, "@P %d\n", state);
+}
+
+void status_jump(remote_session *s, FLAC__uint64 sample, double ms)
+{
+    if (cli_args.status_json)
+	fprintf(s->out, "{\"event\":\"jump\",\"sample\":%llu,\"ms\":%.3f}\n",
+		(unsigned long long) sample, ms);
+    else
+	fprintf(s->out, "@J %llu %.3f\n", (unsigned long long) sample, ms);
+}
+
+void status_volume(remote_session *s, float volume)
+{
+    if (cli_args.status_json)
+	fprintf(s->out, "{\"event\":\"volume\",\"volume\":%f}\n", volume);
+    else
+	fprintf(s->out, "@V %f\n", volume);
+}
+
+/* answer to STATS: the counters of the session's player */
+void status_stats(remote_session *s)
+{
+    stats_print(s->out, s->info->stats, cli_args.status_json);
+}
+
+/* hand everything printed since the last call to the frontend at once */
+void status_flush(remote_session *s)
+{
+    fflush(s->out);
+}
@@ -0,0 +1,178 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This verify.c module implements --test: the files named on the command
+ *  line are decoded on the --jobs thread pool without any output, their
+ *  audio is compared with the MD5 signature in STREAMINFO, and every
+ *  frame that fails its CRC or cannot be decoded is reported with where
+ *  it is in the file.  With --index-db the result is remembered for the
+ *  file as it is now, and a file that has not changed since is not
+ *  decoded again.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "flac123.h"
+
+typedef struct {
+    const char *path;
+    int result;              /* VERIFY_xxx, VERIFY_NONE if it could not be read */
+    unsigned errors;
+    FLAC__uint64 samples;
+    FLAC__bool cached;       /* from the index db, not decoded */
+} verify_job;
+
+static const char *result_names[] = {
+    "unreadable", "ok", "errors", "md5 mismatch", "truncated"
+};
+
+static atomic_uint tested, cached, failed;
+
+static void verify_print(const verify_job *job)
+{
+    flockfile(stdout);
+    printf("{\"path\":");
+    json_string(stdout, job->path);
+    printf(",\"result\":\"%s\"", result_names[job->result]);
+    if (job->cached)
+	printf(",\"cached\":true");
+    else if (job->result != VERIFY_NONE)
+	printf(",\"samples\":%llu,\"errors\":%u", (unsigned long long) job->samples, job->errors);
+    printf("}\n");
+    funlockfile(stdout);
+}
+
+/* the sample_fn of --test: decoding them was the test */
+static FLAC__bool verify_frame(file_info_struct *p, const FLAC__int32 * const buf[],
+			       unsigned samples)
+{
+    return true;
+}
+
+static void verify_job_run(void *arg)
+{
+    verify_job *job = (verify_job *) arg;
+    file_info_struct *p;
+    FLAC__bool ok;
+
+    if (!(p = calloc(1, sizeof(file_info_struct))))
+	goto done;
+
+    /* a file the index db knows like this has been tested before */
+    if (index_lookup(p, job->path) && p->verified != VERIFY_NONE) {
+	job->result = p->verified;
+	job->cached = true;
+	frames_free(&p->frames);
+	free(p);
+	goto done;
+    }
+
+    p->testing = true;
+    p->sample_fn = verify_frame;
+    if (!decoder_open(p, job->path)) {
+	fprintf(stderr, "Error opening %s\n", job->path);
+	free(p);
+	goto done;
+    }
+
+    while ((ok = FLAC__stream_decoder_process_single(p->decoder)) &&
+	   FLAC__stream_decoder_get_state(p->decoder) < FLAC__STREAM_DECODER_END_OF_STREAM)
+    {
+    }
+
+    /* finishing compares the MD5 of the decoded audio with STREAMINFO */
+    if (!ok || p->errors)
+	job->result = VERIFY_ERRORS;
+    else if (!FLAC__stream_decoder_finish(p->decoder))
+	job->result = VERIFY_MD5;
+    else if (p->total_samples && p->current_sample != p->total_samples)
+	job->result = VERIFY_TRUNCATED;
+    else
+	job->result = VERIFY_OK;
+
+    if (!ok)
+	fprintf(stderr, "Error decoding %s: %s\n", job->path,
+		FLAC__stream_decoder_get_resolved_state_string(p->decoder));
+    job->errors = p->errors;
+    job->samples = p->current_sample;
+
+    /* decoder_close() stores it in the index db */
+    p->verified = job->result;
+    p->frames.dirty = true;
+    decoder_close(p);
+    free(p->aobuf);
+    free(p->noise);
+    free(p);
+
+done:
+    atomic_fetch_add(&tested, 1);
+    if (job->cached)
+	atomic_fetch_add(&cached, 1);
+    if (job->result != VERIFY_OK)
+	atomic_fetch_add(&failed, 1);
+    verify_print(job);
+}
+
+/* test files[] and print the results, returns the number of failures */
+int verify_run(const char **files, unsigned count)
+{
+    verify_job *jobs;
+    thread_pool *pool;
+    unsigned threads = cli_args.jobs > 0 ? (unsigned) cli_args.jobs : pool_cpus();
+    struct timespec start, end;
+    unsigned i;
+
+    if (count == 0)
+	return 0;
+
+    if (!(jobs = calloc(count, sizeof(verify_job)))) {
+	fprintf(stderr, "Out of memory\n");
+	return count;
+    }
+
+    if (threads > count)
+	threads = count;
+    if (!(pool = pool_new(threads))) {
+	fprintf(stderr, "Error starting decoder threads\n");
+	threads = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+	jobs[i].path = files[i];
+	if (pool)
+	    pool_submit(pool, verify_job_run, &jobs[i]);
+	else
+	    verify_job_run(&jobs[i]);
+    }
+    if (pool) {
+	pool_wait(pool);
+	pool_free(pool);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!cli_args.quiet)
+	fprintf(stderr, "Tested %u files (%u known from the index db) on %u threads in %.2f "
+		"seconds, %u failed\n", atomic_load(&tested), atomic_load(&cached),
+		threads ? threads : 1, (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9, atomic_load(&failed));
+
+    free(jobs);
+    return atomic_load(&failed);
+}
@@ -55,7 +55,77 @@ static void local__vcentry_parse_value(const FLAC__StreamMetadata_VorbisComment_
     }
 }
 
-FLAC__bool get_vorbis_comments(const char *filename)
+/* parse a numeric entry such as "-6.20 dB" or "0.988" */
+static float local__vcentry_parse_float(const FLAC__StreamMetadata_VorbisComment_Entry *entry)
+{
+    char value[VORBIS_TAG_LEN+1];
+
+    local__vcentry_parse_value(entry, value, VORBIS_TAG_LEN);
+    return (float) atof(value);
+}
+
+/* take title, artist etc. and the ReplayGain tags from vc, true if it
+ * has any tags to show */
+FLAC__bool vorbis_comment_parse(file_info_struct *p, const FLAC__StreamMetadata_VorbisComment *vc)
+{
+    FLAC__bool got = false;
+    int i;
+
+    for(i = 0; i < vc->num_comments; i++) {
+	if(local__vcentry_matches("artist", &vc->comments[i]))
+	{
+	    local__vcentry_parse_value(&vc->comments[i], p->artist, VORBIS_TAG_LEN);
+	    got = true;
+	}
+	else if(local__vcentry_matches("album", &vc->comments[i]))
+	{
+	    local__vcentry_parse_value(&vc->comments[i], p->album, VORBIS_TAG_LEN);
+	    got = true;
+	}
+	else if(local__vcentry_matches("title", &vc->comments[i]))
+	{
+	    local__vcentry_parse_value(&vc->comments[i], p->title, VORBIS_TAG_LEN);
+	    got = true;
+	}
+	else if(local__vcentry_matches("genre", &vc->comments[i]))
+	{
+	    local__vcentry_parse_value(&vc->comments[i], p->genre, VORBIS_TAG_LEN);
+	    got = true;
+	}
+	else if(local__vcentry_matches("description", &vc->comments[i]))
+	{
+	    local__vcentry_parse_value(&vc->comments[i], p->comment, VORBIS_TAG_LEN);
+	    got = true;
+	}
+	else if(local__vcentry_matches("date", &vc->comments[i]))
+	{
+	    local__vcentry_parse_value(&vc->comments[i], p->year, VORBIS_YEAR_LEN);
+	    got = true;
+	}
+	/* ReplayGain alone does not count as tags to show */
+	else if(local__vcentry_matches("replaygain_track_gain", &vc->comments[i]))
+	{
+	    p->track_gain = local__vcentry_parse_float(&vc->comments[i]);
+	    p->has_track_gain = true;
+	}
+	else if(local__vcentry_matches("replaygain_track_peak", &vc->comments[i]))
+	{
+	    p->track_peak = local__vcentry_parse_float(&vc->comments[i]);
+	}
+	else if(local__vcentry_matches("replaygain_album_gain", &vc->comments[i]))
+	{
+	    p->album_gain = local__vcentry_parse_float(&vc->comments[i]);
+	    p->has_album_gain = true;
+	}
+	else if(local__vcentry_matches("replaygain_album_peak", &vc->comments[i]))
+	{
+	    p->album_peak = local__vcentry_parse_float(&vc->comments[i]);
+	}
+    }
+    return got;
+}
+
+FLAC__bool get_vorbis_comments(file_info_struct *p, const char *filename)
 {
     FLAC__Metadata_SimpleIterator *iterator = FLAC__metadata_simple_iterator_new();
     FLAC__bool got_vorbis_comments = false;
@@ -66,40 +136,7 @@ FLAC__bool get_vorbis_comments(const char *filename)
 		if(FLAC__metadata_simple_iterator_get_block_type(iterator) == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
 		    FLAC__StreamMetadata *block = FLAC__metadata_simple_iterator_get_block(iterator);
 		    if(0 != block) {
-			int i;
-			const FLAC__StreamMetadata_VorbisComment *vc = &block->data.vorbis_comment;
-			for(i = 0; i < vc->num_comments; i++) {
-			    if(local__vcentry_matches("artist", &vc->comments[i]))
-			    {
-				local__vcentry_parse_value(&vc->comments[i], file_info.artist, VORBIS_TAG_LEN);
-				got_vorbis_comments = true;
-			    }
-			    else if(local__vcentry_matches("album", &vc->comments[i]))
-			    {
-				local__vcentry_parse_value(&vc->comments[i], file_info.album, VORBIS_TAG_LEN);
-				got_vorbis_comments = true;
-			    }
-			    else if(local__vcentry_matches("title", &vc->comments[i]))
-			    {
-				local__vcentry_parse_value(&vc->comments[i], file_info.title, VORBIS_TAG_LEN);
-				got_vorbis_comments = true;
-			    }
-			    else if(local__vcentry_matches("genre", &vc->comments[i]))
-			    {
-				local__vcentry_parse_value(&vc->comments[i], file_info.genre, VORBIS_TAG_LEN);
-				got_vorbis_comments = true;
-			    }
-			    else if(local__vcentry_matches("description", &vc->comments[i]))
-			    {
-				local__vcentry_parse_value(&vc->comments[i], file_info.comment, VORBIS_TAG_LEN);
-				got_vorbis_comments = true;
-			    }
-			    else if(local__vcentry_matches("date", &vc->comments[i]))
-			    {
-				local__vcentry_parse_value(&vc->comments[i], file_info.year, VORBIS_YEAR_LEN);
-				got_vorbis_comments = true;
-			    }
-			}
+			got_vorbis_comments = vorbis_comment_parse(p, &block->data.vorbis_comment);
 			FLAC__metadata_object_delete(block);
 		    }
 		}
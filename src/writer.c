@@ -0,0 +1,381 @@
+/*
+ *  flac123 a command-line flac player
+ *  Copyright (C) 2003-2023  Jake Angerman
+ *
+ *  This writer.c module writes --wav and --outdir output itself instead
+ *  of through libao's file drivers: WAV, RF64 for more than 4 GB, or raw
+ *  PCM, to a file, stdout or an inherited descriptor.  The PCM is
+ *  collected into large page aligned buffers, which are write()n whole
+ *  at offsets that are multiples of the buffer size, or vmsplice()d into
+ *  a pipe without being copied.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE          /* vmsplice() and F_SETPIPE_SZ */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "flac123.h"
+
+/* bytes collected before they are written */
+#define WRITER_BUFFER (1 << 20)
+
+/* what a pipe is asked to hold, see writer_flush() */
+#define WRITER_PIPE_SIZE (1 << 20)
+
+/* header space: RIFF and WAVE, JUNK or ds64, fmt (extensible), data */
+#define WAV_HEADER_MAX (12 + 36 + 48 + 8)
+
+#define WAV_UNKNOWN 0xFFFFFFFF
+
+struct pcm_writer {
+    int fd;
+    FLAC__bool own_fd;       /* opened here, so closed here */
+    FLAC__bool seekable;     /* the header is rewritten at the end */
+    FLAC__bool pipe;         /* the buffers are vmsplice()d */
+    FLAC__bool failed;       /* an error has been reported */
+    FLAC__bool convert;      /* unsigned 8 bit, or little endian */
+    int type;                /* WRITER_xxx */
+    char *name;
+    ao_sample_format fmt;
+    off_t header_at;
+    unsigned header_len;
+    FLAC__uint64 data_len;   /* PCM bytes, without the header */
+    uint_8 *buf;             /* two halves of size bytes for a pipe */
+    size_t size;
+    size_t used;
+    unsigned half;           /* the one being filled */
+};
+
+static FLAC__bool big_endian(void)
+{
+    const uint_16 one = 1;
+
+    return *(const uint_8 *) &one == 0;
+}
+
+static void put16(uint_8 *p, unsigned v)
+{
+    p[0] = (uint_8) v;
+    p[1] = (uint_8) (v >> 8);
+}
+
+static void put32(uint_8 *p, uint_32 v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+static void put64(uint_8 *p, FLAC__uint64 v)
+{
+    put32(p, (uint_32) v);
+    put32(p + 4, (uint_32) (v >> 32));
+}
+
+/* where FLAC puts 1 to 8 channels, as a WAVE_FORMAT_EXTENSIBLE mask */
+static uint_32 channel_mask(int channels)
+{
+    static const uint_32 masks[] = {
+	0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x70F, 0x63F
+    };
+
+    return channels >= 1 && channels <= 8 ? masks[channels - 1] : 0;
+}
+
+/*
+ * Lay out the header for data_len bytes of PCM into h.  A WAV file keeps
+ * a JUNK chunk the size of a ds64 chunk, so that it can still be turned
+ * into RF64 in place when it outgrows 4 GB.  Unknown sizes (sizes of a
+ * stream that cannot be rewound) are all ones.  Returns the length,
+ * which is the same for every data_len.
+ */
+static unsigned wav_header(const pcm_writer *w, uint_8 *h, FLAC__bool known)
+{
+    unsigned bytes = (w->fmt.bits + 7) / 8, block = bytes * w->fmt.channels;
+    FLAC__bool extensible = w->fmt.channels > 2 || w->fmt.bits > 16;
+    unsigned fmt_len = extensible ? 40 : 16;
+    unsigned len = 12 + 36 + 8 + fmt_len + 8;
+    FLAC__uint64 riff = len - 8 + w->data_len + (w->data_len & 1);
+    FLAC__bool rf64 = w->type == WRITER_RF64 || riff > 0xFFFFFFFF;
+    static const uint_8 pcm_guid[16] = {
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+	0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+    };
+
+    memset(h, 0, len);
+    memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+    put32(h + 4, rf64 || !known ? WAV_UNKNOWN : (uint_32) riff);
+    memcpy(h + 8, "WAVE", 4);
+
+    memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+    put32(h + 16, 28);
+    if (rf64) {
+	put64(h + 20, known ? riff : (FLAC__uint64) -1);
+	put64(h + 28, known ? w->data_len : (FLAC__uint64) -1);
+	put64(h + 36, known ? w->data_len / block : (FLAC__uint64) -1);
+    }
+
+    h += 48;
+    memcpy(h, "fmt ", 4);
+    put32(h + 4, fmt_len);
+    put16(h + 8, extensible ? 0xFFFE : 1);
+    put16(h + 10, w->fmt.channels);
+    put32(h + 12, w->fmt.rate);
+    put32(h + 16, w->fmt.rate * block);
+    put16(h + 20, block);
+    put16(h + 22, bytes * 8);
+    if (extensible) {
+	put16(h + 24, 22);
+	put16(h + 26, w->fmt.bits);
+	put32(h + 28, channel_mask(w->fmt.channels));
+	memcpy(h + 32, pcm_guid, 16);
+    }
+
+    h += 8 + fmt_len;
+    memcpy(h, "data", 4);
+    put32(h + 4, rf64 || !known ? WAV_UNKNOWN : (uint_32) w->data_len);
+
+    return len;
+}
+
+static void writer_error(pcm_writer *w, const char *what)
+{
+    if (!w->failed)
+	fprintf(stderr, "Error %s %s: %s\n", what, w->name, strerror(errno));
+    w->failed = true;
+}
+
+static FLAC__bool write_all(pcm_writer *w, const uint_8 *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = write(w->fd, data, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    writer_error(w, "writing");
+	    return false;
+	}
+	data += n;
+	len -= n;
+    }
+    return true;
+}
+
+/*
+ * Write out the buffer being filled.  Into a pipe it is vmsplice()d, so
+ * the pipe refers to its pages instead of a copy of them.  They must not
+ * be filled again before the reader has had them, which is why there are
+ * two halves of at least the pipe's size: once all of one half is in the
+ * pipe, nothing of the other can be left in it.
+ */
+static FLAC__bool writer_flush(pcm_writer *w)
+{
+    uint_8 *data = w->buf + w->half * w->size;
+    size_t len = w->used;
+#ifdef SPLICE_F_GIFT
+    struct iovec iov;
+    ssize_t n;
+
+    while (w->pipe && len > 0) {
+	iov.iov_base = data;
+	iov.iov_len = len;
+	if ((n = vmsplice(w->fd, &iov, 1, 0)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EINVAL && errno != ENOSYS) {
+		writer_error(w, "writing");
+		return false;
+	    }
+	    w->pipe = false; /* write() the rest */
+	    break;
+	}
+	data += n;
+	len -= n;
+    }
+    if (w->pipe) {
+	w->half ^= 1;
+	w->used = 0;
+	return true;
+    }
+#endif
+
+    w->used = 0;
+    return write_all(w, data, len);
+}
+
+/* copy len bytes of native PCM into the buffer as the file wants them */
+static void writer_copy(pcm_writer *w, uint_8 *out, const uint_8 *in, size_t len)
+{
+    unsigned bytes = w->fmt.bits / 8, i;
+    size_t j;
+
+    if (!w->convert) {
+	memcpy(out, in, len);
+    } else if (bytes == 1) {
+	/* 8 bit WAV is unsigned */
+	for (j = 0; j < len; j++)
+	    out[j] = in[j] ^ 0x80;
+    } else {
+	for (j = 0; j + bytes <= len; j += bytes)
+	    for (i = 0; i < bytes; i++)
+		out[j + i] = in[j + bytes - 1 - i];
+    }
+}
+
+/* what --raw and --rf64 ask for */
+int writer_type(void)
+{
+    return cli_args.raw ? WRITER_RAW : cli_args.rf64 ? WRITER_RF64 : WRITER_WAV;
+}
+
+/* open target, a path, - for stdout or fd:N for an inherited descriptor,
+ * for PCM of fmt.  NULL after an error has been printed. */
+pcm_writer *writer_open(const char *target, int type, const ao_sample_format *fmt)
+{
+    pcm_writer *w = calloc(1, sizeof(pcm_writer));
+    struct stat st;
+    char *end;
+    long pipe_size;
+    void *buf = NULL;
+
+    if (!w || !(w->name = strdup(target))) {
+	fprintf(stderr, "Out of memory\n");
+	free(w);
+	return NULL;
+    }
+    w->type = type;
+    w->fmt = *fmt;
+    w->convert = type != WRITER_RAW && (fmt->bits == 8 || big_endian());
+
+    if (strcmp(target, "-") == 0) {
+	w->fd = STDOUT_FILENO;
+    } else if (strncmp(target, "fd:", 3) == 0) {
+	w->fd = (int) strtol(target + 3, &end, 10);
+	if (end == target + 3 || *end != '\0' || fcntl(w->fd, F_GETFL) < 0) {
+	    fprintf(stderr, "%s is not an open file descriptor\n", target);
+	    free(w->name);
+	    free(w);
+	    return NULL;
+	}
+    } else if ((w->fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0) {
+	w->own_fd = true;
+    } else {
+	writer_error(w, "opening");
+	free(w->name);
+	free(w);
+	return NULL;
+    }
+
+    w->size = WRITER_BUFFER;
+    if (fstat(w->fd, &st) == 0 && S_ISREG(st.st_mode))
+	w->seekable = (w->header_at = lseek(w->fd, 0, SEEK_CUR)) >= 0;
+#ifdef F_SETPIPE_SZ
+    if (fstat(w->fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+	fcntl(w->fd, F_SETPIPE_SZ, WRITER_PIPE_SIZE);
+	if ((pipe_size = fcntl(w->fd, F_GETPIPE_SZ)) > 0) {
+	    w->pipe = true;
+	    if ((size_t) pipe_size > w->size)
+		w->size = pipe_size;
+	}
+    }
+#else
+    (void) pipe_size;
+#endif
+
+    if (posix_memalign(&buf, 4096, (w->pipe ? 2 : 1) * w->size) != 0) {
+	fprintf(stderr, "Out of memory\n");
+	w->failed = true;
+	writer_close(w);
+	return NULL;
+    }
+    w->buf = buf;
+    realtime_prefault(w->buf, (w->pipe ? 2 : 1) * w->size);
+
+    /* the header goes out with the first buffer */
+    if (type != WRITER_RAW)
+	w->header_len = w->used = wav_header(w, w->buf, false);
+
+    return w;
+}
+
+/* queue len bytes of PCM, false after an error */
+FLAC__bool writer_write(pcm_writer *w, const uint_8 *data, size_t len)
+{
+    size_t n, unit = w->convert ? w->fmt.bits / 8 : 1;
+
+    if (w->failed)
+	return false;
+
+    w->data_len += len;
+    while (len > 0) {
+	/* whole buffers are written straight from data */
+	if (w->used == 0 && !w->pipe && !w->convert && len >= w->size) {
+	    n = len - len % w->size;
+	    if (!write_all(w, data, n))
+		return false;
+	} else {
+	    n = w->size - w->used < len ? w->size - w->used : len;
+	    n -= n % unit; /* samples are byte swapped whole */
+	    writer_copy(w, w->buf + w->half * w->size + w->used, data, n);
+	    if ((w->used += n) > w->size - unit && !writer_flush(w))
+		return false;
+	}
+	data += n;
+	len -= n;
+    }
+
+    return true;
+}
+
+/* write out the rest and the final header, and free w.  False if any of
+ * the output could not be written. */
+FLAC__bool writer_close(pcm_writer *w)
+{
+    uint_8 header[WAV_HEADER_MAX], pad = 0;
+    FLAC__bool ok = !w->failed;
+
+    if (ok && w->buf) {
+	/* a chunk of odd length is padded */
+	if (w->type != WRITER_RAW && (w->data_len & 1))
+	    w->buf[w->half * w->size + w->used++] = pad;
+	ok = writer_flush(w);
+    }
+
+    if (ok && w->seekable && w->type != WRITER_RAW &&
+	pwrite(w->fd, header, wav_header(w, header, true), w->header_at) != w->header_len)
+    {
+	writer_error(w, "writing");
+	ok = false;
+    }
+
+    if (w->own_fd && close(w->fd) != 0 && ok) {
+	writer_error(w, "closing");
+	ok = false;
+    }
+
+    free(w->buf);
+    free(w->name);
+    free(w);
+    return ok;
+}